@@ -109,22 +109,41 @@ int64_t main(int argc, char* argv[])
 	int64_t userExitCode;
 	printIntro();
 
+	initStack(&vm); // before initVM(), which already pushes while interning
 	initVM(&vm);
-	initStack(&vm);
 	initNativeFunctions();
 
-	if (argc == 1)
+	// options
+	int argi = 1;
+	if (argi < argc && strcmp(argv[argi], "--register") == 0)
+	{
+		vm.engine = ENGINE_REGISTER;
+		++argi;
+	}
+	if (argi + 1 < argc && strcmp(argv[argi], "--max-frames") == 0)
+	{
+		long long framesMax = strtoll(argv[argi + 1], NULL, 10);
+		if (framesMax <= 0 || framesMax > UINT32_MAX)
+		{
+			fprintf(stderr, "--max-frames needs a positive number, got <%s>\n", argv[argi + 1]);
+			return 64;
+		}
+		vm.framesMax = (uint32_t)framesMax;
+		argi += 2;
+	}
+
+	if (argi == argc)
 	{
 		userExitCode = repl(&vm);
 	}
-	else if (argc == 2)
+	else if (argi + 1 == argc)
 	{
-		printf("Running file <%s>\r\n\n", argv[1]);
-		userExitCode = runFile(argv[1]);
+		printf("Running file <%s>\r\n\n", argv[argi]);
+		userExitCode = runFile(argv[argi]);
 	}
 	else
 	{
-		fprintf(stderr, "Usage: clox [path]\n");
+		fprintf(stderr, "Usage: clox [--register] [--max-frames n] [path]\n");
 		return 64;
 	}
 
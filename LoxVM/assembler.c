@@ -0,0 +1,345 @@
+#include <string.h>
+
+#include "assembler.h"
+
+#ifdef JIT_X64
+
+#include "memory.h"
+#include "object.h"
+#include "platform.h"
+#include "vm.h"
+
+// callee-saved in either calling convention (rsi and rdi only on windows)
+static const Register savedRegisters[] = { RBX, RBP, R12, R13, R14, R15, RSI, RDI };
+
+// shadow space for windows callees, plus 8 so that calls see a 16-byte aligned stack
+// after the return address and eight pushes.
+#define FRAME_SIZE 40
+
+void initAssembler(Assembler* a)
+{
+	a->code = NULL;
+	a->count = 0;
+	a->capacity = 0;
+	a->fixups = NULL;
+	a->fixupCount = 0;
+	a->fixupCapacity = 0;
+	a->exitStub = 0;
+}
+
+void freeAssembler(Assembler* a)
+{
+	FREE_ARRAY(uint8_t, a->code, a->capacity);
+	FREE_ARRAY(Fixup, a->fixups, a->fixupCapacity);
+	initAssembler(a);
+}
+
+uint8_t* finishAssembler(Assembler* a, size_t* size)
+{
+	*size = a->count;
+	uint8_t* code = (uint8_t*)allocateExecutable(a->count);
+	memcpy(code, a->code, a->count);
+	makeExecutable(code, a->count);
+	return code;
+}
+
+void emitByte(Assembler* a, uint8_t byte)
+{
+	if (a->capacity < a->count + 1)
+	{
+		uint32_t oldCapacity = a->capacity;
+		a->capacity = GROW_CAPACITY(oldCapacity);
+		a->code = GROW_ARRAY(uint8_t, a->code, oldCapacity, a->capacity);
+	}
+	a->code[a->count++] = byte;
+}
+
+void emit32(Assembler* a, uint32_t value)
+{
+	for (uint32_t i = 0; i < 4; ++i)
+		emitByte(a, (uint8_t)(value >> (i * 8)));
+}
+
+void emit64(Assembler* a, uint64_t value)
+{
+	for (uint32_t i = 0; i < 8; ++i)
+		emitByte(a, (uint8_t)(value >> (i * 8)));
+}
+
+static void patch32(Assembler* a, uint32_t at, uint32_t value)
+{
+	for (uint32_t i = 0; i < 4; ++i)
+		a->code[at + i] = (uint8_t)(value >> (i * 8));
+}
+
+void addFixup(Assembler* a, uint32_t at, uint32_t target, bool isExit)
+{
+	if (a->fixupCapacity < a->fixupCount + 1)
+	{
+		uint32_t oldCapacity = a->fixupCapacity;
+		a->fixupCapacity = GROW_CAPACITY(oldCapacity);
+		a->fixups = GROW_ARRAY(Fixup, a->fixups, oldCapacity, a->fixupCapacity);
+	}
+	a->fixups[a->fixupCount++] = (Fixup){ at, target, isExit };
+}
+
+/// <summary>
+/// REX prefix for 64-bit operands, with the high bits of ModRM's 'reg' and 'rm'.
+/// </summary>
+static void emitRex(Assembler* a, Register reg, Register rm)
+{
+	emitByte(a, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+/// <summary>
+/// REX prefix for SSE instructions, left out when it would be empty.
+/// </summary>
+static void emitRexIfNeeded(Assembler* a, uint8_t reg, uint8_t rm)
+{
+	if (reg >= 8 || rm >= 8)
+		emitByte(a, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+void emitRegisters(Assembler* a, uint8_t opcode, Register reg, Register rm)
+{
+	emitRex(a, reg, rm);
+	emitByte(a, opcode);
+	emitByte(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void emitMemory(Assembler* a, uint8_t opcode, Register reg, Register base, int32_t displacement)
+{
+	emitRex(a, reg, base);
+	emitByte(a, opcode);
+	emitByte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+	emit32(a, (uint32_t)displacement);
+}
+
+void emitLoad(Assembler* a, Register destination, Register base, int32_t displacement)
+{
+	emitMemory(a, X64_LOAD, destination, base, displacement);
+}
+
+void emitStore(Assembler* a, Register base, int32_t displacement, Register source)
+{
+	emitMemory(a, X64_STORE, source, base, displacement);
+}
+
+void emitMove(Assembler* a, Register destination, Register source)
+{
+	emitRegisters(a, X64_STORE, source, destination);
+}
+
+void emitImmediate(Assembler* a, Register destination, uint64_t value)
+{
+	emitRex(a, RAX, destination);
+	emitByte(a, 0xb8 + (destination & 7));
+	emit64(a, value);
+}
+
+void emitAddImmediate(Assembler* a, Register destination, int32_t value, bool isSubtract)
+{
+	emitRex(a, RAX, destination);
+	emitByte(a, 0x81);
+	emitByte(a, (isSubtract ? 0xe8 : 0xc0) | (destination & 7));
+	emit32(a, (uint32_t)value);
+}
+
+void emitCompareImmediate(Assembler* a, Register left, int8_t value)
+{
+	emitRex(a, RAX, left);
+	emitByte(a, 0x83);
+	emitByte(a, 0xf8 | (left & 7));
+	emitByte(a, (uint8_t)value);
+}
+
+void emitConditionalMove(Assembler* a, Condition condition, Register destination, Register source)
+{
+	emitRex(a, destination, source);
+	emitByte(a, 0x0f);
+	emitByte(a, 0x40 + condition);
+	emitByte(a, 0xc0 | ((destination & 7) << 3) | (source & 7));
+}
+
+void emitCall(Assembler* a, void* function)
+{
+	emitImmediate(a, RAX, (uint64_t)(uintptr_t)function);
+	emitCallRegister(a, RAX);
+}
+
+void emitCallRegister(Assembler* a, Register function)
+{
+	if (function >= R8) emitByte(a, 0x41);
+	emitByte(a, 0xff);
+	emitByte(a, 0xd0 | (function & 7));
+}
+
+void emitCompareMemory(Assembler* a, Register base, int32_t displacement, uint32_t value)
+{
+	if (base >= R8) emitByte(a, 0x41);
+	emitByte(a, 0x81);
+	emitByte(a, 0x80 | (7 << 3) | (base & 7));
+	emit32(a, (uint32_t)displacement);
+	emit32(a, value);
+}
+
+void emitCompareObjectType(Assembler* a, Register base, uint32_t type)
+{
+	emitCompareMemory(a, base, (int32_t)offsetof(Object, type), type);
+}
+
+static void emitPushRegister(Assembler* a, Register reg)
+{
+	if (reg >= R8) emitByte(a, 0x41);
+	emitByte(a, 0x50 + (reg & 7));
+}
+
+static void emitPopRegister(Assembler* a, Register reg)
+{
+	if (reg >= R8) emitByte(a, 0x41);
+	emitByte(a, 0x58 + (reg & 7));
+}
+
+void emitToDouble(Assembler* a, uint8_t xmm, Register source)
+{
+	emitByte(a, 0x66);
+	emitRex(a, (Register)xmm, source);
+	emitByte(a, 0x0f);
+	emitByte(a, 0x6e);
+	emitByte(a, 0xc0 | ((xmm & 7) << 3) | (source & 7));
+}
+
+void emitFromDouble(Assembler* a, Register destination, uint8_t xmm)
+{
+	emitByte(a, 0x66);
+	emitRex(a, (Register)xmm, destination);
+	emitByte(a, 0x0f);
+	emitByte(a, 0x7e);
+	emitByte(a, 0xc0 | ((xmm & 7) << 3) | (destination & 7));
+}
+
+/// <summary>
+/// SSE instruction with 'xmm' in ModRM.reg and [base + displacement] in ModRM.rm.
+/// </summary>
+static void emitMemoryDouble(Assembler* a, uint8_t prefix, uint8_t opcode, uint8_t xmm,
+	Register base, int32_t displacement)
+{
+	emitByte(a, prefix);
+	emitRexIfNeeded(a, xmm, base);
+	emitByte(a, 0x0f);
+	emitByte(a, opcode);
+	emitByte(a, 0x80 | ((xmm & 7) << 3) | (base & 7));
+	emit32(a, (uint32_t)displacement);
+}
+
+/// <summary>
+/// SSE instruction between two xmm registers.
+/// </summary>
+static void emitRegistersDouble(Assembler* a, uint8_t prefix, uint8_t opcode, uint8_t reg, uint8_t rm)
+{
+	emitByte(a, prefix);
+	emitRexIfNeeded(a, reg, rm);
+	emitByte(a, 0x0f);
+	emitByte(a, opcode);
+	emitByte(a, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void emitLoadDouble(Assembler* a, uint8_t xmm, Register base, int32_t displacement)
+{
+	emitMemoryDouble(a, 0xf2, 0x10, xmm, base, displacement); // movsd
+}
+
+void emitStoreDouble(Assembler* a, Register base, int32_t displacement, uint8_t xmm)
+{
+	emitMemoryDouble(a, 0xf2, 0x11, xmm, base, displacement); // movsd
+}
+
+void emitMoveDouble(Assembler* a, uint8_t destination, uint8_t source)
+{
+	emitRegistersDouble(a, 0x66, 0x28, destination, source); // movapd
+}
+
+void emitArithmeticDouble(Assembler* a, uint8_t opcode, uint8_t destination, uint8_t source)
+{
+	emitRegistersDouble(a, 0xf2, opcode, destination, source);
+}
+
+void emitCompareDoubles(Assembler* a, uint8_t left, uint8_t right)
+{
+	emitRegistersDouble(a, 0x66, 0x2e, left, right); // ucomisd
+}
+
+void emitIntToDouble(Assembler* a, Register value, uint8_t xmm)
+{
+	// the tag is the whole upper half of a small integer
+	emitMove(a, RDX, value);
+	emitRex(a, RAX, RDX);
+	emitByte(a, 0xc1); // shr rdx, 32
+	emitByte(a, 0xe8 | (RDX & 7));
+	emitByte(a, 32);
+	emitByte(a, 0x81); // cmp edx, imm32
+	emitByte(a, 0xf8 | (RDX & 7));
+	emit32(a, (uint32_t)((QNAN | TAG_INT) >> 32));
+	uint32_t skip = emitJump(a, CONDITION_NOT_EQUAL);
+
+	emitRegistersDouble(a, 0xf2, 0x2a, xmm, (uint8_t)value); // cvtsi2sd xmm, r32
+	emitFromDouble(a, value, xmm);
+	patchJump(a, skip, a->count);
+}
+
+uint32_t emitJump(Assembler* a, Condition condition)
+{
+	if (condition == CONDITION_ALWAYS)
+	{
+		emitByte(a, 0xe9);
+	}
+	else
+	{
+		emitByte(a, 0x0f);
+		emitByte(a, 0x80 + condition);
+	}
+	emit32(a, 0);
+	return a->count - 4;
+}
+
+void patchJump(Assembler* a, uint32_t at, uint32_t destination)
+{
+	patch32(a, at, destination - (at + 4));
+}
+
+void emitExit(Assembler* a, uint8_t* ip)
+{
+	emitImmediate(a, RAX, (uint64_t)(uintptr_t)ip);
+	patchJump(a, emitJump(a, CONDITION_ALWAYS), a->exitStub);
+}
+
+void emitEntryStub(Assembler* a)
+{
+	for (uint32_t i = 0; i < sizeof(savedRegisters) / sizeof(Register); ++i)
+		emitPushRegister(a, savedRegisters[i]);
+	emitAddImmediate(a, RSP, FRAME_SIZE, true);
+
+	emitMove(a, SP, ARGUMENT_2);
+	emitMove(a, SLOTS, ARGUMENT_1);
+	emitMove(a, CLOSURE, ARGUMENT_3);
+	emitImmediate(a, QNAN_BITS, QNAN);
+
+	// jmp target
+	if (ARGUMENT_0 >= R8) emitByte(a, 0x41);
+	emitByte(a, 0xff);
+	emitByte(a, 0xe0 | (ARGUMENT_0 & 7));
+}
+
+void emitExitStub(Assembler* a)
+{
+	a->exitStub = a->count;
+	emitImmediate(a, RCX, (uint64_t)(uintptr_t)&vm.sp);
+	emitStore(a, RCX, 0, SP);
+
+	emitAddImmediate(a, RSP, FRAME_SIZE, false);
+	for (uint32_t i = sizeof(savedRegisters) / sizeof(Register); i > 0; --i)
+		emitPopRegister(a, savedRegisters[i - 1]);
+	emitByte(a, 0xc3); // ret
+}
+
+#endif
@@ -0,0 +1,207 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+
+#ifdef JIT_X64
+
+// x86-64 register numbers. the low three bits go in ModRM, the fourth in REX.
+typedef enum
+{
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15,
+} Register;
+
+// interpreter registers, held in callee-saved registers for the life of the code.
+// none of them is rsp or r12, which would need a SIB byte as a memory base.
+#define SP RBX
+#define SLOTS R14
+#define CLOSURE R15
+#define QNAN_BITS R12 // QNAN, for number guards
+
+#ifdef _WIN64
+#define ARGUMENT_0 RCX
+#define ARGUMENT_1 RDX
+#define ARGUMENT_2 R8
+#define ARGUMENT_3 R9
+#else
+#define ARGUMENT_0 RDI
+#define ARGUMENT_1 RSI
+#define ARGUMENT_2 RDX
+#define ARGUMENT_3 RCX
+#endif
+
+// condition codes, as added to the jcc and cmovcc opcodes
+typedef enum
+{
+	CONDITION_EQUAL = 0x4,
+	CONDITION_NOT_EQUAL = 0x5,
+	CONDITION_BELOW_EQUAL = 0x6,
+	CONDITION_ABOVE = 0x7,
+	CONDITION_ALWAYS = 0x10,
+} Condition;
+
+// 64-bit ALU opcodes in 'rm op= reg' form
+#define X64_ADD 0x01
+#define X64_OR 0x09
+#define X64_AND 0x21
+#define X64_SUB 0x29
+#define X64_XOR 0x31
+#define X64_CMP 0x39
+#define X64_STORE 0x89 // mov rm, reg
+#define X64_LOAD 0x8b // mov reg, rm
+
+// scalar double opcodes, 'xmm op= xmm'
+#define SSE_ADD 0x58
+#define SSE_MULTIPLY 0x59
+#define SSE_SUBTRACT 0x5c
+#define SSE_DIVIDE 0x5e
+
+typedef struct
+{
+	/// <summary>
+	/// Offset of the rel32 to fill in.
+	/// </summary>
+	uint32_t at;
+
+	/// <summary>
+	/// Where it leads, in terms of whoever emitted it.
+	/// </summary>
+	uint32_t target;
+
+	/// <summary>
+	/// Leave for run() at 'target' instead of jumping within the code.
+	/// </summary>
+	bool isExit;
+} Fixup;
+
+/// <summary>
+/// Growable buffer of machine code, plus jumps waiting for their destinations.
+/// </summary>
+typedef struct
+{
+	uint8_t* code;
+	uint32_t count;
+	uint32_t capacity;
+
+	Fixup* fixups;
+	uint32_t fixupCount;
+	uint32_t fixupCapacity;
+
+	/// <summary>
+	/// Offset of the exit stub.
+	/// </summary>
+	uint32_t exitStub;
+} Assembler;
+
+/// <summary>
+/// Signature of the entry stub. Returns the bytecode address to continue at.
+/// </summary>
+typedef uint8_t* (*JitEntry)(uint8_t* target, Value* slots, Value* sp, ObjectClosure* closure);
+
+void initAssembler(Assembler* a);
+void freeAssembler(Assembler* a);
+
+/// <summary>
+/// Copy the code to fresh executable memory of 'size' bytes.
+/// </summary>
+uint8_t* finishAssembler(Assembler* a, size_t* size);
+
+void emitByte(Assembler* a, uint8_t byte);
+void emit32(Assembler* a, uint32_t value);
+void emit64(Assembler* a, uint64_t value);
+void addFixup(Assembler* a, uint32_t at, uint32_t target, bool isExit);
+
+/// <summary>
+/// 'opcode' between two registers.
+/// </summary>
+void emitRegisters(Assembler* a, uint8_t opcode, Register reg, Register rm);
+
+/// <summary>
+/// 'opcode' between 'reg' and [base + displacement].
+/// </summary>
+void emitMemory(Assembler* a, uint8_t opcode, Register reg, Register base, int32_t displacement);
+void emitLoad(Assembler* a, Register destination, Register base, int32_t displacement);
+void emitStore(Assembler* a, Register base, int32_t displacement, Register source);
+void emitMove(Assembler* a, Register destination, Register source);
+void emitImmediate(Assembler* a, Register destination, uint64_t value);
+
+/// <summary>
+/// 'destination += value', or -= when 'isSubtract'.
+/// </summary>
+void emitAddImmediate(Assembler* a, Register destination, int32_t value, bool isSubtract);
+void emitCompareImmediate(Assembler* a, Register left, int8_t value);
+void emitConditionalMove(Assembler* a, Condition condition, Register destination, Register source);
+
+/// <summary>
+/// call 'function', which must not need more than the shadow space on the stack.
+/// </summary>
+void emitCall(Assembler* a, void* function);
+
+/// <summary>
+/// call the function whose address is in 'function', same rules as emitCall().
+/// </summary>
+void emitCallRegister(Assembler* a, Register function);
+
+/// <summary>
+/// cmp dword [base + displacement], value
+/// </summary>
+void emitCompareMemory(Assembler* a, Register base, int32_t displacement, uint32_t value);
+
+/// <summary>
+/// Compare the ObjectType of the object 'base' points to with 'type'.
+/// </summary>
+void emitCompareObjectType(Assembler* a, Register base, uint32_t type);
+
+// scalar doubles. xmm registers are numbered 0-15 like the general ones.
+
+/// <summary>
+/// movq xmm, reg
+/// </summary>
+void emitToDouble(Assembler* a, uint8_t xmm, Register source);
+
+/// <summary>
+/// movq reg, xmm
+/// </summary>
+void emitFromDouble(Assembler* a, Register destination, uint8_t xmm);
+void emitLoadDouble(Assembler* a, uint8_t xmm, Register base, int32_t displacement);
+void emitStoreDouble(Assembler* a, Register base, int32_t displacement, uint8_t xmm);
+void emitMoveDouble(Assembler* a, uint8_t destination, uint8_t source);
+
+/// <summary>
+/// 'destination op= source', 'opcode' being one of the SSE_ defines.
+/// </summary>
+void emitArithmeticDouble(Assembler* a, uint8_t opcode, uint8_t destination, uint8_t source);
+
+/// <summary>
+/// ucomisd left, right
+/// </summary>
+void emitCompareDoubles(Assembler* a, uint8_t left, uint8_t right);
+
+/// <summary>
+/// Replace a small integer in 'value' with the double of the same number and leave
+/// anything else as it is. Clobbers rdx and 'xmm'.
+/// Leaves the flags 'equal' exactly when it converted.
+/// </summary>
+void emitIntToDouble(Assembler* a, Register value, uint8_t xmm);
+
+/// <returns>Offset of the jump's rel32, to be patched.</returns>
+uint32_t emitJump(Assembler* a, Condition condition);
+void patchJump(Assembler* a, uint32_t at, uint32_t destination);
+
+/// <summary>
+/// Leave for run() at 'ip'. SP must already hold the stack top.
+/// </summary>
+void emitExit(Assembler* a, uint8_t* ip);
+
+/// <summary>
+/// Save the callee-saved registers, load the interpreter registers from the JitEntry
+/// arguments and jump to 'target'.
+/// </summary>
+void emitEntryStub(Assembler* a);
+
+/// <summary>
+/// Store SP to vm.sp, restore the callee-saved registers and return rax.
+/// </summary>
+void emitExitStub(Assembler* a);
+
+#endif
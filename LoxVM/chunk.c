@@ -15,6 +15,7 @@ void freeChunk(Chunk* chunk)
 {
 	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	FREE_ARRAY(uint32_t, chunk->lines, chunk->capacity);
+	FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCount);
 	freeValueArray(&chunk->constants); // free constants
 	initChunk(chunk); // reset to well-defined state
 }
@@ -25,9 +26,173 @@ void initChunk(Chunk* chunk)
 	chunk->capacity = 0;
 	chunk->code = NULL;
 	chunk->lines = NULL;
+	chunk->caches = NULL;
+	chunk->cacheCount = 0;
 	initValueArray(&chunk->constants);
 }
 
+uint32_t instructionSize(Chunk* chunk, uint32_t offset)
+{
+	uint8_t* code = chunk->code; // fetch once
+	switch (code[offset])
+	{
+		// 24-bit name and 16-bit cache index
+		case OP_GET_PROPERTY_LONG:
+		case OP_SET_PROPERTY_LONG:
+			return 6;
+
+		// name, argument count and cache index
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+			return 5;
+
+		// 24-bit constant or global index, or 8-bit name and cache index
+		case OP_CONSTANT_LONG:
+		case OP_METHOD_LONG:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_GET_GLOBAL_LONG:
+		case OP_SET_GLOBAL_LONG:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+			return 4;
+
+		// 8-bit operand
+		case OP_CONSTANT:
+		case OP_POPN:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_SET_LOCAL_POP:
+			return 2;
+
+		// 16-bit jump offset, name and argument count, or a pair of 8-bit operands
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_GET_LOCAL_LOCAL:
+		case OP_GET_LOCAL_CONSTANT:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		case OP_POP_LOOP:
+			return 3;
+
+		// constant index followed by a pair of bytes per upvalue
+		case OP_CLOSURE:
+		{
+			ObjectFunction* function = AS_FUNCTION(
+				chunk->constants.values[code[offset + 1]]);
+			return 2 + function->upvalueCount * 2;
+		}
+		case OP_CLOSURE_LONG:
+		{
+			uint32_t index = (code[offset + 1] << 16)
+				| (code[offset + 2] << 8) | code[offset + 3];
+			ObjectFunction* function = AS_FUNCTION(chunk->constants.values[index]);
+			return 4 + function->upvalueCount * 2;
+		}
+
+		default: return 1; // no operands
+	}
+}
+
+bool jumpDestination(Chunk* chunk, uint32_t offset, uint32_t* destination)
+{
+	uint8_t* code = chunk->code; // fetch once
+	switch (code[offset])
+	{
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+			*destination = offset + 3 + ((code[offset + 1] << 8) | code[offset + 2]);
+			return true;
+		case OP_LOOP:
+		case OP_POP_LOOP:
+			*destination = offset + 3 - ((code[offset + 1] << 8) | code[offset + 2]);
+			return true;
+		default: return false;
+	}
+}
+
+int32_t stackEffect(Chunk* chunk, uint32_t offset)
+{
+	uint8_t* code = chunk->code; // fetch once
+	switch (code[offset])
+	{
+		case OP_CONSTANT:
+		case OP_CONSTANT_LONG:
+		case OP_CONSTANT_ZERO:
+		case OP_ZERO:
+		case OP_ONE:
+		case OP_NEG_ONE:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG:
+		case OP_GET_UPVALUE:
+		case OP_CLOSURE:
+		case OP_CLOSURE_LONG:
+		case OP_CLASS:
+			return 1;
+
+		case OP_GET_LOCAL_LOCAL:
+		case OP_GET_LOCAL_CONSTANT:
+			return 2;
+
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG:
+		case OP_GET_SUPER: // superclass
+		case OP_SET_PROPERTY:
+		case OP_SET_PROPERTY_LONG:
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD:
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_CLOSE_UPVALUE:
+		case OP_PRINT:
+		case OP_INHERIT:
+		case OP_METHOD:
+		case OP_METHOD_LONG:
+		case OP_SET_LOCAL_POP:
+		case OP_POP_JUMP_IF_FALSE:
+		case OP_POP_LOOP:
+			return -1;
+
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+			return -2;
+
+		case OP_POPN: return -code[offset + 1];
+
+		// callee and args are replaced by the result
+		case OP_CALL:
+		case OP_TAIL_CALL: return -code[offset + 1];
+		case OP_INVOKE: return -code[offset + 2];
+		case OP_SUPER_INVOKE: return -code[offset + 2] - 1; // and superclass
+
+		default: return 0; // in-place or control flow
+	}
+}
+
 void writeChunk(Chunk* chunk, uint8_t byte, uint32_t line)
 {
 	if (chunk->capacity < chunk->count + 1)
@@ -45,6 +210,38 @@ void writeChunk(Chunk* chunk, uint8_t byte, uint32_t line)
 	chunk->lines[count] = line;
 }
 
+void freeRegisterChunk(RegisterChunk* chunk)
+{
+	FREE_ARRAY(Instruction, chunk->code, chunk->capacity);
+	FREE_ARRAY(uint32_t, chunk->lines, chunk->capacity);
+	initRegisterChunk(chunk); // reset to well-defined state
+}
+
+void initRegisterChunk(RegisterChunk* chunk)
+{
+	chunk->count = 0;
+	chunk->capacity = 0;
+	chunk->code = NULL;
+	chunk->lines = NULL;
+}
+
+void writeRegisterChunk(RegisterChunk* chunk, Instruction instruction, uint32_t line)
+{
+	if (chunk->capacity < chunk->count + 1)
+	{
+		uint32_t oldCapacity = chunk->capacity;
+		chunk->capacity = GROW_CAPACITY(oldCapacity);
+		chunk->code = GROW_ARRAY(Instruction, chunk->code,
+			oldCapacity, chunk->capacity);
+		chunk->lines = GROW_ARRAY(uint32_t, chunk->lines,
+			oldCapacity, chunk->capacity);
+	}
+
+	uint32_t count = chunk->count++; // fetch once
+	chunk->code[count] = instruction;
+	chunk->lines[count] = line;
+}
+
 /// <summary>
 /// Not production code.
 /// </summary>
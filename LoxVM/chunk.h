@@ -4,7 +4,10 @@
 #include "value.h"
 
 #define CONSTANTS_MAX 16777216 // (1 << 24)
+#define INLINE_CACHES_MAX 65536 // (1 << 16) per function
+#define INLINE_CACHE_SIZE 4 // receiver shapes per site before it stays on the slow path
 
+// REMEMBER to add new opcodes to the dispatchTable in run().
 typedef enum
 {
 	// constants
@@ -51,14 +54,19 @@ typedef enum
 	/// Supports up to 256 locals.
 	/// </summary>
 	OP_SET_LOCAL,
+
+	// globals take an index into vm.globalValues, resolved by the compiler.
+	// each _LONG variant must follow its short form.
 	OP_DEFINE_GLOBAL,
+	OP_DEFINE_GLOBAL_LONG,
 	OP_GET_GLOBAL,
-	//OP_GET_GLOBAL_LONG, // TODO
+	OP_GET_GLOBAL_LONG,
 	OP_SET_GLOBAL,
-	//OP_SET_GLOBAL_LONG, // TODO
+	OP_SET_GLOBAL_LONG,
 
 	/// <summary>
 	/// Access a method from a super class.
+	/// Followed by a cache index, the superclass being the only 'shape' it sees.
 	/// </summary>
 	OP_GET_SUPER,
 
@@ -72,7 +80,7 @@ typedef enum
 	/// </summary>
 	OP_SET_UPVALUE,
 
-	// properties
+	// properties. each carries a 16-bit index into the chunk's inline caches after its name.
 	OP_GET_PROPERTY,
 	OP_GET_PROPERTY_LONG,
 	OP_SET_PROPERTY,
@@ -113,15 +121,22 @@ typedef enum
 	/// </summary>
 	OP_CALL,
 
+	/// <summary>
+	/// OP_CALL in tail position, always followed by OP_RETURN.
+	/// A closure replaces the caller's frame, arguments sliding down over its slots.
+	/// </summary>
+	OP_TAIL_CALL,
+
 	/// <summary>
 	/// Instance method call. 
 	/// A combination of OP_GET_PROPERTY and OP_CALL.
+	/// Name, argument count and a 16-bit inline cache index.
 	/// </summary>
 	OP_INVOKE,
 
 	/// <summary>
 	/// Invoke a method on an instance's super class.
-	/// A combination of OP_GET_SUPER and OP_CALL.
+	/// A combination of OP_GET_SUPER and OP_CALL, followed by a cache index.
 	/// </summary>
 	OP_SUPER_INVOKE,
 
@@ -142,8 +157,233 @@ typedef enum
 	OP_METHOD,
 	OP_METHOD_LONG,
 
+	// superinstructions, only emitted by the peephole pass in endCompiler().
+	// chosen from opcode pair counts (DEBUG_PROFILE_OPCODES) over loop, call and field heavy scripts.
+
+	/// <summary>
+	/// OP_GET_LOCAL a; OP_GET_LOCAL b
+	/// </summary>
+	OP_GET_LOCAL_LOCAL,
+
+	/// <summary>
+	/// OP_GET_LOCAL slot; OP_CONSTANT index
+	/// </summary>
+	OP_GET_LOCAL_CONSTANT,
+
+	/// <summary>
+	/// OP_SET_LOCAL slot; OP_POP
+	/// </summary>
+	OP_SET_LOCAL_POP,
+
+	/// <summary>
+	/// OP_JUMP_IF_FALSE; OP_POP, where the destination is also an OP_POP (skipped).
+	/// Pops the condition on both paths.
+	/// </summary>
+	OP_POP_JUMP_IF_FALSE,
+
+	/// <summary>
+	/// OP_LESS; OP_POP_JUMP_IF_FALSE
+	/// </summary>
+	OP_JUMP_IF_NOT_LESS,
+
+	/// <summary>
+	/// OP_GREATER; OP_POP_JUMP_IF_FALSE
+	/// </summary>
+	OP_JUMP_IF_NOT_GREATER,
+
+	/// <summary>
+	/// OP_POP; OP_LOOP
+	/// </summary>
+	OP_POP_LOOP,
+
+	// quickened instructions, OP_ADD rewrites itself into one of these the first
+	// time it runs and they rewrite themselves back when their guard fails.
+
+	/// <summary>
+	/// OP_ADD that last saw two numbers.
+	/// </summary>
+	OP_ADD_NUM,
+
+	/// <summary>
+	/// OP_ADD that last saw two strings.
+	/// </summary>
+	OP_ADD_STR,
+
 } OpCode;
 
+// register instructions are 32-bit words: the opcode in the low byte, then operands A, B
+// and C (frame slots, counts), or A and a 16-bit Bx. names, globals, caches and jump
+// offsets don't fit and follow in whole words.
+typedef uint32_t Instruction;
+
+#define REGISTERS_MAX 256 // frame slots an operand can name
+#define ENCODE_ABC(op, a, b, c) \
+	((Instruction)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+#define ENCODE_ABX(op, a, bx) \
+	((Instruction)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(bx) << 16))
+#define DECODE_OP(instruction) ((instruction) & 0xff)
+#define DECODE_A(instruction) (((instruction) >> 8) & 0xff)
+#define DECODE_B(instruction) (((instruction) >> 16) & 0xff)
+#define DECODE_C(instruction) ((instruction) >> 24)
+#define DECODE_BX(instruction) ((instruction) >> 16)
+
+// opcodes of the register engine, which runs three-address code over frame slots.
+// a stack position maps to the frame slot of the same number, so locals are registers
+// and temporaries live where the stack engine would have pushed them.
+// REMEMBER to add new opcodes to the dispatchTable in runRegister().
+typedef enum
+{
+	/// <summary>
+	/// A = B
+	/// </summary>
+	ROP_MOVE,
+
+	/// <summary>
+	/// A = constant Bx
+	/// </summary>
+	ROP_CONSTANT,
+
+	/// <summary>
+	/// A = constant [word]
+	/// </summary>
+	ROP_CONSTANT_LONG,
+	ROP_NIL,
+	ROP_TRUE,
+	ROP_FALSE,
+
+	// globals: A is the value, the global's slot follows
+	ROP_DEFINE_GLOBAL,
+	ROP_GET_GLOBAL,
+	ROP_SET_GLOBAL,
+
+	// upvalues: A is the value, B the upvalue index
+	ROP_GET_UPVALUE,
+	ROP_SET_UPVALUE,
+
+	/// <summary>
+	/// A = B.[name word], followed by a cache index word.
+	/// </summary>
+	ROP_GET_PROPERTY,
+
+	/// <summary>
+	/// B.[name word] = C and A = C, followed by a cache index word.
+	/// </summary>
+	ROP_SET_PROPERTY,
+
+	/// <summary>
+	/// A = method [name word] of superclass C bound to B, followed by a cache index word.
+	/// </summary>
+	ROP_GET_SUPER,
+
+	// A = B op C
+	ROP_EQUAL,
+	ROP_GREATER,
+	ROP_LESS,
+	ROP_ADD,
+	ROP_SUBTRACT,
+	ROP_MULTIPLY,
+	ROP_DIVIDE,
+
+	// A = op B
+	ROP_NOT,
+	ROP_NEGATE,
+
+	// control flow. the word after a jump is a signed offset from the next instruction.
+	ROP_JUMP,
+
+	/// <summary>
+	/// Jump if A is falsey.
+	/// </summary>
+	ROP_JUMP_IF_FALSE,
+
+	/// <summary>
+	/// Jump unless A < B.
+	/// </summary>
+	ROP_JUMP_IF_NOT_LESS,
+
+	/// <summary>
+	/// Jump unless A > B.
+	/// </summary>
+	ROP_JUMP_IF_NOT_GREATER,
+
+	/// <summary>
+	/// Call A with the B arguments in the slots after it. The result replaces A.
+	/// </summary>
+	ROP_CALL,
+
+	/// <summary>
+	/// ROP_CALL in tail position, followed by ROP_RETURN of A.
+	/// A closure takes over the caller's frame.
+	/// </summary>
+	ROP_TAIL_CALL,
+
+	/// <summary>
+	/// Invoke method [name word] on receiver A with the B arguments after it,
+	/// followed by a cache index word. The result replaces A.
+	/// </summary>
+	ROP_INVOKE,
+
+	/// <summary>
+	/// Invoke method [name word] of superclass C on receiver A with the B arguments after it,
+	/// followed by a cache index word.
+	/// </summary>
+	ROP_SUPER_INVOKE,
+
+	/// <summary>
+	/// A = closure of function [constant word], followed by one word per upvalue:
+	/// isLocal in the low byte, index above it.
+	/// </summary>
+	ROP_CLOSURE,
+
+	/// <summary>
+	/// Close the upvalue of slot A, if it has one.
+	/// </summary>
+	ROP_CLOSE_UPVALUE,
+	ROP_PRINT,
+	ROP_RETURN,
+
+	// classes
+	ROP_CLASS, // A = class [name word]
+	ROP_INHERIT, // copy methods of superclass A into B
+	ROP_METHOD, // add method B to class A as [name word]
+} RegisterOpCode;
+
+typedef struct
+{
+	/// <summary>
+	/// Receiver shape this entry applies to. It fixes both the class and the field layout.
+	/// </summary>
+	ObjectShape* shape;
+
+	/// <summary>
+	/// The method the name resolved to, or NULL if it resolved to a field.
+	/// </summary>
+	ObjectClosure* method;
+
+	/// <summary>
+	/// Shape after a store that added the field, NULL if the field already existed.
+	/// </summary>
+	ObjectShape* transition;
+
+	/// <summary>
+	/// Slot of the field.
+	/// </summary>
+	uint32_t index;
+} InlineCacheEntry;
+
+/// <summary>
+/// Lookup results remembered by one property access or invoke site.
+/// </summary>
+typedef struct
+{
+	/// <summary>
+	/// Entries are stale unless this matches vm.cacheEpoch.
+	/// </summary>
+	uint32_t epoch;
+	uint32_t count;
+	InlineCacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
 typedef struct
 {
 	uint32_t count;
@@ -151,10 +391,47 @@ typedef struct
 	uint8_t* code;
 	uint32_t* lines; // could use run-length encoding
 	ValueArray constants;
+
+	/// <summary>
+	/// One per property access and invoke site, allocated by endCompiler().
+	/// </summary>
+	InlineCache* caches;
+	uint32_t cacheCount;
 } Chunk;
 
+/// <summary>
+/// Code for the register engine, translated from a function's Chunk.
+/// It shares that chunk's constants and inline caches.
+/// </summary>
+typedef struct
+{
+	uint32_t count;
+	uint32_t capacity;
+	Instruction* code;
+	uint32_t* lines; // one per word, operand words included
+} RegisterChunk;
+
 uint32_t addConstant(Chunk* chunk, Value value);
 void freeChunk(Chunk* chunk);
 void initChunk(Chunk* chunk);
+
+/// <summary>
+/// Size in bytes of the instruction at 'offset', including its operands.
+/// </summary>
+uint32_t instructionSize(Chunk* chunk, uint32_t offset);
+
+/// <summary>
+/// Where the jump at 'offset' lands.
+/// </summary>
+/// <returns>False if the instruction at 'offset' is not a jump.</returns>
+bool jumpDestination(Chunk* chunk, uint32_t offset, uint32_t* destination);
+
+/// <summary>
+/// Net number of values the instruction at 'offset' pushes (or pops if negative).
+/// </summary>
+int32_t stackEffect(Chunk* chunk, uint32_t offset);
 void writeChunk(Chunk* chunk, uint8_t byte, uint32_t line);
+void freeRegisterChunk(RegisterChunk* chunk);
+void initRegisterChunk(RegisterChunk* chunk);
+void writeRegisterChunk(RegisterChunk* chunk, Instruction instruction, uint32_t line);
 uint32_t writeConstant(Chunk* chunk, Value value, uint32_t line);
@@ -8,4 +8,18 @@
 //#define DEBUG_STRESS_GC
 //#define DEBUG_LOG_GC
 #define DEBUG_TRACE_EXECUTION
+//#define DEBUG_PROFILE_OPCODES // count adjacent opcode pairs, printed by freeVM()
+
+// use "labels as values" to thread the dispatch loop when the compiler supports it,
+// otherwise fall back to the portable switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+
+// compile hot functions to machine code (see jit.c). value.h turns this back off
+// without NAN_BOXING, which the generated code relies on.
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X64
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
@@ -100,6 +100,26 @@ typedef struct Compiler
 	int32_t localCount;
 	Upvalue upvalues[UINT8_COUNT];
 	uint32_t scopeDepth;
+
+	/// <summary>
+	/// Inline caches handed out to property access and invoke sites so far.
+	/// </summary>
+	uint32_t cacheCount;
+
+	/// <summary>
+	/// Offset of the last OP_CALL emitted, to spot a call in tail position.
+	/// </summary>
+	uint32_t lastCall;
+
+	/// <summary>
+	/// Offset of the last short OP_GET_PROPERTY emitted, to spot '(instance.method)(...)'.
+	/// </summary>
+	uint32_t lastPropertyGet;
+
+	/// <summary>
+	/// Offset the last forward jump was patched to land at.
+	/// </summary>
+	uint32_t lastJumpTarget;
 } Compiler;
 
 typedef struct ClassCompiler
@@ -134,6 +154,7 @@ static void defineVariable(uint32_t global);
 static bool identifiersEqual(Token* a, Token* b);
 static ParseRule* getRule(TokenType type);
 static uint32_t parseIdentifierConstant(Token* name);
+static uint32_t resolveGlobal(Token* name);
 static void parsePrecedence(Precedence precedence);
 static uint32_t parseVariable(const char* errorMessage);
 static Token syntheticToken(const char* text);
@@ -145,6 +166,10 @@ static void initCompiler(Compiler* compiler, FunctionType type)
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
+	compiler->cacheCount = 0;
+	compiler->lastCall = UINT32_MAX;
+	compiler->lastPropertyGet = UINT32_MAX;
+	compiler->lastJumpTarget = UINT32_MAX;
 
 	// create entrypoint (like 'main')
 	compiler->function = newFunction();
@@ -287,6 +312,7 @@ static void patchJump(uint32_t offset)
 	// update 16 bits now that the address is known
 	currentChunk()->code[offset] = (jump >> 8) & 0xff;
 	currentChunk()->code[offset + 1] = jump & 0xff;
+	current->lastJumpTarget = currentChunk()->count;
 }
 
 static void emitByte(uint8_t byte)
@@ -309,6 +335,21 @@ static void emitBytesLong(uint8_t opcode, uint32_t index)
 	emitByte((uint8_t)(index >> 8));
 	emitByte((uint8_t)(index >> 0));
 }
+/// <summary>
+/// Give the instruction just emitted its own inline cache.
+/// </summary>
+static void emitInlineCache()
+{
+	if (current->cacheCount == INLINE_CACHES_MAX)
+	{
+		error("Too many property accesses in one function.");
+		return;
+	}
+
+	uint32_t index = current->cacheCount++;
+	emitByte((uint8_t)(index >> 8));
+	emitByte((uint8_t)(index >> 0));
+}
 static void emitConstant(Value value)
 {
 	uint32_t constantCount = currentChunk()->count;
@@ -390,15 +431,757 @@ static void emitReturn()
 	emitByte(OP_RETURN);
 }
 
+/// <summary>
+/// Is the OP_JUMP_IF_FALSE at 'offset' followed by an OP_POP on both paths?
+/// Then the pair can pop the condition itself and land past the second OP_POP.
+/// </summary>
+static bool isPoppingBranch(Chunk* chunk, uint32_t offset, bool* isTarget)
+{
+	uint8_t* code = chunk->code;
+	uint32_t destination;
+	return code[offset] == OP_JUMP_IF_FALSE
+		&& code[offset + 3] == OP_POP && !isTarget[offset + 3]
+		&& jumpDestination(chunk, offset, &destination)
+		&& code[destination] == OP_POP;
+}
+
+/// <summary>
+/// Rewrite common instruction sequences into superinstructions.
+/// Jumps are re-targeted afterwards, the chunk only ever shrinks.
+/// </summary>
+static void optimizeChunk(Chunk* chunk)
+{
+	uint8_t* code = chunk->code;
+	uint32_t count = chunk->count;
+
+	// nothing may be fused into an instruction that something jumps to
+	bool* isTarget = ALLOCATE(bool, count + 1);
+	memset(isTarget, 0, sizeof(bool) * (count + 1));
+	for (uint32_t offset = 0; offset < count; offset += instructionSize(chunk, offset))
+	{
+		uint32_t destination;
+		if (!jumpDestination(chunk, offset, &destination))
+			continue;
+
+		isTarget[destination] = true;
+		if (code[destination] == OP_POP)
+			isTarget[destination + 1] = true; // a popping branch lands here instead
+	}
+
+	uint8_t* optimized = ALLOCATE(uint8_t, chunk->capacity);
+	uint32_t* lines = ALLOCATE(uint32_t, chunk->capacity);
+	uint32_t* newOffsets = ALLOCATE(uint32_t, count + 1); // old offset -> new offset
+	uint32_t* jumps = ALLOCATE(uint32_t, count); // new offsets of jumps
+	uint32_t* destinations = ALLOCATE(uint32_t, count); // and their old destinations
+	uint32_t jumpCount = 0;
+	uint32_t length = 0;
+
+#define EMIT(byte) (lines[length] = line, optimized[length++] = (uint8_t)(byte))
+
+	for (uint32_t offset = 0; offset < count;)
+	{
+		newOffsets[offset] = length;
+		uint32_t line = chunk->lines[offset];
+		uint32_t size = instructionSize(chunk, offset);
+		uint32_t next = offset + size;
+		uint8_t nextOp = (next < count && !isTarget[next]) ? code[next] : OP_RETURN; // OP_RETURN never fuses
+		uint32_t fused = 0; // bytes of old code the superinstruction swallowed, 0 if none
+		uint32_t destination;
+
+		switch (code[offset])
+		{
+			case OP_GET_LOCAL:
+				if (nextOp == OP_GET_LOCAL || nextOp == OP_CONSTANT)
+				{
+					EMIT(nextOp == OP_GET_LOCAL ? OP_GET_LOCAL_LOCAL : OP_GET_LOCAL_CONSTANT);
+					EMIT(code[offset + 1]);
+					EMIT(code[next + 1]);
+					fused = size + 2;
+				}
+				else if (nextOp == OP_CONSTANT_ZERO)
+				{
+					EMIT(OP_GET_LOCAL_CONSTANT);
+					EMIT(code[offset + 1]);
+					EMIT(0);
+					fused = size + 1;
+				}
+				break;
+			case OP_SET_LOCAL:
+				if (nextOp == OP_POP)
+				{
+					EMIT(OP_SET_LOCAL_POP);
+					EMIT(code[offset + 1]);
+					fused = size + 1;
+				}
+				break;
+			case OP_LESS:
+			case OP_GREATER:
+				if (nextOp == OP_JUMP_IF_FALSE && isPoppingBranch(chunk, next, isTarget))
+				{
+					jumpDestination(chunk, next, &destination);
+					destinations[jumpCount] = destination + 1; // skip the pop
+					jumps[jumpCount++] = length;
+					EMIT(code[offset] == OP_LESS ? OP_JUMP_IF_NOT_LESS : OP_JUMP_IF_NOT_GREATER);
+					EMIT(0); // patched below
+					EMIT(0);
+					fused = size + 3 + 1;
+				}
+				break;
+			case OP_JUMP_IF_FALSE:
+				if (isPoppingBranch(chunk, offset, isTarget))
+				{
+					jumpDestination(chunk, offset, &destination);
+					destinations[jumpCount] = destination + 1; // skip the pop
+					jumps[jumpCount++] = length;
+					EMIT(OP_POP_JUMP_IF_FALSE);
+					EMIT(0); // patched below
+					EMIT(0);
+					fused = size + 1;
+				}
+				break;
+			case OP_POP:
+				if (nextOp == OP_LOOP)
+				{
+					jumpDestination(chunk, next, &destinations[jumpCount]);
+					jumps[jumpCount++] = length;
+					EMIT(OP_POP_LOOP);
+					EMIT(0); // patched below
+					EMIT(0);
+					fused = size + 3;
+				}
+				break;
+			default: break;
+		}
+
+		// copy as is
+		if (fused == 0)
+		{
+			if (jumpDestination(chunk, offset, &destinations[jumpCount]))
+				jumps[jumpCount++] = length;
+			for (uint32_t i = 0; i < size; ++i)
+				EMIT(code[offset + i]);
+			fused = size;
+		}
+
+		offset += fused;
+	}
+	newOffsets[count] = length;
+
+#undef EMIT
+
+	// re-target jumps, the distances only got shorter so they still fit
+	for (uint32_t i = 0; i < jumpCount; ++i)
+	{
+		uint32_t jump = jumps[i];
+		uint32_t next = jump + 3;
+		uint32_t destination = newOffsets[destinations[i]];
+		uint32_t distance = destination >= next ? destination - next : next - destination;
+		optimized[jump + 1] = (distance >> 8) & 0xff;
+		optimized[jump + 2] = distance & 0xff;
+	}
+
+	FREE_ARRAY(bool, isTarget, count + 1);
+	FREE_ARRAY(uint32_t, newOffsets, count + 1);
+	FREE_ARRAY(uint32_t, jumps, count);
+	FREE_ARRAY(uint32_t, destinations, count);
+	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	FREE_ARRAY(uint32_t, chunk->lines, chunk->capacity);
+	chunk->code = optimized;
+	chunk->lines = lines;
+	chunk->count = length;
+}
+
+/// <summary>
+/// Walks every path through the finished chunk to find the stack depth on entry
+/// to each instruction (-1 where unreachable), counted from the callee in slot 0.
+/// </summary>
+/// <returns>The deepest the value stack gets.</returns>
+static int32_t computeStackDepths(ObjectFunction* function, int32_t* depths)
+{
+	Chunk* chunk = &function->chunk;
+	uint32_t count = chunk->count;
+	uint32_t* worklist = ALLOCATE(uint32_t, count);
+	for (uint32_t i = 0; i < count; ++i)
+		depths[i] = -1;
+
+	int32_t maxDepth = function->arity + 1; // callee and args
+	uint32_t pending = 0;
+	depths[0] = maxDepth;
+	worklist[pending++] = 0;
+
+	while (pending > 0)
+	{
+		uint32_t offset = worklist[--pending];
+		int32_t depth = depths[offset] + stackEffect(chunk, offset);
+		if (depth > maxDepth) maxDepth = depth;
+
+		// where control goes next
+		uint32_t next = offset + instructionSize(chunk, offset);
+		uint32_t successors[2];
+		uint32_t successorCount = 0;
+		switch (chunk->code[offset])
+		{
+			case OP_RETURN: break;
+			case OP_JUMP:
+			case OP_LOOP:
+			case OP_POP_LOOP:
+				jumpDestination(chunk, offset, &successors[successorCount++]);
+				break;
+			default:
+				// conditional jumps fall through as well
+				if (jumpDestination(chunk, offset, &successors[successorCount]))
+					++successorCount;
+				successors[successorCount++] = next;
+				break;
+		}
+
+		for (uint32_t i = 0; i < successorCount; ++i)
+		{
+			uint32_t successor = successors[i];
+			if (successor < count && depths[successor] == -1)
+			{
+				depths[successor] = depth;
+				worklist[pending++] = successor;
+			}
+		}
+	}
+
+	FREE_ARRAY(uint32_t, worklist, count);
+	return maxDepth;
+}
+
+static uint32_t computeMaxStack(ObjectFunction* function)
+{
+	uint32_t count = function->chunk.count;
+	if (count == 0) return function->arity + 1;
+
+	int32_t* depths = ALLOCATE(int32_t, count);
+	int32_t maxDepth = computeStackDepths(function, depths);
+	FREE_ARRAY(int32_t, depths, count);
+
+	// +1 for the value the runtime may park on top to hide it from the GC
+	// (e.g. allocateString())
+	return (uint32_t)maxDepth + 1;
+}
+
+/// <summary>
+/// State of translating one function's stack code into register code.
+/// </summary>
+typedef struct
+{
+	RegisterChunk* out;
+	uint32_t line;
+
+	/// <summary>
+	/// Slot that holds the value of each stack position: the position itself, or the
+	/// local it was loaded from while that load hasn't been copied up yet.
+	/// </summary>
+	uint8_t sources[REGISTERS_MAX];
+
+	/// <summary>
+	/// Last instruction if its destination may still be rewritten, -1 otherwise.
+	/// </summary>
+	int32_t lastWrite;
+
+	uint32_t* jumps; // indices of jump offset words
+	uint32_t* destinations; // and the stack offsets they go to
+	uint32_t jumpCount;
+} Translator;
+
+static uint32_t emitRegister(Translator* translator, Instruction instruction)
+{
+	writeRegisterChunk(translator->out, instruction, translator->line);
+	translator->lastWrite = -1;
+	return translator->out->count - 1;
+}
+
+/// <summary>
+/// Emit an instruction that only writes slot A after reading its operands,
+/// so a following store to a local may retarget it.
+/// </summary>
+static void emitRegisterWrite(Translator* translator, Instruction instruction)
+{
+	translator->lastWrite = (int32_t)emitRegister(translator, instruction);
+	translator->sources[DECODE_A(instruction)] = DECODE_A(instruction);
+}
+
+static void emitRegisterJump(Translator* translator, Instruction instruction,
+	uint32_t destination)
+{
+	emitRegister(translator, instruction);
+	translator->destinations[translator->jumpCount] = destination;
+	translator->jumps[translator->jumpCount++] = emitRegister(translator, 0); // patched later
+}
+
+/// <summary>
+/// Copy a pending local load into its own slot.
+/// </summary>
+static void materialize(Translator* translator, uint32_t position)
+{
+	uint8_t source = translator->sources[position];
+	if (source != position)
+	{
+		emitRegister(translator, ENCODE_ABC(ROP_MOVE, position, source, 0));
+		translator->sources[position] = (uint8_t)position;
+	}
+}
+
+/// <summary>
+/// Copy every pending load below 'depth' into place. Needed wherever another path
+/// joins, and before anything that may read or write the frame behind our back.
+/// </summary>
+static void materializeAll(Translator* translator, uint32_t depth)
+{
+	for (uint32_t position = 0; position < depth; ++position)
+		materialize(translator, position);
+}
+
+/// <summary>
+/// Index of 'value' in the chunk's constants, adding it if it isn't there.
+/// </summary>
+static uint32_t findConstant(Chunk* chunk, Value value)
+{
+	for (uint32_t i = 0; i < chunk->constants.count; ++i)
+	{
+#ifdef NAN_BOXING
+		if (chunk->constants.values[i] == value) // same bits, so a small integer stays one
+#else
+		if (valuesEqual(chunk->constants.values[i], value))
+#endif
+			return i;
+	}
+	return addConstant(chunk, value);
+}
+
+static void emitRegisterConstant(Translator* translator, uint32_t destination, uint32_t index)
+{
+	if (index <= UINT16_MAX)
+	{
+		emitRegisterWrite(translator, ENCODE_ABX(ROP_CONSTANT, destination, index));
+	}
+	else
+	{
+		emitRegisterWrite(translator, ENCODE_ABC(ROP_CONSTANT_LONG, destination, 0, 0));
+		emitRegister(translator, index);
+		translator->lastWrite = (int32_t)translator->out->count - 2;
+	}
+}
+
+/// <summary>
+/// Store the value on top of the stack (position 'top') into local 'slot'.
+/// </summary>
+static void storeLocal(Translator* translator, uint32_t slot, uint32_t top)
+{
+	uint8_t* sources = translator->sources;
+	uint8_t value = sources[top];
+	if (value == slot)
+		return; // 'a = a'
+
+	// pending loads of the old value must happen first
+	bool isLoaded = false;
+	for (uint32_t position = 0; position <= top; ++position)
+	{
+		if (position != slot && sources[position] == slot)
+			isLoaded = true;
+	}
+
+	RegisterChunk* out = translator->out;
+	if (!isLoaded && value == top && translator->lastWrite != -1
+		&& DECODE_A(out->code[translator->lastWrite]) == top)
+	{
+		// compute straight into the local: 'a = b + c' is a single add
+		Instruction* instruction = &out->code[translator->lastWrite];
+		*instruction = (*instruction & ~(Instruction)0xff00) | (slot << 8);
+		sources[top] = (uint8_t)slot;
+	}
+	else
+	{
+		for (uint32_t position = 0; position <= top; ++position)
+		{
+			if (position != slot && sources[position] == slot)
+				materialize(translator, position);
+		}
+		emitRegister(translator, ENCODE_ABC(ROP_MOVE, slot, sources[top], 0));
+	}
+	sources[slot] = (uint8_t)slot;
+	translator->lastWrite = -1;
+}
+
+/// <summary>
+/// Translate the function's (unfused) stack code into register code for runRegister().
+/// Stack depths are known at every instruction, so each stack position becomes the
+/// frame slot of the same number. Loads of locals are not copied until something
+/// needs the copy, which lets instructions name locals as their operands directly.
+/// </summary>
+static void translateToRegisters(ObjectFunction* function)
+{
+	Chunk* chunk = &function->chunk;
+	uint8_t* code = chunk->code;
+	uint32_t count = chunk->count;
+
+	int32_t* depths = ALLOCATE(int32_t, count);
+	if (computeStackDepths(function, depths) >= REGISTERS_MAX)
+	{
+		FREE_ARRAY(int32_t, depths, count);
+		error("Function needs too many slots for the register engine.");
+		return;
+	}
+
+	// paths join at jump destinations
+	bool* isTarget = ALLOCATE(bool, count + 1);
+	memset(isTarget, 0, sizeof(bool) * (count + 1));
+	for (uint32_t offset = 0; offset < count; offset += instructionSize(chunk, offset))
+	{
+		uint32_t destination;
+		if (jumpDestination(chunk, offset, &destination))
+			isTarget[destination] = true;
+	}
+
+	Translator translator;
+	translator.out = &function->registerChunk;
+	translator.lastWrite = -1;
+	translator.jumps = ALLOCATE(uint32_t, count);
+	translator.destinations = ALLOCATE(uint32_t, count);
+	translator.jumpCount = 0;
+	for (uint32_t i = 0; i < REGISTERS_MAX; ++i)
+		translator.sources[i] = (uint8_t)i;
+
+	uint8_t* sources = translator.sources;
+	RegisterChunk* out = translator.out;
+	uint32_t* newOffsets = ALLOCATE(uint32_t, count + 1); // stack offset -> register index
+
+	for (uint32_t offset = 0; offset < count;)
+	{
+		uint32_t size = instructionSize(chunk, offset);
+		int32_t depth = depths[offset];
+		translator.line = chunk->lines[offset];
+		if (isTarget[offset] && depth != -1)
+		{
+			materializeAll(&translator, depth); // jumps arrive with everything in place
+			translator.lastWrite = -1;
+		}
+		newOffsets[offset] = out->count;
+		if (depth == -1) // unreachable
+		{
+			offset += size;
+			continue;
+		}
+
+		uint32_t top = depth - 1; // position of the top value
+		uint32_t destination;
+		switch (code[offset])
+		{
+			case OP_CONSTANT:
+				emitRegisterConstant(&translator, depth, code[offset + 1]);
+				break;
+			case OP_CONSTANT_LONG:
+				emitRegisterConstant(&translator, depth,
+					(code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3]);
+				break;
+			case OP_CONSTANT_ZERO:
+				emitRegisterConstant(&translator, depth, 0);
+				break;
+			case OP_ZERO:
+				emitRegisterConstant(&translator, depth, findConstant(chunk, INT_VAL(0)));
+				break;
+			case OP_ONE:
+				emitRegisterConstant(&translator, depth, findConstant(chunk, INT_VAL(1)));
+				break;
+			case OP_NEG_ONE:
+				emitRegisterConstant(&translator, depth, findConstant(chunk, INT_VAL(-1)));
+				break;
+			case OP_NIL: emitRegisterWrite(&translator, ENCODE_ABC(ROP_NIL, depth, 0, 0)); break;
+			case OP_TRUE: emitRegisterWrite(&translator, ENCODE_ABC(ROP_TRUE, depth, 0, 0)); break;
+			case OP_FALSE: emitRegisterWrite(&translator, ENCODE_ABC(ROP_FALSE, depth, 0, 0)); break;
+			case OP_POP:
+			case OP_POPN:
+				break; // positions above the depth are simply dead
+
+			case OP_GET_LOCAL:
+				sources[depth] = sources[code[offset + 1]];
+				translator.lastWrite = -1;
+				break;
+			case OP_SET_LOCAL:
+				storeLocal(&translator, code[offset + 1], top);
+				break;
+			case OP_DEFINE_GLOBAL:
+			case OP_DEFINE_GLOBAL_LONG:
+			case OP_GET_GLOBAL:
+			case OP_GET_GLOBAL_LONG:
+			case OP_SET_GLOBAL:
+			case OP_SET_GLOBAL_LONG:
+			{
+				uint8_t operation = code[offset];
+				bool isLong = operation == OP_DEFINE_GLOBAL_LONG
+					|| operation == OP_GET_GLOBAL_LONG || operation == OP_SET_GLOBAL_LONG;
+				uint32_t slot = isLong
+					? (uint32_t)((code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3])
+					: code[offset + 1];
+				if (operation == OP_GET_GLOBAL || operation == OP_GET_GLOBAL_LONG)
+				{
+					emitRegisterWrite(&translator, ENCODE_ABC(ROP_GET_GLOBAL, depth, 0, 0));
+					emitRegister(&translator, slot);
+					translator.lastWrite = (int32_t)out->count - 2;
+				}
+				else
+				{
+					bool isDefine = operation == OP_DEFINE_GLOBAL || operation == OP_DEFINE_GLOBAL_LONG;
+					emitRegister(&translator, ENCODE_ABC(isDefine ? ROP_DEFINE_GLOBAL : ROP_SET_GLOBAL,
+						sources[top], 0, 0));
+					emitRegister(&translator, slot);
+				}
+				break;
+			}
+			case OP_GET_UPVALUE:
+				emitRegisterWrite(&translator, ENCODE_ABC(ROP_GET_UPVALUE, depth, code[offset + 1], 0));
+				break;
+			case OP_SET_UPVALUE:
+				// upvalues never point into this frame, closures made here capture
+				// locals of frames that are already running
+				emitRegister(&translator, ENCODE_ABC(ROP_SET_UPVALUE, sources[top], code[offset + 1], 0));
+				break;
+
+			case OP_GET_PROPERTY:
+			case OP_GET_PROPERTY_LONG:
+			case OP_SET_PROPERTY:
+			case OP_SET_PROPERTY_LONG:
+			{
+				uint8_t operation = code[offset];
+				bool isLong = operation == OP_GET_PROPERTY_LONG || operation == OP_SET_PROPERTY_LONG;
+				uint32_t name = isLong
+					? (uint32_t)((code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3])
+					: code[offset + 1];
+				uint32_t cache = (code[offset + size - 2] << 8) | code[offset + size - 1];
+				if (operation == OP_GET_PROPERTY || operation == OP_GET_PROPERTY_LONG)
+				{
+					emitRegisterWrite(&translator, ENCODE_ABC(ROP_GET_PROPERTY, top, sources[top], 0));
+				}
+				else
+				{
+					emitRegister(&translator, ENCODE_ABC(ROP_SET_PROPERTY, top - 1,
+						sources[top - 1], sources[top]));
+					sources[top - 1] = (uint8_t)(top - 1);
+				}
+				uint32_t instruction = out->count - 1;
+				emitRegister(&translator, name);
+				emitRegister(&translator, cache);
+				if (operation == OP_GET_PROPERTY || operation == OP_GET_PROPERTY_LONG)
+					translator.lastWrite = (int32_t)instruction;
+				break;
+			}
+			case OP_GET_SUPER:
+				emitRegister(&translator, ENCODE_ABC(ROP_GET_SUPER, top - 1,
+					sources[top - 1], sources[top]));
+				emitRegister(&translator, code[offset + 1]);
+				emitRegister(&translator, (code[offset + 2] << 8) | code[offset + 3]);
+				sources[top - 1] = (uint8_t)(top - 1);
+				break;
+
+			case OP_EQUAL:
+			case OP_GREATER:
+			case OP_LESS:
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			{
+				RegisterOpCode operation;
+				switch (code[offset])
+				{
+					case OP_EQUAL: operation = ROP_EQUAL; break;
+					case OP_GREATER: operation = ROP_GREATER; break;
+					case OP_LESS: operation = ROP_LESS; break;
+					case OP_ADD: operation = ROP_ADD; break;
+					case OP_SUBTRACT: operation = ROP_SUBTRACT; break;
+					case OP_MULTIPLY: operation = ROP_MULTIPLY; break;
+					default: operation = ROP_DIVIDE; break;
+				}
+				emitRegisterWrite(&translator, ENCODE_ABC(operation, top - 1,
+					sources[top - 1], sources[top]));
+				break;
+			}
+			case OP_NOT:
+				emitRegisterWrite(&translator, ENCODE_ABC(ROP_NOT, top, sources[top], 0));
+				break;
+			case OP_NEGATE:
+				emitRegisterWrite(&translator, ENCODE_ABC(ROP_NEGATE, top, sources[top], 0));
+				break;
+
+			case OP_JUMP_IF_FALSE:
+			{
+				jumpDestination(chunk, offset, &destination);
+				if (!isPoppingBranch(chunk, offset, isTarget))
+				{
+					// the condition is still needed on one of the paths
+					materializeAll(&translator, depth);
+					emitRegisterJump(&translator, ENCODE_ABC(ROP_JUMP_IF_FALSE, top, 0, 0), destination);
+					break;
+				}
+
+				// both paths pop the condition, so it doesn't need a slot of its own
+				Instruction* last = translator.lastWrite != -1 ? &out->code[translator.lastWrite] : NULL;
+				if (last != NULL && DECODE_A(*last) == top
+					&& (DECODE_OP(*last) == ROP_LESS || DECODE_OP(*last) == ROP_GREATER))
+				{
+					// compare and branch in one
+					Instruction compare = *last;
+					--out->count;
+					materializeAll(&translator, top);
+					emitRegisterJump(&translator, ENCODE_ABC(DECODE_OP(compare) == ROP_LESS
+						? ROP_JUMP_IF_NOT_LESS : ROP_JUMP_IF_NOT_GREATER,
+						DECODE_B(compare), DECODE_C(compare), 0), destination);
+				}
+				else
+				{
+					materializeAll(&translator, top);
+					emitRegisterJump(&translator, ENCODE_ABC(ROP_JUMP_IF_FALSE, sources[top], 0, 0),
+						destination);
+				}
+				break;
+			}
+			case OP_JUMP:
+			case OP_LOOP:
+				jumpDestination(chunk, offset, &destination);
+				materializeAll(&translator, depth);
+				emitRegisterJump(&translator, ENCODE_ABC(ROP_JUMP, 0, 0, 0), destination);
+				break;
+
+			case OP_CALL:
+			case OP_TAIL_CALL:
+			{
+				uint8_t argCount = code[offset + 1];
+				materializeAll(&translator, depth); // the callee may write our locals through upvalues
+				emitRegister(&translator, ENCODE_ABC(code[offset] == OP_TAIL_CALL ? ROP_TAIL_CALL : ROP_CALL,
+					depth - argCount - 1, argCount, 0));
+				break;
+			}
+			case OP_INVOKE:
+			{
+				uint8_t argCount = code[offset + 2];
+				materializeAll(&translator, depth);
+				emitRegister(&translator, ENCODE_ABC(ROP_INVOKE, depth - argCount - 1, argCount, 0));
+				emitRegister(&translator, code[offset + 1]);
+				emitRegister(&translator, (code[offset + 3] << 8) | code[offset + 4]);
+				break;
+			}
+			case OP_SUPER_INVOKE:
+			{
+				uint8_t argCount = code[offset + 2];
+				materializeAll(&translator, depth);
+				emitRegister(&translator, ENCODE_ABC(ROP_SUPER_INVOKE, depth - argCount - 2,
+					argCount, top));
+				emitRegister(&translator, code[offset + 1]);
+				emitRegister(&translator, (code[offset + 3] << 8) | code[offset + 4]);
+				break;
+			}
+			case OP_CLOSURE:
+			case OP_CLOSURE_LONG:
+			{
+				bool isLong = code[offset] == OP_CLOSURE_LONG;
+				uint32_t constant = isLong
+					? (uint32_t)((code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3])
+					: code[offset + 1];
+				uint32_t upvalues = offset + (isLong ? 4 : 2);
+				materializeAll(&translator, depth); // captured locals must be in their slots
+				emitRegister(&translator, ENCODE_ABC(ROP_CLOSURE, depth, 0, 0));
+				emitRegister(&translator, constant);
+				for (uint32_t i = upvalues; i < offset + size; i += 2)
+					emitRegister(&translator, code[i] | (code[i + 1] << 8));
+				sources[depth] = (uint8_t)depth;
+				break;
+			}
+			case OP_CLOSE_UPVALUE:
+				materializeAll(&translator, depth);
+				emitRegister(&translator, ENCODE_ABC(ROP_CLOSE_UPVALUE, top, 0, 0));
+				break;
+			case OP_PRINT:
+				emitRegister(&translator, ENCODE_ABC(ROP_PRINT, sources[top], 0, 0));
+				break;
+			case OP_RETURN:
+				emitRegister(&translator, ENCODE_ABC(ROP_RETURN, sources[top], 0, 0));
+				break;
+
+			case OP_CLASS:
+				emitRegister(&translator, ENCODE_ABC(ROP_CLASS, depth, 0, 0));
+				emitRegister(&translator, code[offset + 1]);
+				sources[depth] = (uint8_t)depth;
+				break;
+			case OP_INHERIT:
+				emitRegister(&translator, ENCODE_ABC(ROP_INHERIT, sources[top - 1], sources[top], 0));
+				break;
+			case OP_METHOD:
+			case OP_METHOD_LONG:
+			{
+				uint32_t name = code[offset] == OP_METHOD_LONG
+					? (uint32_t)((code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3])
+					: code[offset + 1];
+				emitRegister(&translator, ENCODE_ABC(ROP_METHOD, sources[top - 1], sources[top], 0));
+				emitRegister(&translator, name);
+				break;
+			}
+
+			default:
+				error("Instruction not supported by the register engine.");
+				break;
+		}
+
+		// nothing is pending after a path ends, the next instruction can only be jumped to
+		uint8_t operation = code[offset];
+		if (operation == OP_JUMP || operation == OP_LOOP || operation == OP_RETURN)
+		{
+			for (uint32_t i = 0; i < REGISTERS_MAX; ++i)
+				sources[i] = (uint8_t)i;
+			translator.lastWrite = -1;
+		}
+		offset += size;
+	}
+	newOffsets[count] = out->count;
+
+	// jump offsets count from the instruction after the offset word
+	for (uint32_t i = 0; i < translator.jumpCount; ++i)
+	{
+		uint32_t jump = translator.jumps[i];
+		out->code[jump] = (Instruction)(int32_t)(newOffsets[translator.destinations[i]] - (jump + 1));
+	}
+
+	FREE_ARRAY(int32_t, depths, count);
+	FREE_ARRAY(bool, isTarget, count + 1);
+	FREE_ARRAY(uint32_t, translator.jumps, count);
+	FREE_ARRAY(uint32_t, translator.destinations, count);
+	FREE_ARRAY(uint32_t, newOffsets, count + 1);
+}
+
 static ObjectFunction* endCompiler()
 {
 	emitReturn();
 	ObjectFunction* function = current->function; // return value
 
+	// zeroed caches start out empty
+	if (current->cacheCount > 0)
+	{
+		InlineCache* caches = ALLOCATE(InlineCache, current->cacheCount);
+		memset(caches, 0, sizeof(InlineCache) * current->cacheCount);
+		function->chunk.caches = caches;
+		function->chunk.cacheCount = current->cacheCount;
+	}
+
+	if (!parser.hadError)
+	{
+		if (vm.engine == ENGINE_REGISTER)
+			translateToRegisters(function); // reads the code before it is fused
+		optimizeChunk(&function->chunk);
+	}
+	function->maxStack = computeMaxStack(function);
+
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.hadError)
+	{
 		disassembleChunk(currentChunk(), function->name != NULL ?
 			function->name->chars : "<script>");
+		if (vm.engine == ENGINE_REGISTER)
+			disassembleRegisterChunk(function, function->name != NULL ?
+				function->name->chars : "<script>");
+	}
 #endif
 
 	current = current->enclosing; // pop compiler
@@ -540,6 +1323,8 @@ static void compileDot(bool canAssign)
 		emitByte(OP_INVOKE);
 		emitByte(nameIndex);
 		emitByte(argCount);
+		emitInlineCache();
+		return; // complete
 	}
 	else // call
 	{
@@ -550,7 +1335,12 @@ static void compileDot(bool canAssign)
 	if (nameIndex >= UINT8_COUNT)
 		emitBytesLong(opCode, nameIndex);
 	else
+	{
+		if (opCode == OP_GET_PROPERTY)
+			current->lastPropertyGet = currentChunk()->count;
 		emitBytes(opCode, nameIndex);
+	}
+	emitInlineCache();
 }
 
 static void compileBreak(bool canAssign)
@@ -585,12 +1375,14 @@ static void compileSuper(bool canAssign)
 		emitByte(OP_SUPER_INVOKE);
 		emitByte(name);
 		emitByte(argCount);
+		emitInlineCache(); // resolves the method once per superclass
 	}
 	else // getting
 	{
 		// is getting a method but not invoking it (rare)
 		compileNamedVariable(syntheticToken("super"), false);
 		emitBytes(OP_GET_SUPER, name);
+		emitInlineCache();
 	}
 }
 
@@ -656,7 +1448,27 @@ static void compileBlock()
 
 static void compileCall(bool canAssign)
 {
+	// calling a property that was just read, as in '(instance.method)(...)', is an
+	// OP_INVOKE too, so a method is called without being bound first. not when a jump
+	// lands after the read, as in '(a or b.method)()'.
+	Chunk* chunk = currentChunk();
+	uint32_t get = current->lastPropertyGet;
+	if (chunk->count >= 4 && get == chunk->count - 4 && current->lastJumpTarget != chunk->count)
+	{
+		uint8_t name = chunk->code[get + 1];
+		uint8_t cacheHigh = chunk->code[get + 2];
+		uint8_t cacheLow = chunk->code[get + 3];
+		chunk->count = get; // the instance stays where OP_INVOKE expects the receiver
+
+		uint8_t argCount = compileArgumentList();
+		emitBytes(OP_INVOKE, name);
+		emitByte(argCount);
+		emitBytes(cacheHigh, cacheLow);
+		return;
+	}
+
 	uint8_t argCount = compileArgumentList();
+	current->lastCall = currentChunk()->count;
 	emitBytes(OP_CALL, argCount);
 }
 
@@ -795,6 +1607,13 @@ static void compileReturnStatement()
 
 	compileExpression(); // compile returned value
 	consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
+
+	// returning the result of a call: let the callee take over this frame.
+	// the OP_RETURN stays for callees that aren't closures, and for branches of
+	// 'and' and 'or' that skip the call.
+	Chunk* chunk = currentChunk();
+	if (current->type != TYPE_SCRIPT && chunk->count >= 2 && current->lastCall == chunk->count - 2)
+		chunk->code[current->lastCall] = OP_TAIL_CALL;
 	emitByte(OP_RETURN);
 }
 
@@ -937,7 +1756,7 @@ static void compileClassDeclaration()
 
 	// bytecode
 	emitBytes(OP_CLASS, nameConstant);
-	defineVariable(nameConstant);
+	defineVariable(current->scopeDepth > 0 ? 0 : resolveGlobal(&className));
 
 	// enter class scope
 	ClassCompiler classCompiler; // hooray recursive descent!
@@ -1022,6 +1841,8 @@ static void compileNumber(bool canAssign)
 		emitByte(OP_ONE);
 	else if (value == -1) // never gets hit because the '-' is parsed before number
 		emitByte(OP_NEG_ONE);
+	else if (value <= INT32_MAX && value == (int32_t)value) // whole, and never negative
+		emitConstant(INT_VAL((int32_t)value));
 	else
 		emitConstant(NUMBER_VAL(value));
 }
@@ -1130,8 +1951,7 @@ static void compileNamedVariable(Token name, bool canAssign)
 	}
 	else // global
 	{
-		// TODO - account for globals assigned an index > 256
-		arg = parseIdentifierConstant(&name);
+		arg = resolveGlobal(&name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
@@ -1151,12 +1971,9 @@ static void compileNamedVariable(Token name, bool canAssign)
 	// emit code
 	if (arg < UINT8_COUNT)
 		emitBytes(opCode, (uint8_t)arg);
-	else
-	{
-		// should only get here if it's a global
-		error("Long variables are not supported yet. TODO.");
-		emitBytesLong(opCode + 1, (uint32_t)arg); // TODO - support LONG variant
-	}
+	else // only globals get this far
+		emitBytesLong(opCode + 1, (uint32_t)arg); // _LONG variant follows
+
 }
 
 static void compileVariable(bool canAssign)
@@ -1325,7 +2142,19 @@ static uint32_t parseVariable(const char* errorMessage)
 	if (current->scopeDepth > 0)
 		return 0; // dummy table index
 
-	return parseIdentifierConstant(&parser.previous);
+	return resolveGlobal(&parser.previous);
+}
+
+/// <summary>
+/// Index of a global variable in vm.globalValues.
+/// </summary>
+static uint32_t resolveGlobal(Token* name)
+{
+	ObjectString* identifier = copyString(name->start, name->length);
+	uint32_t slot = globalSlot(identifier);
+	if (slot >= GLOBALS_MAX)
+		error("Too many global variables.");
+	return slot;
 }
 
 static void defineVariable(uint32_t global)
@@ -1337,8 +2166,10 @@ static void defineVariable(uint32_t global)
 		return;
 	}
 
-	// TODO - support OP_DEFINE_GLOBAL_LONG
-	emitBytes(OP_DEFINE_GLOBAL, global & 0xff);
+	if (global < UINT8_COUNT)
+		emitBytes(OP_DEFINE_GLOBAL, (uint8_t)global);
+	else
+		emitBytesLong(OP_DEFINE_GLOBAL_LONG, global);
 }
 
 /// <summary>
@@ -21,6 +21,25 @@ static uint32_t constantInstruction(const char* name,
 	return offset + 2; // op and index of const
 }
 
+static uint32_t localsInstruction(const char* name,
+	Chunk* chunk, uint32_t offset)
+{
+	printf("%-16s %4d %4d\n", name,
+		chunk->code[offset + 1], chunk->code[offset + 2]);
+	return offset + 3; // op and two slots
+}
+
+static uint32_t localConstantInstruction(const char* name,
+	Chunk* chunk, uint32_t offset)
+{
+	uint8_t slot = chunk->code[offset + 1];
+	uint8_t constantIndex = chunk->code[offset + 2];
+	printf("%-16s %4d %4d '", name, slot, constantIndex);
+	printValue(chunk->constants.values[constantIndex]);
+	printf("'\n");
+	return offset + 3; // op, slot and index of const
+}
+
 static uint32_t constantLongInstruction(const char* name,
 	Chunk* chunk, uint32_t offset)
 {
@@ -40,6 +59,42 @@ static uint32_t constantLongInstruction(const char* name,
 	return offset + 4; // op and 3 bytes of index
 }
 
+static uint32_t propertyInstruction(const char* name,
+	Chunk* chunk, uint32_t offset)
+{
+	uint8_t* code = chunk->code; // fetch once
+	uint8_t constantIndex = code[offset + 1];
+	uint16_t cache = (uint16_t)((code[offset + 2] << 8) | code[offset + 3]);
+	printf("%-16s %4d '", name, constantIndex);
+	printValue(chunk->constants.values[constantIndex]);
+	printf("' (cache %d)\n", cache);
+	return offset + 4; // op, index of const and cache
+}
+
+static uint32_t propertyLongInstruction(const char* name,
+	Chunk* chunk, uint32_t offset)
+{
+	uint8_t* code = chunk->code; // fetch once
+	uint32_t constantIndex = (code[offset + 1] << 16)
+		| (code[offset + 2] << 8) | code[offset + 3];
+	uint16_t cache = (uint16_t)((code[offset + 4] << 8) | code[offset + 5]);
+	printf("%-16s %4d '", name, constantIndex);
+	printValue(chunk->constants.values[constantIndex]);
+	printf("' (cache %d)\n", cache);
+	return offset + 6; // op, 3 bytes of index and cache
+}
+
+static uint32_t globalInstruction(const char* name, bool isLong,
+	Chunk* chunk, uint32_t offset)
+{
+	uint8_t* code = chunk->code; // fetch once
+	uint32_t slot = isLong
+		? (uint32_t)((code[offset + 1] << 16) | (code[offset + 2] << 8) | code[offset + 3])
+		: code[offset + 1];
+	printf("%-16s %4d '%s'\n", name, slot, AS_CSTRING(vm.globalNames.values[slot]));
+	return offset + (isLong ? 4 : 2); // op and slot
+}
+
 static uint32_t jumpInstruction(const char* name, int32_t sign,
 	Chunk* chunk, uint32_t offset)
 {
@@ -50,20 +105,22 @@ static uint32_t jumpInstruction(const char* name, int32_t sign,
 	return offset + 3;
 }
 
-static uint32_t invokeInstruction(const char* name, Chunk* chunk, uint32_t offset)
+static uint32_t invokeCachedInstruction(const char* name, Chunk* chunk, uint32_t offset)
 {
 	// get operands
-	uint8_t constantIndex = chunk->code[offset + 1];
-	uint8_t argCount = chunk->code[offset + 2];
-	
+	uint8_t* code = chunk->code; // fetch once
+	uint8_t constantIndex = code[offset + 1];
+	uint8_t argCount = code[offset + 2];
+	uint16_t cache = (uint16_t)((code[offset + 3] << 8) | code[offset + 4]);
+
 	// print op
 	printf("%-16s (%d args) %4d '", name, argCount, constantIndex);
 
 	// print method
 	printValue(chunk->constants.values[constantIndex]);
 
-	printf("'\n");
-	return offset + 3;
+	printf("' (cache %d)\n", cache);
+	return offset + 5;
 }
 
 static uint32_t simpleInstruction(const char* name, uint32_t offset)
@@ -143,25 +200,31 @@ uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset)
 		case OP_SET_LOCAL:
 			return byteInstruction("OP_SET_LOCAL", chunk, offset);
 		case OP_DEFINE_GLOBAL:
-			return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+			return globalInstruction("OP_DEFINE_GLOBAL", false, chunk, offset);
+		case OP_DEFINE_GLOBAL_LONG:
+			return globalInstruction("OP_DEFINE_GLOBAL_LONG", true, chunk, offset);
 		case OP_GET_GLOBAL:
-			return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+			return globalInstruction("OP_GET_GLOBAL", false, chunk, offset);
+		case OP_GET_GLOBAL_LONG:
+			return globalInstruction("OP_GET_GLOBAL_LONG", true, chunk, offset);
 		case OP_SET_GLOBAL:
-			return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+			return globalInstruction("OP_SET_GLOBAL", false, chunk, offset);
+		case OP_SET_GLOBAL_LONG:
+			return globalInstruction("OP_SET_GLOBAL_LONG", true, chunk, offset);
 		case OP_GET_SUPER:
-			return constantInstruction("OP_GET_SUPER", chunk, offset);
+			return propertyInstruction("OP_GET_SUPER", chunk, offset);
 		case OP_GET_UPVALUE:
 			return byteInstruction("OP_GET_UPVALUE", chunk, offset);
 		case OP_SET_UPVALUE:
 			return byteInstruction("OP_GET_UPVALUE", chunk, offset);
 		case OP_GET_PROPERTY:
-			return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+			return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
 		case OP_GET_PROPERTY_LONG:
-			return constantLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
+			return propertyLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
 		case OP_SET_PROPERTY:
-			return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+			return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
 		case OP_SET_PROPERTY_LONG:
-			return constantLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
+			return propertyLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
 
 		// boolean
 		case OP_EQUAL: 
@@ -176,6 +239,10 @@ uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset)
 		// arithmetic
 		case OP_ADD:
 			return simpleInstruction("OP_ADD", offset);
+		case OP_ADD_NUM:
+			return simpleInstruction("OP_ADD_NUM", offset);
+		case OP_ADD_STR:
+			return simpleInstruction("OP_ADD_STR", offset);
 		case OP_SUBTRACT:
 			return simpleInstruction("OP_SUBTRACT", offset);
 		case OP_MULTIPLY:
@@ -198,10 +265,12 @@ uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset)
 		// functions
 		case OP_CALL:
 			return byteInstruction("OP_CALL", chunk, offset);
+		case OP_TAIL_CALL:
+			return byteInstruction("OP_TAIL_CALL", chunk, offset);
 		case OP_INVOKE:
-			return invokeInstruction("OP_INVOKE", chunk, offset);
+			return invokeCachedInstruction("OP_INVOKE", chunk, offset);
 		case OP_SUPER_INVOKE:
-			return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+			return invokeCachedInstruction("OP_SUPER_INVOKE", chunk, offset);
 		case OP_CLOSURE:
 		{
 			offset++;
@@ -253,6 +322,22 @@ uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset)
 		case OP_METHOD_LONG:
 			return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
 
+		// superinstructions
+		case OP_GET_LOCAL_LOCAL:
+			return localsInstruction("OP_GET_LOCAL_LOCAL", chunk, offset);
+		case OP_GET_LOCAL_CONSTANT:
+			return localConstantInstruction("OP_GET_LOCAL_CONSTANT", chunk, offset);
+		case OP_SET_LOCAL_POP:
+			return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+		case OP_POP_JUMP_IF_FALSE:
+			return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_LESS:
+			return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_GREATER:
+			return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+		case OP_POP_LOOP:
+			return jumpInstruction("OP_POP_LOOP", -1, chunk, offset);
+
 		default:
 			printf("Unknown opcode %d\n", instruction);
 			return offset + 1;
@@ -260,3 +345,200 @@ uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset)
 
 	return 0;
 }
+
+static uint32_t registerInstruction(const char* name, uint32_t operands,
+	Instruction instruction, uint32_t offset)
+{
+	printf("%-22s", name);
+	if (operands > 0) printf(" r%d", DECODE_A(instruction));
+	if (operands > 1) printf(" r%d", DECODE_B(instruction));
+	if (operands > 2) printf(" r%d", DECODE_C(instruction));
+	printf("\n");
+	return offset + 1;
+}
+
+/// <summary>
+/// Instruction with a constant (name) word after it, and 'extra' words after that.
+/// </summary>
+static uint32_t registerConstantInstruction(const char* name, uint32_t operands,
+	ObjectFunction* function, uint32_t offset, uint32_t extra)
+{
+	Instruction* code = function->registerChunk.code; // fetch once
+	printf("%-22s", name);
+	if (operands > 0) printf(" r%d", DECODE_A(code[offset]));
+	if (operands > 1) printf(" r%d", DECODE_B(code[offset]));
+	if (operands > 2) printf(" r%d", DECODE_C(code[offset]));
+	printf(" '");
+	printValue(function->chunk.constants.values[code[offset + 1]]);
+	printf("'\n");
+	return offset + 2 + extra;
+}
+
+static uint32_t registerGlobalInstruction(const char* name,
+	ObjectFunction* function, uint32_t offset)
+{
+	Instruction* code = function->registerChunk.code; // fetch once
+	uint32_t slot = code[offset + 1];
+	printf("%-22s r%d %4d '%s'\n", name, DECODE_A(code[offset]), slot,
+		AS_CSTRING(vm.globalNames.values[slot]));
+	return offset + 2; // op and slot
+}
+
+static uint32_t registerJumpInstruction(const char* name, uint32_t operands,
+	ObjectFunction* function, uint32_t offset)
+{
+	Instruction* code = function->registerChunk.code; // fetch once
+	int32_t jump = (int32_t)code[offset + 1];
+	printf("%-22s", name);
+	if (operands > 0) printf(" r%d", DECODE_A(code[offset]));
+	if (operands > 1) printf(" r%d", DECODE_B(code[offset]));
+	printf(" -> %04d\n", offset + 2 + jump);
+	return offset + 2;
+}
+
+void disassembleRegisterChunk(ObjectFunction* function, const char* name)
+{
+	printf("== %s (registers) ==\n", name);
+
+	for (uint32_t offset = 0; offset < function->registerChunk.count;)
+	{
+		offset = disassembleRegisterInstruction(function, offset);
+	}
+}
+
+uint32_t disassembleRegisterInstruction(ObjectFunction* function, uint32_t offset)
+{
+	RegisterChunk* chunk = &function->registerChunk;
+	printf("%04d ", offset);
+
+	// handle line number
+	if (offset > 0 &&
+		(chunk->lines[offset] == chunk->lines[offset - 1]))
+	{
+		// still on same line
+		printf("   | ");
+	}
+	else
+	{
+		// print line number
+		printf("%4d ", chunk->lines[offset]);
+	}
+
+	// decode
+	Instruction instruction = chunk->code[offset];
+	switch (DECODE_OP(instruction))
+	{
+		case ROP_MOVE:
+			return registerInstruction("ROP_MOVE", 2, instruction, offset);
+		case ROP_CONSTANT:
+		{
+			uint32_t constant = DECODE_BX(instruction);
+			printf("%-22s r%d %4d '", "ROP_CONSTANT", DECODE_A(instruction), constant);
+			printValue(function->chunk.constants.values[constant]);
+			printf("'\n");
+			return offset + 1;
+		}
+		case ROP_CONSTANT_LONG:
+			return registerConstantInstruction("ROP_CONSTANT_LONG", 1, function, offset, 0);
+		case ROP_NIL:
+			return registerInstruction("ROP_NIL", 1, instruction, offset);
+		case ROP_TRUE:
+			return registerInstruction("ROP_TRUE", 1, instruction, offset);
+		case ROP_FALSE:
+			return registerInstruction("ROP_FALSE", 1, instruction, offset);
+
+		// variables
+		case ROP_DEFINE_GLOBAL:
+			return registerGlobalInstruction("ROP_DEFINE_GLOBAL", function, offset);
+		case ROP_GET_GLOBAL:
+			return registerGlobalInstruction("ROP_GET_GLOBAL", function, offset);
+		case ROP_SET_GLOBAL:
+			return registerGlobalInstruction("ROP_SET_GLOBAL", function, offset);
+		case ROP_GET_UPVALUE:
+			printf("%-22s r%d ^%d\n", "ROP_GET_UPVALUE", DECODE_A(instruction), DECODE_B(instruction));
+			return offset + 1;
+		case ROP_SET_UPVALUE:
+			printf("%-22s r%d ^%d\n", "ROP_SET_UPVALUE", DECODE_A(instruction), DECODE_B(instruction));
+			return offset + 1;
+		case ROP_GET_PROPERTY:
+			return registerConstantInstruction("ROP_GET_PROPERTY", 2, function, offset, 1);
+		case ROP_SET_PROPERTY:
+			return registerConstantInstruction("ROP_SET_PROPERTY", 3, function, offset, 1);
+		case ROP_GET_SUPER:
+			return registerConstantInstruction("ROP_GET_SUPER", 3, function, offset, 1);
+
+		// operators
+		case ROP_EQUAL:
+			return registerInstruction("ROP_EQUAL", 3, instruction, offset);
+		case ROP_GREATER:
+			return registerInstruction("ROP_GREATER", 3, instruction, offset);
+		case ROP_LESS:
+			return registerInstruction("ROP_LESS", 3, instruction, offset);
+		case ROP_ADD:
+			return registerInstruction("ROP_ADD", 3, instruction, offset);
+		case ROP_SUBTRACT:
+			return registerInstruction("ROP_SUBTRACT", 3, instruction, offset);
+		case ROP_MULTIPLY:
+			return registerInstruction("ROP_MULTIPLY", 3, instruction, offset);
+		case ROP_DIVIDE:
+			return registerInstruction("ROP_DIVIDE", 3, instruction, offset);
+		case ROP_NOT:
+			return registerInstruction("ROP_NOT", 2, instruction, offset);
+		case ROP_NEGATE:
+			return registerInstruction("ROP_NEGATE", 2, instruction, offset);
+
+		// control flow
+		case ROP_JUMP:
+			return registerJumpInstruction("ROP_JUMP", 0, function, offset);
+		case ROP_JUMP_IF_FALSE:
+			return registerJumpInstruction("ROP_JUMP_IF_FALSE", 1, function, offset);
+		case ROP_JUMP_IF_NOT_LESS:
+			return registerJumpInstruction("ROP_JUMP_IF_NOT_LESS", 2, function, offset);
+		case ROP_JUMP_IF_NOT_GREATER:
+			return registerJumpInstruction("ROP_JUMP_IF_NOT_GREATER", 2, function, offset);
+
+		// functions
+		case ROP_CALL:
+			printf("%-22s r%d (%d args)\n", "ROP_CALL", DECODE_A(instruction), DECODE_B(instruction));
+			return offset + 1;
+		case ROP_TAIL_CALL:
+			printf("%-22s r%d (%d args)\n", "ROP_TAIL_CALL", DECODE_A(instruction), DECODE_B(instruction));
+			return offset + 1;
+		case ROP_INVOKE:
+			return registerConstantInstruction("ROP_INVOKE", 2, function, offset, 1);
+		case ROP_SUPER_INVOKE:
+			return registerConstantInstruction("ROP_SUPER_INVOKE", 3, function, offset, 1);
+		case ROP_CLOSURE:
+		{
+			Value constant = function->chunk.constants.values[chunk->code[offset + 1]];
+			offset = registerConstantInstruction("ROP_CLOSURE", 1, function, offset, 0);
+
+			// print enclosed variables
+			for (uint32_t j = 0; j < AS_FUNCTION(constant)->upvalueCount; ++j)
+			{
+				Instruction upvalue = chunk->code[offset];
+				printf("%04d	|			%s %d\n",
+					offset++, (upvalue & 0xff) ? "local" : "upvalue", upvalue >> 8);
+			}
+			return offset;
+		}
+		case ROP_CLOSE_UPVALUE:
+			return registerInstruction("ROP_CLOSE_UPVALUE", 1, instruction, offset);
+		case ROP_PRINT:
+			return registerInstruction("ROP_PRINT", 1, instruction, offset);
+		case ROP_RETURN:
+			return registerInstruction("ROP_RETURN", 1, instruction, offset);
+
+		// classes
+		case ROP_CLASS:
+			return registerConstantInstruction("ROP_CLASS", 1, function, offset, 0);
+		case ROP_INHERIT:
+			return registerInstruction("ROP_INHERIT", 2, instruction, offset);
+		case ROP_METHOD:
+			return registerConstantInstruction("ROP_METHOD", 2, function, offset, 0);
+
+		default:
+			printf("Unknown opcode %d\n", DECODE_OP(instruction));
+			return offset + 1;
+	}
+}
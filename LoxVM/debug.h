@@ -3,3 +3,5 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 uint32_t disassembleInstruction(Chunk* chunk, uint32_t offset);
+void disassembleRegisterChunk(ObjectFunction* function, const char* name);
+uint32_t disassembleRegisterInstruction(ObjectFunction* function, uint32_t offset);
@@ -0,0 +1,480 @@
+#include <stdio.h>
+
+#include "jit.h"
+
+#ifdef JIT_X64
+
+#include "assembler.h"
+#include "memory.h"
+#include "platform.h"
+
+// a baseline compiler: every bytecode instruction becomes a fixed template of x86-64.
+// the code keeps the interpreter's state where run() keeps it (values on vm.stack,
+// locals at frame->slots), so it can hand control back at any instruction boundary by
+// returning that instruction's address. run() executes it and carries on from there.
+// the templates cover stack shuffling, locals, globals, upvalues, numbers and jumps.
+// calls, returns, the object model and failed type guards all leave for run().
+//
+// layout of the code buffer:
+//   entry stub   saves registers, loads the interpreter registers, jumps to the
+//                instruction run() asked for
+//   exit stub    stores the stack top to vm.sp and returns the bytecode address in rax
+//   body         the templates, in bytecode order
+//   side exits   one per guard, loads the guarded instruction's address for the exit stub
+
+// displacement of PEEK(distance) from SP
+#define STACK(distance) (-(int32_t)sizeof(Value) * ((distance) + 1))
+
+/// <summary>
+/// Jump to the template of the instruction at bytecode 'offset'.
+/// </summary>
+static void emitBranch(Assembler* a, Condition condition, uint32_t offset)
+{
+	addFixup(a, emitJump(a, condition), offset, false);
+}
+
+/// <summary>
+/// Leave for run() at the instruction at 'offset' when 'condition' holds.
+/// </summary>
+static void emitExitIf(Assembler* a, Condition condition, uint32_t offset)
+{
+	addFixup(a, emitJump(a, condition), offset, true);
+}
+
+static void emitPush(Assembler* a, Register source)
+{
+	emitStore(a, SP, 0, source);
+	emitAddImmediate(a, SP, (int32_t)sizeof(Value), false);
+}
+
+static void emitPop(Assembler* a, uint32_t count)
+{
+	emitAddImmediate(a, SP, (int32_t)(count * sizeof(Value)), true);
+}
+
+static void emitPushValue(Assembler* a, Value value)
+{
+	emitImmediate(a, RAX, value);
+	emitPush(a, RAX);
+}
+
+static void emitGetLocal(Assembler* a, uint8_t slot)
+{
+	emitLoad(a, RAX, SLOTS, (int32_t)(slot * sizeof(Value)));
+	emitPush(a, RAX);
+}
+
+/// <summary>
+/// Leave for run() at 'offset' unless 'value' holds a number, which is left as a double.
+/// The templates only do double arithmetic. Clobbers rdx and 'xmm'.
+/// </summary>
+static void emitNumberGuard(Assembler* a, Register value, uint8_t xmm, uint32_t offset)
+{
+	emitMove(a, RDX, value);
+	emitRegisters(a, X64_AND, QNAN_BITS, RDX);
+	emitRegisters(a, X64_CMP, QNAN_BITS, RDX);
+	uint32_t isDouble = emitJump(a, CONDITION_NOT_EQUAL);
+
+	// the conversion leaves the flags of its tag compare, so anything but an integer leaves
+	emitIntToDouble(a, value, xmm);
+	emitExitIf(a, CONDITION_NOT_EQUAL, offset);
+	patchJump(a, isDouble, a->count);
+}
+
+/// <summary>
+/// Load the left operand to xmm0 and rax and the right to xmm1 and rcx,
+/// leaving for run() unless both are numbers.
+/// </summary>
+static void emitNumberOperands(Assembler* a, uint32_t offset)
+{
+	emitLoad(a, RAX, SP, STACK(1));
+	emitLoad(a, RCX, SP, STACK(0));
+	emitNumberGuard(a, RAX, 0, offset);
+	emitNumberGuard(a, RCX, 1, offset);
+	emitToDouble(a, 0, RAX);
+	emitToDouble(a, 1, RCX);
+}
+
+static void emitArithmetic(Assembler* a, uint8_t opcode, uint32_t offset)
+{
+	emitNumberOperands(a, offset);
+	if (opcode == SSE_DIVIDE)
+	{
+		// leave +-0 to run(), which reports the division by zero
+		emitRegisters(a, X64_ADD, RCX, RCX); // shifts out the sign
+		emitExitIf(a, CONDITION_EQUAL, offset);
+	}
+
+	emitArithmeticDouble(a, opcode, 0, 1);
+	emitFromDouble(a, RAX, 0);
+	emitPop(a, 1);
+	emitStore(a, SP, STACK(0), RAX);
+}
+
+/// <summary>
+/// Set the flags of 'a < b' (isLess) or 'a > b' as 'above', for two loaded operands.
+/// 'above' is false when either is NaN, like the comparisons in C.
+/// </summary>
+static void emitCompareOperands(Assembler* a, bool isLess)
+{
+	if (isLess)
+		emitCompareDoubles(a, 1, 0); // b > a
+	else
+		emitCompareDoubles(a, 0, 1);
+}
+
+static void emitComparison(Assembler* a, bool isLess, uint32_t offset)
+{
+	emitNumberOperands(a, offset);
+	emitPop(a, 1);
+	emitCompareOperands(a, isLess);
+	emitImmediate(a, RAX, FALSE_VAL);
+	emitImmediate(a, RCX, TRUE_VAL);
+	emitConditionalMove(a, CONDITION_ABOVE, RAX, RCX);
+	emitStore(a, SP, STACK(0), RAX);
+}
+
+/// <summary>
+/// Set the flags so 'below or equal' means rax is falsey. nil and false are adjacent tags.
+/// </summary>
+static void emitFalseyTest(Assembler* a)
+{
+	emitMove(a, RCX, RAX);
+	emitImmediate(a, RDX, NIL_VAL);
+	emitRegisters(a, X64_SUB, RDX, RCX);
+	emitCompareImmediate(a, RCX, 1);
+}
+
+/// <summary>
+/// Load the address of global 'slot' to rcx.
+/// vm.globalValues may have grown since the code was compiled, so look it up each time.
+/// </summary>
+static void emitGlobalAddress(Assembler* a, uint32_t slot)
+{
+	emitImmediate(a, RCX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+	emitLoad(a, RCX, RCX, 0);
+	emitAddImmediate(a, RCX, (int32_t)(slot * sizeof(Value)), false);
+}
+
+/// <summary>
+/// Leave for run() at 'offset' if rax holds an undefined global. Clobbers rdx.
+/// </summary>
+static void emitDefinedGuard(Assembler* a, uint32_t offset)
+{
+	emitImmediate(a, RDX, UNDEFINED_VAL);
+	emitRegisters(a, X64_CMP, RDX, RAX);
+	emitExitIf(a, CONDITION_EQUAL, offset);
+}
+
+/// <summary>
+/// Load the location of upvalue 'index' to rax.
+/// </summary>
+static void emitUpvalueLocation(Assembler* a, uint8_t index)
+{
+	// the pointers live inside the closure
+	emitLoad(a, RAX, CLOSURE,
+		(int32_t)(offsetof(ObjectClosure, upvalues) + index * sizeof(ObjectUpvalue*)));
+	emitLoad(a, RAX, RAX, offsetof(ObjectUpvalue, location));
+}
+
+/// <summary>
+/// Call a native taking 'argCount' (1 or 2) numbers without going through its shim:
+/// the arguments go to the C function in xmm registers and the result replaces the
+/// callee. Leaves for run() unless the callee has that signature and gets numbers.
+/// </summary>
+static void emitNumberNativeCall(Assembler* a, uint8_t argCount, uint32_t offset)
+{
+	// callee is an object, a native, and of the right signature
+	emitLoad(a, RAX, SP, STACK(argCount));
+	emitImmediate(a, RCX, QNAN | SIGN_BIT);
+	emitMove(a, RDX, RAX);
+	emitRegisters(a, X64_AND, RCX, RDX);
+	emitRegisters(a, X64_CMP, RCX, RDX);
+	emitExitIf(a, CONDITION_NOT_EQUAL, offset);
+	emitImmediate(a, RCX, ~(QNAN | SIGN_BIT));
+	emitRegisters(a, X64_AND, RCX, RAX);
+	emitCompareObjectType(a, RAX, OBJECT_NATIVE);
+	emitExitIf(a, CONDITION_NOT_EQUAL, offset);
+	emitCompareMemory(a, RAX, offsetof(ObjectNative, signature),
+		argCount == 1 ? NATIVE_NUMBER_1 : NATIVE_NUMBER_2);
+	emitExitIf(a, CONDITION_NOT_EQUAL, offset);
+
+	for (uint8_t i = 0; i < argCount; ++i)
+	{
+		emitLoad(a, RCX, SP, STACK(argCount - 1 - i));
+		emitNumberGuard(a, RCX, i, offset);
+		emitToDouble(a, i, RCX);
+	}
+
+	// number natives neither allocate nor fail, nothing else needs to be in memory
+	emitLoad(a, RAX, RAX, offsetof(ObjectNative, typed));
+	emitCallRegister(a, RAX);
+	emitFromDouble(a, RAX, 0);
+	emitPop(a, argCount);
+	emitStore(a, SP, STACK(0), RAX);
+}
+
+static void printTop(Value value)
+{
+	printValue(value);
+	printf("\n");
+}
+
+/// <summary>
+/// Called for two objects with different bits, which may still be equal strings.
+/// </summary>
+static Value equalObjects(Value a, Value b)
+{
+	return BOOL_VAL(valuesEqual(a, b));
+}
+
+static void emitEqual(Assembler* a)
+{
+	emitLoad(a, RAX, SP, STACK(1));
+	emitLoad(a, RCX, SP, STACK(0));
+	emitIntToDouble(a, RAX, 0); // 1 == 1.0
+	emitIntToDouble(a, RCX, 1);
+	emitPop(a, 1);
+	emitRegisters(a, X64_CMP, RCX, RAX); // NaN-boxed values are equal by bits, as in valuesEqual()
+	uint32_t isSame = emitJump(a, CONDITION_EQUAL);
+
+	// ...except a rope and a string, so two objects ask valuesEqual()
+	emitImmediate(a, R8, QNAN | SIGN_BIT);
+	emitMove(a, RDX, RAX);
+	emitRegisters(a, X64_AND, RCX, RDX);
+	emitRegisters(a, X64_AND, R8, RDX);
+	emitRegisters(a, X64_CMP, R8, RDX);
+	uint32_t isNotObjects = emitJump(a, CONDITION_NOT_EQUAL);
+	emitMove(a, ARGUMENT_1, RCX); // first, rcx is an argument register on Windows
+	emitMove(a, ARGUMENT_0, RAX);
+	emitCall(a, (void*)&equalObjects);
+	uint32_t isCompared = emitJump(a, CONDITION_ALWAYS);
+
+	patchJump(a, isNotObjects, a->count);
+	emitImmediate(a, RAX, FALSE_VAL);
+	uint32_t isDifferent = emitJump(a, CONDITION_ALWAYS);
+	patchJump(a, isSame, a->count);
+	emitImmediate(a, RAX, TRUE_VAL);
+	patchJump(a, isCompared, a->count);
+	patchJump(a, isDifferent, a->count);
+	emitStore(a, SP, STACK(0), RAX);
+}
+
+/// <summary>
+/// Translate the instruction at 'offset'.
+/// </summary>
+static void emitInstruction(Assembler* a, Chunk* chunk, uint32_t offset)
+{
+	uint8_t* code = chunk->code + offset;
+	Value* constants = chunk->constants.values;
+	uint32_t destination = 0;
+	jumpDestination(chunk, offset, &destination);
+
+	switch (code[0])
+	{
+		// constants are baked into the code. the function keeps them alive.
+		case OP_CONSTANT: emitPushValue(a, constants[code[1]]); break;
+		case OP_CONSTANT_LONG:
+			emitPushValue(a, constants[(code[1] << 16) | (code[2] << 8) | code[3]]);
+			break;
+		case OP_CONSTANT_ZERO: emitPushValue(a, constants[0]); break;
+		case OP_ZERO: emitPushValue(a, NUMBER_VAL(0)); break;
+		case OP_ONE: emitPushValue(a, NUMBER_VAL(1)); break;
+		case OP_NEG_ONE: emitPushValue(a, NUMBER_VAL(-1)); break;
+		case OP_NIL: emitPushValue(a, NIL_VAL); break;
+		case OP_TRUE: emitPushValue(a, TRUE_VAL); break;
+		case OP_FALSE: emitPushValue(a, FALSE_VAL); break;
+		case OP_POP: emitPop(a, 1); break;
+		case OP_POPN: emitPop(a, code[1]); break;
+
+		case OP_GET_LOCAL: emitGetLocal(a, code[1]); break;
+		case OP_SET_LOCAL:
+			emitLoad(a, RAX, SP, STACK(0));
+			emitStore(a, SLOTS, (int32_t)(code[1] * sizeof(Value)), RAX);
+			break;
+		case OP_DEFINE_GLOBAL:
+		case OP_DEFINE_GLOBAL_LONG:
+			emitGlobalAddress(a, code[0] == OP_DEFINE_GLOBAL_LONG
+				? (code[1] << 16) | (code[2] << 8) | code[3] : code[1]);
+			emitLoad(a, RAX, SP, STACK(0));
+			emitStore(a, RCX, 0, RAX);
+			emitPop(a, 1);
+			break;
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG:
+			emitGlobalAddress(a, code[0] == OP_GET_GLOBAL_LONG
+				? (code[1] << 16) | (code[2] << 8) | code[3] : code[1]);
+			emitLoad(a, RAX, RCX, 0);
+			emitDefinedGuard(a, offset);
+			emitPush(a, RAX);
+			break;
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_LONG:
+			emitGlobalAddress(a, code[0] == OP_SET_GLOBAL_LONG
+				? (code[1] << 16) | (code[2] << 8) | code[3] : code[1]);
+			emitLoad(a, RAX, RCX, 0);
+			emitDefinedGuard(a, offset);
+			emitLoad(a, RAX, SP, STACK(0));
+			emitStore(a, RCX, 0, RAX);
+			break;
+		case OP_GET_UPVALUE:
+			emitUpvalueLocation(a, code[1]);
+			emitLoad(a, RAX, RAX, 0);
+			emitPush(a, RAX);
+			break;
+		case OP_SET_UPVALUE:
+			emitUpvalueLocation(a, code[1]);
+			emitLoad(a, RCX, SP, STACK(0));
+			emitStore(a, RAX, 0, RCX);
+			break;
+
+		case OP_EQUAL: emitEqual(a); break;
+		case OP_GREATER: emitComparison(a, false, offset); break;
+		case OP_LESS: emitComparison(a, true, offset); break;
+
+		// strings and type errors leave for run()
+		case OP_ADD:
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+			emitArithmetic(a, SSE_ADD, offset);
+			break;
+		case OP_SUBTRACT: emitArithmetic(a, SSE_SUBTRACT, offset); break;
+		case OP_MULTIPLY: emitArithmetic(a, SSE_MULTIPLY, offset); break;
+		case OP_DIVIDE: emitArithmetic(a, SSE_DIVIDE, offset); break;
+		case OP_NOT:
+			emitLoad(a, RAX, SP, STACK(0));
+			emitFalseyTest(a);
+			emitImmediate(a, RAX, FALSE_VAL);
+			emitImmediate(a, RCX, TRUE_VAL);
+			emitConditionalMove(a, CONDITION_BELOW_EQUAL, RAX, RCX);
+			emitStore(a, SP, STACK(0), RAX);
+			break;
+		case OP_NEGATE:
+			emitLoad(a, RAX, SP, STACK(0));
+			emitNumberGuard(a, RAX, 0, offset);
+			emitImmediate(a, RCX, SIGN_BIT);
+			emitRegisters(a, X64_XOR, RCX, RAX);
+			emitStore(a, SP, STACK(0), RAX);
+			break;
+
+		case OP_JUMP_IF_FALSE:
+			emitLoad(a, RAX, SP, STACK(0));
+			emitFalseyTest(a);
+			emitBranch(a, CONDITION_BELOW_EQUAL, destination);
+			break;
+		case OP_JUMP:
+		case OP_LOOP:
+			emitBranch(a, CONDITION_ALWAYS, destination);
+			break;
+
+		case OP_PRINT:
+			emitLoad(a, ARGUMENT_0, SP, STACK(0));
+			emitPop(a, 1);
+			emitCall(a, (void*)&printTop);
+			break;
+
+		case OP_CALL:
+			if (code[1] == 1 || code[1] == 2)
+				emitNumberNativeCall(a, code[1], offset);
+			else
+				emitExit(a, code);
+			break;
+
+		// superinstructions
+		case OP_GET_LOCAL_LOCAL:
+			emitGetLocal(a, code[1]);
+			emitGetLocal(a, code[2]);
+			break;
+		case OP_GET_LOCAL_CONSTANT:
+			emitGetLocal(a, code[1]);
+			emitPushValue(a, constants[code[2]]);
+			break;
+		case OP_SET_LOCAL_POP:
+			emitLoad(a, RAX, SP, STACK(0));
+			emitStore(a, SLOTS, (int32_t)(code[1] * sizeof(Value)), RAX);
+			emitPop(a, 1);
+			break;
+		case OP_POP_JUMP_IF_FALSE:
+			emitLoad(a, RAX, SP, STACK(0));
+			emitPop(a, 1);
+			emitFalseyTest(a);
+			emitBranch(a, CONDITION_BELOW_EQUAL, destination);
+			break;
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+			emitNumberOperands(a, offset);
+			emitPop(a, 2);
+			emitCompareOperands(a, code[0] == OP_JUMP_IF_NOT_LESS);
+			emitBranch(a, CONDITION_BELOW_EQUAL, destination);
+			break;
+		case OP_POP_LOOP:
+			emitPop(a, 1);
+			emitBranch(a, CONDITION_ALWAYS, destination);
+			break;
+
+		// calls, returns, closures, classes and property access: frames change, objects
+		// get allocated or errors get reported, all of which run() already knows how to do.
+		default:
+			emitExit(a, code);
+			break;
+	}
+}
+
+void compileJit(ObjectFunction* function)
+{
+	Chunk* chunk = &function->chunk;
+	Assembler a;
+	initAssembler(&a);
+	uint32_t* entries = ALLOCATE(uint32_t, chunk->count);
+
+	emitEntryStub(&a);
+	emitExitStub(&a);
+
+	for (uint32_t offset = 0; offset < chunk->count; offset += instructionSize(chunk, offset))
+	{
+		entries[offset] = a.count;
+		emitInstruction(&a, chunk, offset);
+	}
+
+	// jumps were emitted before their destinations were known, side exits go at the end
+	for (uint32_t i = 0; i < a.fixupCount; ++i)
+	{
+		Fixup* fixup = &a.fixups[i];
+		if (!fixup->isExit)
+		{
+			patchJump(&a, fixup->at, entries[fixup->target]);
+			continue;
+		}
+
+		patchJump(&a, fixup->at, a.count);
+		emitExit(&a, chunk->code + fixup->target);
+	}
+
+	JitCode* jit = ALLOCATE(JitCode, 1);
+	jit->code = finishAssembler(&a, &jit->size);
+	jit->entries = entries;
+	jit->entryCount = chunk->count;
+	function->jit = jit;
+
+	freeAssembler(&a);
+}
+
+uint8_t* runJit(CallFrame* frame, uint8_t* ip, Value* sp)
+{
+	ObjectFunction* function = frame->closure->function;
+	JitCode* jit = function->jit;
+	JitEntry entry = (JitEntry)(void*)jit->code;
+	return entry(jit->code + jit->entries[ip - function->chunk.code],
+		frame->slots, sp, frame->closure);
+}
+
+void freeJit(JitCode* jit)
+{
+	if (jit == NULL) return;
+
+	freeExecutable(jit->code, jit->size);
+	FREE_ARRAY(uint32_t, jit->entries, jit->entryCount);
+	FREE(JitCode, jit);
+}
+
+#endif
@@ -0,0 +1,46 @@
+#pragma once
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT_X64
+
+#define JIT_THRESHOLD 100 // calls before a function is compiled
+
+/// <summary>
+/// Machine code for one function.
+/// </summary>
+struct JitCode
+{
+	/// <summary>
+	/// Read-execute memory from allocateExecutable(), starting with the entry stub.
+	/// </summary>
+	uint8_t* code;
+	size_t size;
+
+	/// <summary>
+	/// Bytecode offset -> offset into 'code' of the same instruction.
+	/// Only meaningful where an instruction starts.
+	/// </summary>
+	uint32_t* entries;
+	uint32_t entryCount;
+};
+
+typedef struct JitCode JitCode;
+
+/// <summary>
+/// Translate 'function' to machine code and attach it as function->jit.
+/// Instructions the translator doesn't handle become exits back to run().
+/// </summary>
+void compileJit(ObjectFunction* function);
+
+/// <summary>
+/// Run the compiled function of 'frame' from the instruction at 'ip' until it reaches
+/// one that has to be interpreted. Leaves the stack top in vm.sp.
+/// </summary>
+/// <returns>The instruction run() should execute next.</returns>
+uint8_t* runJit(CallFrame* frame, uint8_t* ip, Value* sp);
+
+void freeJit(JitCode* jit);
+
+#endif
@@ -1,8 +1,10 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
@@ -48,19 +50,20 @@ static void freeObject(Object* object)
 		}
 		case OBJECT_CLOSURE:
 		{
-			// free array of upvalues
+			// free self, upvalue pointers included
 			ObjectClosure* closure = (ObjectClosure*)object;
-			FREE_ARRAY(ObjectUpvalue*, closure->upvalues,
-				closure->upvalueCount);
-
-			// free self
-			FREE(ObjectClosure, object); // free 'substruct'
+			reallocate(object, CLOSURE_SIZE(closure->upvalueCount), 0);
 			break;
 		}
 		case OBJECT_FUNCTION:
 		{
 			ObjectFunction* function = (ObjectFunction*)object;
 			freeChunk(&function->chunk);
+			freeRegisterChunk(&function->registerChunk);
+#ifdef JIT_X64
+			freeJit(function->jit);
+			freeTraces(function->traces);
+#endif
 			function->name = NULL;
 			FREE(ObjectFunction, object); // free 'substruct'
 			break;
@@ -68,15 +71,17 @@ static void freeObject(Object* object)
 		case OBJECT_INSTANCE:
 		{
 			ObjectInstance* instance = (ObjectInstance*)object;
-			freeTable(&instance->fields); // GC cleans up individual items in table
-			instance->_class = NULL; 
+			FREE_ARRAY(Value, instance->fields, instance->fieldCapacity); // GC cleans up individual items
+			instance->_class = NULL;
+			instance->shape = NULL;
 			FREE(ObjectInstance, object); // free 'substruct'
 			break;
 		}
 		case OBJECT_STRING:
 		{
 			ObjectString* string = (ObjectString*)object;
-			if (string->isDynamic) // only free dynamic strings, not interned strings
+			// an unflattened rope has no characters yet
+			if (string->isDynamic && string->chars != NULL) // only free dynamic strings, not interned strings
 			{
 				// make sure isDynamic is correct or you'll start freeing
 				// interned strings.
@@ -91,6 +96,14 @@ static void freeObject(Object* object)
 			FREE(ObjectNative, object); // free 'substruct'
 			break;
 		}
+		case OBJECT_SHAPE:
+		{
+			ObjectShape* shape = (ObjectShape*)object;
+			freeTable(&shape->slots);
+			freeTable(&shape->transitions);
+			FREE(ObjectShape, object); // free 'substruct'
+			break;
+		}
 		case OBJECT_UPVALUE:
 		{
 			ObjectUpvalue* upvalue = (ObjectUpvalue*)object;
@@ -153,6 +166,8 @@ static void blackenObject(Object* object)
 			ObjectClass* _class = (ObjectClass*)object;
 			markObject((Object*)_class->name);
 			markTable(&_class->methods);
+			markObject((Object*)_class->rootShape);
+			markObject((Object*)_class->initializer);
 			break;
 		}
 		case OBJECT_CLOSURE:
@@ -167,18 +182,48 @@ static void blackenObject(Object* object)
 		{
 			ObjectFunction* function = (ObjectFunction*)object;
 			markObject((Object*)function->name);
+			markObject((Object*)function->closure);
 			markArray(&function->chunk.constants);
+
+			// keep cached shapes alive so their addresses can't be reused
+			for (uint32_t i = 0; i < function->chunk.cacheCount; ++i)
+			{
+				InlineCache* cache = &function->chunk.caches[i];
+				for (uint32_t j = 0; j < cache->count; ++j)
+				{
+					markObject((Object*)cache->entries[j].shape);
+					markObject((Object*)cache->entries[j].method);
+					markObject((Object*)cache->entries[j].transition);
+				}
+			}
 			break;
 		}
 		case OBJECT_INSTANCE:
 		{
 			ObjectInstance* instance = (ObjectInstance*)object;
 			markObject((Object*)instance->_class);
-			markTable(&instance->fields);
+			markObject((Object*)instance->shape);
+			for (uint32_t i = 0; i < instance->shape->fieldCount; ++i)
+				markValue(instance->fields[i]);
+			markObject((Object*)instance->boundMethod);
 			break;
 		}
 		case OBJECT_NATIVE: break; // goes straight to black
-		case OBJECT_STRING: break; // goes straight to black
+		case OBJECT_SHAPE:
+		{
+			ObjectShape* shape = (ObjectShape*)object;
+			markTable(&shape->slots);
+			markTable(&shape->transitions);
+			break;
+		}
+		case OBJECT_STRING:
+		{
+			// only ropes get here
+			ObjectString* rope = (ObjectString*)object;
+			markObject((Object*)rope->left);
+			markObject((Object*)rope->right);
+			break;
+		}
 		case OBJECT_UPVALUE: markValue(((ObjectUpvalue*)object)->closed); break;
 		default: exit(123); // unreachable
 	}
@@ -217,8 +262,9 @@ void markObject(Object* object)
 
 	// challenge: skip adding strings and natives to gray stack
 	// since they do not get processed. darken from white to black.
+	// ropes are the exception, they still have their pieces to mark.
 	ObjectType type = object->type;
-	if (type == OBJECT_STRING || type == OBJECT_NATIVE)
+	if ((type == OBJECT_STRING && ((ObjectString*)object)->left == NULL) || type == OBJECT_NATIVE)
 		return; //  A black object is any object whose isMarked field is set and that is no longer in the gray stack.
 	
 	// auto-expand
@@ -232,10 +278,7 @@ void markObject(Object* object)
 			exit(1);
 	}
 
-	// strings and natives don't need to be processed, so skip graying them
-	Value value = OBJECT_VAL(object);
-	if (!(IS_NATIVE(value) || IS_STRING(value)))
-		vm.grayStack[vm.grayCount++] = object;
+	vm.grayStack[vm.grayCount++] = object;
 }
 
 void markValue(Value value)
@@ -249,13 +292,21 @@ void markValue(Value value)
 /// </summary>
 static void markRoots()
 {
-	// mark stack array
-	for (Value* slot = vm.stack.values; slot < &vm.stack.values[vm.stack.count]; ++slot)
+	// mark stack array. the register engine may read any slot of its frames,
+	// so it marks all of them.
+	Value* top = vm.sp > vm.frameTop ? vm.sp : vm.frameTop;
+	for (Value* slot = vm.stack; slot < top; ++slot)
 		markValue(*slot);
 
-	// mark call stack array
-	for (uint32_t i = 0; i < vm.frameCount; ++i)
-		markObject((Object*)vm.callStack[i].closure);
+	// mark call stack, segment by segment from the outermost frame
+	uint32_t remaining = vm.frameCount;
+	for (FrameSegment* segment = vm.callStack; remaining > 0; segment = segment->next)
+	{
+		uint32_t count = remaining < segment->capacity ? remaining : segment->capacity;
+		for (uint32_t i = 0; i < count; ++i)
+			markObject((Object*)segment->frames[i].closure);
+		remaining -= count;
+	}
 
 	// mark upvalues linked list
 	for (ObjectUpvalue* upvalue = vm.openUpvalues;
@@ -264,7 +315,9 @@ static void markRoots()
 		markObject((Object*)upvalue);
 	}
 
-	markTable(&vm.globals);
+	markTable(&vm.globalSlots);
+	markArray(&vm.globalValues);
+	markArray(&vm.globalNames);
 	markCompilerRoots();
 	markObject((Object*)vm.initString);
 }
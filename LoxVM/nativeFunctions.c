@@ -1,6 +1,42 @@
 #include "nativeFunctions.h"
 
-Value clockNative(uint8_t argCount, Value* args)
+bool clockNative(VM* vm, Value* args, Value* result)
 {
-	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+	*result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+	return true;
+}
+
+Value lengthNative(VM* vm, ObjectString* string)
+{
+	return INT64_VAL(string->length);
+}
+
+// 'result' is the callee's slot, so it still holds the native until it's overwritten
+
+bool number1Shim(VM* vm, Value* args, Value* result)
+{
+	if (!IS_NUMBER(args[0]))
+		return nativeError(vm, "Argument must be a number.");
+
+	*result = NUMBER_VAL(AS_NATIVE(*result)->typed.number1(AS_NUMBER(args[0])));
+	return true;
+}
+
+bool number2Shim(VM* vm, Value* args, Value* result)
+{
+	if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1]))
+		return nativeError(vm, "Arguments must be numbers.");
+
+	*result = NUMBER_VAL(AS_NATIVE(*result)->typed.number2(
+		AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+	return true;
+}
+
+bool string1Shim(VM* vm, Value* args, Value* result)
+{
+	if (!IS_STRING(args[0]))
+		return nativeError(vm, "Argument must be a string.");
+
+	*result = AS_NATIVE(*result)->typed.string1(vm, AS_STRING(args[0]));
+	return true;
 }
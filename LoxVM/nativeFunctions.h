@@ -5,4 +5,11 @@
 #include "object.h"
 #include "value.h"
 
-Value clockNative(uint8_t argCount, Value* args);
+bool clockNative(VM* vm, Value* args, Value* result);
+Value lengthNative(VM* vm, ObjectString* string);
+
+// shims of the typed signatures: check and unbox the arguments in one pass, call
+// the C function in the native's 'typed' and box the result.
+bool number1Shim(VM* vm, Value* args, Value* result);
+bool number2Shim(VM* vm, Value* args, Value* result);
+bool string1Shim(VM* vm, Value* args, Value* result);
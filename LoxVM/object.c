@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
@@ -11,6 +14,9 @@
 #define ALLOCATE_OBJECT(type, objectType) \
 	(type*)allocateObject(sizeof(type), objectType)
 
+// instances are small, so start with room for a few fields rather than GROW_CAPACITY's 8
+#define GROW_FIELDS(capacity) ((capacity) < 4 ? 4 : (capacity) * 2)
+
 /// <summary>
 /// Constructor for Object. Allocates full-sized struct,
 /// then inits Object's payload fields.
@@ -45,7 +51,10 @@ static ObjectString* allocateString(const char* chars,
 	string->length = length;
 	string->chars = chars;
 	string->isDynamic = isDynamic;
+	string->isInterned = true;
 	string->hash = hash;
+	string->left = NULL;
+	string->right = NULL;
 
 	// intern
 	push(OBJECT_VAL(string)); // store where gc can reach it
@@ -55,19 +64,79 @@ static ObjectString* allocateString(const char* chars,
 	return string;
 }
 
-static uint32_t hashString(const char* key, uint32_t length)
+// odd constants with well spread bits, from wyhash
+#define HASH_SECRET_0 0xa0761d6478bd642full
+#define HASH_SECRET_1 0xe7037ed1a0b428dbull
+
+/// <summary>
+/// Multiplies into 128 bits and folds the halves together. Every input bit reaches the low bits,
+/// which are the ones a Table indexes with.
+/// </summary>
+static inline uint64_t hashMix(uint64_t a, uint64_t b)
 {
-	// FNV-1a hash function
-	// https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
-	uint32_t hash = 2166136261u; // return value
-	for (uint32_t i = 0; i < length; ++i)
+#if defined(__SIZEOF_INT128__)
+	__uint128_t product = (__uint128_t)a * b;
+	return (uint64_t)product ^ (uint64_t)(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	uint64_t high;
+	uint64_t low = _umul128(a, b, &high);
+	return low ^ high;
+#else
+	// schoolbook multiply on 32-bit halves
+	uint64_t aLow = (uint32_t)a, aHigh = a >> 32;
+	uint64_t bLow = (uint32_t)b, bHigh = b >> 32;
+	uint64_t lowLow = aLow * bLow, lowHigh = aLow * bHigh;
+	uint64_t highLow = aHigh * bLow, highHigh = aHigh * bHigh;
+	uint64_t middle = (lowLow >> 32) + (uint32_t)lowHigh + (uint32_t)highLow;
+	uint64_t low = (lowLow & 0xffffffffu) | (middle << 32);
+	uint64_t high = highHigh + (lowHigh >> 32) + (highLow >> 32) + (middle >> 32);
+	return low ^ high;
+#endif
+}
+
+// unaligned little-endian loads, memcpy compiles down to a single mov
+static inline uint64_t read64(const char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t read32(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+/// <summary>
+/// wyhash-style: 16 bytes per multiply, seeded with vm.hashSeed so a script
+/// can't pick keys that all land in the same Table slots.
+/// https://github.com/wangyi-fudan/wyhash
+/// </summary>
+static inline uint32_t hashString(const char* key, uint32_t length)
+{
+	uint64_t hash = vm.hashSeed;
+	uint64_t a, b;
+	uint32_t left = length;
+
+	while (left > 16)
+	{
+		hash = hashMix(read64(key) ^ HASH_SECRET_1, read64(key + 8) ^ hash);
+		key += 16;
+		left -= 16;
+	}
+
+	// 1 to 16 bytes left, read as two words that may overlap
+	if (left > 8)
+	{
+		a = read64(key);
+		b = read64(key + left - 8);
+	}
+	else if (left >= 4)
+	{
+		a = read32(key);
+		b = read32(key + left - 4);
+	}
+	else if (left > 0)
 	{
-		// maybe hash 4 bytes at a time?
-		hash ^= (uint8_t)key[i];
-		hash *= 16777619;
+		a = ((uint64_t)(uint8_t)key[0] << 16) | ((uint64_t)(uint8_t)key[left >> 1] << 8) | (uint8_t)key[left - 1];
+		b = 0;
 	}
+	else
+		a = b = 0;
 
-	return hash;
+	hash = hashMix(a ^ HASH_SECRET_1, b ^ hash);
+	return (uint32_t)hashMix(hash ^ HASH_SECRET_0, length ^ HASH_SECRET_1);
 }
 
 static void printFunction(ObjectFunction* function)
@@ -90,7 +159,14 @@ ObjectClass* newClass(ObjectString* name)
 {
 	ObjectClass* _class = ALLOCATE_OBJECT(ObjectClass, OBJECT_CLASS);
 	_class->name = name;
+	_class->rootShape = NULL;
+	_class->initializer = NULL;
+	_class->fieldHint = 0;
 	initTable(&_class->methods);
+
+	push(OBJECT_VAL(_class)); // store where gc can reach it
+	_class->rootShape = newShape();
+	pop();
 	return _class;
 }
 
@@ -98,18 +174,22 @@ ObjectClosure* newClosure(ObjectFunction* function)
 {
 	uint32_t upvalueCount = function->upvalueCount; // fetch once
 
-	// create upvalue pointers array
-	ObjectUpvalue** upvalues = ALLOCATE(ObjectUpvalue*, upvalueCount);
+	// nothing captured, so nothing to tell closures apart
+	if (upvalueCount == 0 && function->closure != NULL)
+		return function->closure;
+
+	// create closure with its upvalue pointers in the same block
+	ObjectClosure* closure = (ObjectClosure*)allocateObject(
+		CLOSURE_SIZE(upvalueCount), OBJECT_CLOSURE);
+	closure->function = function;
+	closure->upvalueCount = upvalueCount;
 
 	// init array of upvalue pointers
 	for (uint32_t i = 0; i < upvalueCount; ++i)
-		upvalues[i] = NULL;
+		closure->upvalues[i] = NULL;
 
-	// create closure
-	ObjectClosure* closure = ALLOCATE_OBJECT(ObjectClosure, OBJECT_CLOSURE);
-	closure->function = function;
-	closure->upvalues = upvalues;
-	closure->upvalueCount = upvalueCount;
+	if (upvalueCount == 0)
+		function->closure = closure;
 	return closure;
 }
 
@@ -118,8 +198,14 @@ ObjectFunction* newFunction()
 	ObjectFunction* function = ALLOCATE_OBJECT(ObjectFunction, OBJECT_FUNCTION);
 	function->arity = 0;
 	function->upvalueCount = 0;
+	function->maxStack = 0;
 	function->name = NULL;
 	initChunk(&function->chunk);
+	initRegisterChunk(&function->registerChunk);
+	function->callCount = 0;
+	function->jit = NULL;
+	function->traces = NULL;
+	function->closure = NULL;
 	return function;
 }
 
@@ -127,23 +213,47 @@ ObjectInstance* newInstance(ObjectClass* _class)
 {
 	ObjectInstance* instance = ALLOCATE_OBJECT(ObjectInstance, OBJECT_INSTANCE);
 	instance->_class = _class;
-	initTable(&instance->fields);
+	instance->shape = _class->rootShape;
+	instance->fields = NULL;
+	instance->fieldCapacity = 0;
+	instance->boundMethod = NULL;
+
+	// sized for what earlier instances ended up with
+	if (_class->fieldHint > 0)
+	{
+		push(OBJECT_VAL(instance)); // store where gc can reach it
+		instance->fields = ALLOCATE(Value, _class->fieldHint);
+		instance->fieldCapacity = _class->fieldHint;
+		pop();
+	}
 	return instance;
 }
 
-ObjectNative* newNativeFunction(NativeFn function)
+ObjectNative* newNativeFunction(NativeFn function, uint8_t arity)
 {
 	ObjectNative* native = ALLOCATE_OBJECT(ObjectNative, OBJECT_NATIVE); // new fn
 	native->function = function;
+	native->arity = arity;
+	native->signature = NATIVE_VALUE;
 	return native;
 }
 
+ObjectShape* newShape()
+{
+	ObjectShape* shape = ALLOCATE_OBJECT(ObjectShape, OBJECT_SHAPE);
+	initTable(&shape->slots);
+	initTable(&shape->transitions);
+	shape->fieldCount = 0;
+	return shape;
+}
+
 ObjectUpvalue* newUpvalue(Value* slot)
 {
 	ObjectUpvalue* upvalue = ALLOCATE_OBJECT(ObjectUpvalue, OBJECT_UPVALUE); // new upvalue
 	upvalue->location = slot;
 	upvalue->closed = NIL_VAL;
 	upvalue->next = NULL;
+	upvalue->previous = NULL;
 	return upvalue;
 }
 
@@ -165,6 +275,85 @@ ObjectString* copyString(const char* chars, uint32_t length)
 	return allocateString(heapChars, length, true, hash);
 }
 
+ObjectString* copyConcatenation(ObjectString* a, ObjectString* b)
+{
+	// join on the C stack, the heap only gets the result if it's new
+	uint32_t length = a->length + b->length;
+	char chars[ROPE_MIN_LENGTH];
+	memcpy(chars, a->chars, a->length);
+	memcpy(chars + a->length, b->chars, b->length);
+	return copyString(chars, length);
+}
+
+ObjectString* newRope(ObjectString* left, ObjectString* right)
+{
+	ObjectString* rope = ALLOCATE_OBJECT(ObjectString, OBJECT_STRING);
+	rope->length = left->length + right->length;
+	rope->isDynamic = true;
+	rope->isInterned = false;
+	rope->chars = NULL;
+	rope->hash = 0; // only interned strings are table keys
+	rope->left = left;
+	rope->right = right;
+	return rope;
+}
+
+const char* flattenString(ObjectString* rope)
+{
+	// not through reallocate(), which may collect. the bytes are still accounted for.
+	char* chars = (char*)malloc(rope->length + 1);
+	if (chars == NULL) exit(1);
+	vm.bytesAllocated += rope->length + 1;
+
+	// fill the buffer from the back, right halves first. appending in a loop makes the
+	// left side deep and prepending the right, so walk with a stack rather than recursion.
+	uint32_t capacity = 16;
+	uint32_t count = 0;
+	ObjectString** pending = (ObjectString**)malloc(sizeof(ObjectString*) * capacity);
+	if (pending == NULL) exit(1);
+	pending[count++] = rope;
+
+	uint32_t end = rope->length;
+	while (count > 0)
+	{
+		ObjectString* piece = pending[--count];
+		if (piece->chars != NULL)
+		{
+			end -= piece->length;
+			memcpy(chars + end, piece->chars, piece->length);
+			continue;
+		}
+
+		if (capacity < count + 2)
+		{
+			capacity *= 2;
+			ObjectString** temp = pending; // prevent memory leak warning from realloc
+			pending = (ObjectString**)realloc(temp, sizeof(ObjectString*) * capacity);
+			if (pending == NULL) exit(1);
+		}
+		pending[count++] = piece->left;
+		pending[count++] = piece->right;
+	}
+	free(pending);
+
+	chars[rope->length] = '\0'; // null-terminated
+	rope->chars = chars;
+	rope->left = NULL; // the pieces are garbage now, unless something else holds them
+	rope->right = NULL;
+	return chars;
+}
+
+bool stringsEqual(ObjectString* a, ObjectString* b)
+{
+	if (a == b)
+		return true;
+
+	// interned strings are unique, so two different ones never match
+	if ((a->isInterned && b->isInterned) || a->length != b->length)
+		return false;
+	return memcmp(stringChars(a), stringChars(b), a->length) == 0;
+}
+
 void printObject(Value value)
 {
 	ObjectType type = OBJECT_TYPE(value);
@@ -177,12 +366,68 @@ void printObject(Value value)
 		case OBJECT_INSTANCE: printf("%s instance", 
 			AS_INSTANCE(value)->_class->name->chars); break;
 		case OBJECT_NATIVE: printf("<native fn>"); break;
+		case OBJECT_SHAPE: printf("shape"); break;
 		case OBJECT_STRING: printf("%s", AS_CSTRING(value)); break;
 		case OBJECT_UPVALUE: printf("upvalue"); break;
 		default: exit(123); // unreachable
 	}
 }
 
+uint32_t setField(ObjectInstance* instance, ObjectString* name, Value value)
+{
+	uint32_t slot;
+	if (shapeFindField(instance->shape, name, &slot))
+	{
+		instance->fields[slot] = value;
+		return slot;
+	}
+
+	// make room first. the slot only counts once the shape changes,
+	// so a collection in between never sees it uninitialized.
+	slot = instance->shape->fieldCount;
+	if (slot == instance->fieldCapacity)
+	{
+		uint32_t oldCapacity = instance->fieldCapacity;
+		uint32_t capacity = GROW_FIELDS(oldCapacity);
+		instance->fields = GROW_ARRAY(Value, instance->fields, oldCapacity, capacity);
+		instance->fieldCapacity = capacity;
+	}
+
+	ObjectShape* shape = shapeAddField(instance->shape, name);
+	instance->fields[slot] = value;
+	instance->shape = shape;
+	if (shape->fieldCount > instance->_class->fieldHint)
+		instance->_class->fieldHint = shape->fieldCount;
+	return slot;
+}
+
+ObjectShape* shapeAddField(ObjectShape* shape, ObjectString* name)
+{
+	// taken before?
+	Value next;
+	if (tableGet(&shape->transitions, name, &next))
+		return AS_SHAPE(next);
+
+	ObjectShape* child = newShape();
+	push(OBJECT_VAL(child)); // store where gc can reach it
+	copyTable(&shape->slots, &child->slots);
+	tableSet(&child->slots, name, INT_VAL(shape->fieldCount));
+	child->fieldCount = shape->fieldCount + 1;
+	tableSet(&shape->transitions, name, OBJECT_VAL(child));
+	pop();
+	return child;
+}
+
+bool shapeFindField(ObjectShape* shape, ObjectString* name, uint32_t* slot)
+{
+	Value value;
+	if (!tableGet(&shape->slots, name, &value))
+		return false;
+
+	*slot = (uint32_t)AS_INT(value);
+	return true;
+}
+
 ObjectString* takeString(const char* chars, uint32_t length)
 {
 	uint32_t hash = hashString(chars, length);
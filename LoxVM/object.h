@@ -15,6 +15,7 @@
 #define IS_FUNCTION(value)		isObjectType(value, OBJECT_FUNCTION)
 #define IS_INSTANCE(value)		isObjectType(value, OBJECT_INSTANCE)
 #define IS_NATIVE(value)		isObjectType(value, OBJECT_NATIVE)
+#define IS_SHAPE(value)			isObjectType(value, OBJECT_SHAPE)
 #define IS_STRING(value)		isObjectType(value, OBJECT_STRING)
 #define IS_UPVALUE(value)		isObjectType(value, OBJECT_UPVALUE)
 
@@ -24,9 +25,17 @@
 #define AS_CLOSURE(value)		((ObjectClosure*)AS_OBJECT(value))
 #define AS_FUNCTION(value)		((ObjectFunction*)AS_OBJECT(value))
 #define AS_INSTANCE(value)		((ObjectInstance*)AS_OBJECT(value))
-#define AS_NATIVE(value)		(((ObjectNative*)AS_OBJECT(value))->function)
+#define AS_NATIVE(value)		((ObjectNative*)AS_OBJECT(value))
+#define AS_SHAPE(value)			((ObjectShape*)AS_OBJECT(value))
 #define AS_STRING(value)		((ObjectString*)AS_OBJECT(value))
-#define AS_CSTRING(value)		(((ObjectString*)AS_OBJECT(value))->chars)
+#define AS_CSTRING(value)		stringChars(AS_STRING(value))
+
+// bytes of a closure with room for 'upvalueCount' upvalue pointers
+#define CLOSURE_SIZE(upvalueCount) \
+	(sizeof(ObjectClosure) + sizeof(ObjectUpvalue*) * (upvalueCount))
+
+// concatenations at least this long are ropes, shorter ones are copied and interned
+#define ROPE_MIN_LENGTH 64
 
 typedef enum
 {
@@ -36,6 +45,7 @@ typedef enum
 	OBJECT_FUNCTION,
 	OBJECT_INSTANCE,
 	OBJECT_NATIVE,
+	OBJECT_SHAPE,
 	OBJECT_STRING,
 	OBJECT_UPVALUE,
 } ObjectType;
@@ -59,30 +69,116 @@ struct ObjectFunction
 	Object object; // header
 	uint32_t arity;
 	uint32_t upvalueCount;
+
+	/// <summary>
+	/// Deepest the value stack gets inside a call, counted from slot 0.
+	/// Computed by the compiler so call() can check headroom once per frame.
+	/// </summary>
+	uint32_t maxStack;
 	Chunk chunk;
+
+	/// <summary>
+	/// Same function for the register engine. Empty unless vm.engine is ENGINE_REGISTER.
+	/// </summary>
+	RegisterChunk registerChunk;
+
+	/// <summary>
+	/// Times call() has entered the function, up to JIT_THRESHOLD.
+	/// </summary>
+	uint32_t callCount;
+
+	/// <summary>
+	/// Machine code for the function once it is hot, otherwise NULL. See jit.h.
+	/// </summary>
+	struct JitCode* jit;
+
+	/// <summary>
+	/// Loops of the function run() has jumped back to, recorded or not. See trace.h.
+	/// </summary>
+	struct Trace* traces;
+
+	/// <summary>
+	/// The one closure of a function without upvalues, once it has been made.
+	/// Every OP_CLOSURE of such a function would produce an identical one.
+	/// </summary>
+	struct ObjectClosure* closure;
 	ObjectString* name;
 };
 
-typedef Value(*NativeFn)(uint8_t argCount, Value* args);
+/// <summary>
+/// A function implemented in C. 'args' holds exactly the declared arity and
+/// the result goes to 'result', the callee's slot just below them.
+/// </summary>
+/// <returns>False after nativeError() reported a runtime error.</returns>
+typedef bool(*NativeFn)(VM* vm, Value* args, Value* result);
+
+// typed natives: plain C functions the VM checks and unboxes the arguments for
+typedef double(*NativeNumber1)(double a);
+typedef double(*NativeNumber2)(double a, double b);
+typedef Value(*NativeString1)(VM* vm, ObjectString* a);
+
+typedef enum
+{
+	/// <summary>
+	/// A NativeFn, which checks its own arguments.
+	/// </summary>
+	NATIVE_VALUE,
+	NATIVE_NUMBER_1,
+	NATIVE_NUMBER_2,
+	NATIVE_STRING_1,
+} NativeSignature;
 
 struct ObjectNative
 {
 	Object object; // header
 	// consider const char* name;
+
+	/// <summary>
+	/// What the VM calls. For a typed native, the shim of its signature.
+	/// </summary>
 	NativeFn function;
+
+	/// <summary>
+	/// Number of arguments, checked by the VM before 'function' runs.
+	/// </summary>
+	uint8_t arity;
+
+	NativeSignature signature;
+
+	/// <summary>
+	/// The C function behind a typed native's shim, picked by 'signature'.
+	/// </summary>
+	union
+	{
+		NativeNumber1 number1;
+		NativeNumber2 number2;
+		NativeString1 string1;
+	} typed;
 };
 
 /// <summary>
 /// Underlying string type in Lox.
 /// Essentially a 'string' that is always dynamically allocated.
+/// A rope is the concatenation of 'left' and 'right', copied into 'chars' when first read.
 /// </summary>
 struct ObjectString // challenge: flag as dynamic or static and account as such when freeing
 {
 	Object object;
 	uint32_t length;
 	bool isDynamic;// not implemented
-	const char* chars;
+
+	/// <summary>
+	/// In vm.strings, so no other interned string is equal to it. Ropes never are.
+	/// </summary>
+	bool isInterned;
+	const char* chars; // NULL until a rope is flattened
 	uint32_t hash;
+
+	/// <summary>
+	/// Halves of a rope that is not flattened yet. NULL otherwise.
+	/// </summary>
+	struct ObjectString* left;
+	struct ObjectString* right;
 };
 
 struct ObjectUpvalue
@@ -94,14 +190,39 @@ struct ObjectUpvalue
 	/// </summary>
 	Value closed;
 	struct ObjectUpvalue* next; // linked-list node
+
+	/// <summary>
+	/// Newer neighbour in vm.openUpvalues, so closing one slot can unlink it in place.
+	/// </summary>
+	struct ObjectUpvalue* previous;
 };
 
 struct ObjectClosure
 {
 	Object object;
 	ObjectFunction* function;
-	ObjectUpvalue** upvalues;
 	uint32_t upvalueCount;
+	ObjectUpvalue* upvalues[]; // allocated with the closure
+};
+
+/// <summary>
+/// Hidden class. Instances that gained the same fields in the same order share
+/// one, so the field names live here once and each instance only stores values.
+/// </summary>
+struct ObjectShape
+{
+	Object object;
+
+	/// <summary>
+	/// Field name -> index into ObjectInstance.fields (a number).
+	/// </summary>
+	Table slots;
+
+	/// <summary>
+	/// Field name -> the ObjectShape reached by adding that field.
+	/// </summary>
+	Table transitions;
+	uint32_t fieldCount;
 };
 
 struct ObjectClass
@@ -109,13 +230,40 @@ struct ObjectClass
 	Object object;
 	ObjectString* name;
 	Table methods;
+
+	/// <summary>
+	/// Shape of a new instance, root of every shape its instances take on.
+	/// A shape therefore implies the class.
+	/// </summary>
+	ObjectShape* rootShape;
+
+	/// <summary>
+	/// The 'init' method, NULL without one. Kept in step with 'methods'.
+	/// </summary>
+	ObjectClosure* initializer;
+
+	/// <summary>
+	/// Most fields an instance has had so far. New instances start with room for them.
+	/// </summary>
+	uint32_t fieldHint;
 };
 
 struct ObjectInstance
 {
 	Object object;
 	ObjectClass* _class;
-	Table fields;
+	ObjectShape* shape;
+
+	/// <summary>
+	/// Field values, indexed by the slots in 'shape'.
+	/// </summary>
+	Value* fields;
+	uint32_t fieldCapacity;
+
+	/// <summary>
+	/// Last method bound to this instance, handed out again while the same method is read.
+	/// </summary>
+	ObjectBoundMethod* boundMethod;
 };
 
 struct ObjectBoundMethod
@@ -140,7 +288,8 @@ ObjectBoundMethod* newBoundMethod(Value receiver, ObjectClosure* method);
 ObjectClass* newClass(ObjectString* name);
 
 /// <summary>
-/// Constructor for a new ObjectClosure.
+/// Constructor for a closure of 'function'. Functions without upvalues
+/// share a single closure, created on first use and cached on the function.
 /// </summary>
 ObjectClosure* newClosure(ObjectFunction* function);
 
@@ -159,7 +308,12 @@ ObjectInstance* newInstance(ObjectClass* _class);
 /// Constructor for a native function.
 /// </summary>
 /// <param name="function"></param>
-ObjectNative* newNativeFunction(NativeFn function);
+ObjectNative* newNativeFunction(NativeFn function, uint8_t arity);
+
+/// <summary>
+/// Constructor for an empty shape.
+/// </summary>
+ObjectShape* newShape();
 
 /// <summary>
 /// Constructor for an upvalue.
@@ -168,7 +322,46 @@ ObjectNative* newNativeFunction(NativeFn function);
 ObjectUpvalue* newUpvalue(Value* slot);
 
 ObjectString* copyString(const char* chars, uint32_t length);
+
+/// <summary>
+/// The interned string of 'a' followed by 'b', which are interned and together shorter
+/// than a rope. Only allocates if the result is new.
+/// </summary>
+ObjectString* copyConcatenation(ObjectString* a, ObjectString* b);
+
+/// <summary>
+/// Constructor for the rope of 'left' followed by 'right'. Copies nothing.
+/// </summary>
+ObjectString* newRope(ObjectString* left, ObjectString* right);
+
+/// <summary>
+/// Copy a rope's pieces into one buffer, which it keeps, and let go of the pieces.
+/// Never collects garbage, so strings can be read anywhere.
+/// </summary>
+const char* flattenString(ObjectString* rope);
+
+/// <summary>
+/// Same characters. Only compares them when one of the two is not interned.
+/// </summary>
+bool stringsEqual(ObjectString* a, ObjectString* b);
 void printObject(Value value);
+
+/// <summary>
+/// Add or overwrite a field, moving the instance to a new shape if needed.
+/// </summary>
+/// <returns>The field's slot.</returns>
+uint32_t setField(ObjectInstance* instance, ObjectString* name, Value value);
+
+/// <summary>
+/// The shape reached from 'shape' by adding field 'name'. Created on first use.
+/// </summary>
+ObjectShape* shapeAddField(ObjectShape* shape, ObjectString* name);
+
+/// <summary>
+/// Slot of field 'name' in instances of 'shape'.
+/// </summary>
+/// <returns>False if the shape has no such field.</returns>
+bool shapeFindField(ObjectShape* shape, ObjectString* name, uint32_t* slot);
 ObjectString* takeString(const char* chars, uint32_t length);
 
 /// <summary>
@@ -179,4 +372,12 @@ ObjectString* takeConstantString(const char* chars, uint32_t length);
 static inline bool isObjectType(Value value, ObjectType type)
 {
 	return IS_OBJECT(value) && AS_OBJECT(value)->type == type;
-}
\ No newline at end of file
+}
+
+/// <summary>
+/// Null-terminated characters of 'string', flattening a rope first.
+/// </summary>
+static inline const char* stringChars(ObjectString* string)
+{
+	return string->chars != NULL ? string->chars : flattenString(string);
+}
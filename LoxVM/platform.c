@@ -0,0 +1,131 @@
+#define _CRT_RAND_S // rand_s() on windows
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "platform.h"
+
+// kept out of the other modules because windows.h collides with names
+// like 'TokenType'.
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static size_t pageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+/// <summary>
+/// Size of the accessible part of a guarded block, rounded up to whole pages.
+/// </summary>
+static size_t guardedSize(size_t size, size_t page)
+{
+	return (size + page - 1) & ~(page - 1);
+}
+
+void* allocateGuarded(size_t size)
+{
+	size_t page = pageSize();
+	size_t usable = guardedSize(size, page);
+
+#ifdef _WIN32
+	uint8_t* memory = (uint8_t*)VirtualAlloc(NULL, usable + page,
+		MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (memory == NULL) exit(1);
+
+	DWORD oldProtect;
+	VirtualProtect(memory + usable, page, PAGE_NOACCESS, &oldProtect);
+#else
+	uint8_t* memory = (uint8_t*)mmap(NULL, usable + page,
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) exit(1);
+
+	mprotect(memory + usable, page, PROT_NONE);
+#endif
+
+	// hand out the tail so the last byte sits right against the guard page
+	return memory + (usable - size);
+}
+
+void freeGuarded(void* pointer, size_t size)
+{
+	if (pointer == NULL) return;
+
+	size_t page = pageSize();
+	size_t usable = guardedSize(size, page);
+	uint8_t* memory = (uint8_t*)pointer - (usable - size);
+
+#ifdef _WIN32
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, usable + page);
+#endif
+}
+
+void* allocateExecutable(size_t size)
+{
+#ifdef _WIN32
+	void* memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (memory == NULL) exit(1);
+#else
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) exit(1);
+#endif
+	return memory;
+}
+
+void makeExecutable(void* pointer, size_t size)
+{
+#ifdef _WIN32
+	DWORD oldProtect;
+	VirtualProtect(pointer, size, PAGE_EXECUTE_READ, &oldProtect);
+	FlushInstructionCache(GetCurrentProcess(), pointer, size);
+#else
+	mprotect(pointer, size, PROT_READ | PROT_EXEC);
+#endif
+}
+
+void freeExecutable(void* pointer, size_t size)
+{
+	if (pointer == NULL) return;
+
+#ifdef _WIN32
+	VirtualFree(pointer, 0, MEM_RELEASE);
+#else
+	munmap(pointer, size);
+#endif
+}
+
+uint64_t randomSeed()
+{
+	uint64_t seed = 0;
+#ifdef _WIN32
+	unsigned int low, high;
+	if (rand_s(&low) == 0 && rand_s(&high) == 0)
+		seed = ((uint64_t)high << 32) | low;
+#else
+	FILE* random = fopen("/dev/urandom", "rb");
+	if (random != NULL)
+	{
+		if (fread(&seed, sizeof(seed), 1, random) != 1) seed = 0;
+		fclose(random);
+	}
+#endif
+
+	// no random source: at least differ between runs, ASLR moves 'seed'
+	if (seed == 0)
+		seed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)&seed;
+	return seed;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "common.h"
+
+/// <summary>
+/// Reserves 'size' bytes that end right at an inaccessible guard page,
+/// so running off the end faults instead of corrupting the heap.
+/// </summary>
+void* allocateGuarded(size_t size);
+
+/// <summary>
+/// Releases memory from allocateGuarded(). 'size' must match.
+/// </summary>
+void freeGuarded(void* pointer, size_t size);
+
+/// <summary>
+/// Reserves 'size' bytes of read-write memory for machine code.
+/// Call makeExecutable() once the code is written.
+/// </summary>
+void* allocateExecutable(size_t size);
+
+/// <summary>
+/// Flips memory from allocateExecutable() to read-execute. It is never writable and
+/// executable at the same time.
+/// </summary>
+void makeExecutable(void* pointer, size_t size);
+
+/// <summary>
+/// Releases memory from allocateExecutable(). 'size' must match.
+/// </summary>
+void freeExecutable(void* pointer, size_t size);
+
+/// <summary>
+/// 64 bits from the OS random source, different for every run.
+/// </summary>
+uint64_t randomSeed();
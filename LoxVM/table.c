@@ -6,72 +6,173 @@
 #include "table.h"
 #include "value.h"
 
-inline void initEntry(Entry* entry)
+// SSE2 is part of x86-64, so MSVC only says so for 32-bit builds
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// control bytes: full slots hold a 7-bit hash fragment, so only the free ones are negative
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+// high hash bits pick the group, low ones are stored in the control byte
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_FRAGMENT(hash) ((int8_t)((hash) & 0x7f))
+
+/// <summary>
+/// Bit i is set if control byte i of the group equals 'byte'.
+/// </summary>
+static inline uint32_t matchByte(const int8_t* group, int8_t byte)
+{
+#ifdef TABLE_SSE2
+	__m128i control = _mm_loadu_si128((const __m128i*)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < TABLE_GROUP_SIZE; ++i)
+		if (group[i] == byte) mask |= 1u << i;
+	return mask;
+#endif
+}
+
+/// <summary>
+/// Bit i is set if slot i of the group is empty or deleted.
+/// </summary>
+static inline uint32_t matchFree(const int8_t* group)
 {
-	entry->key = NULL;
-	entry->value = NIL_VAL;
+#ifdef TABLE_SSE2
+	// free bytes are the negative ones, movemask gathers the sign bits
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < TABLE_GROUP_SIZE; ++i)
+		if (group[i] < 0) mask |= 1u << i;
+	return mask;
+#endif
 }
 
-static Entry* findEntry(Entry* entries, uint32_t capacity, ObjectString* key)
+/// <summary>
+/// Index of the lowest set bit. 'mask' is not 0.
+/// </summary>
+static inline uint32_t lowestBit(uint32_t mask)
 {
-	uint32_t index = key->hash & (capacity - 1); // fast modulo b.c. power of 2
-	Entry* tombstone = NULL;
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+/// <summary>
+/// Entry of 'key', or NULL. The table has a capacity.
+/// </summary>
+static Entry* findEntry(Table* table, ObjectString* key)
+{
+	uint32_t groupMask = table->capacity / TABLE_GROUP_SIZE - 1; // fast modulo b.c. power of 2
+	uint32_t group = HASH_GROUP(key->hash) & groupMask;
+	int8_t fragment = HASH_FRAGMENT(key->hash);
 
-	// linear probing
-	while (true) // non-infinite due to load factor expansion
+	// triangular probing over groups, which visits each of them once
+	for (uint32_t step = 1; ; ++step) // non-infinite, the load factor keeps empty slots around
 	{
-		// because of string interning, strings are compared by ref
-		Entry* entry = &entries[index];
-		if (entry->key == NULL)
+		uint32_t first = group * TABLE_GROUP_SIZE;
+		const int8_t* control = table->control + first;
+		uint32_t empty = matchByte(control, CONTROL_EMPTY);
+		for (uint32_t match = matchByte(control, fragment); match != 0; match &= match - 1)
 		{
-			// tombstone?
-			if (IS_NIL(entry->value))
-			{
-				return tombstone != NULL ? tombstone : entry;
-			}
-			else
-			{
-				if (tombstone == NULL) tombstone = entry;
-			}
-		}
-		else if (entry->key == key) // entry found
-		{	
-			return entry;
+			// because of string interning, strings are compared by ref
+			Entry* entry = &table->entries[first + lowestBit(match)];
+			if (entry->key == key) return entry;
 		}
 
-		index = (index + 1) & (capacity - 1); // loop around
+		// inserts only move on from full groups, so the key isn't further along
+		if (empty != 0) return NULL;
+
+		group = (group + step) & groupMask;
 	}
 }
 
-static void adjustCapacity(Table* table, uint32_t capacity)
+/// <summary>
+/// First empty or deleted slot along the probe sequence of 'hash'. The table has a capacity.
+/// </summary>
+static uint32_t findFreeSlot(Table* table, uint32_t hash)
 {
-	// create bucket array
-	Entry* entries = ALLOCATE(Entry, capacity);
+	uint32_t groupMask = table->capacity / TABLE_GROUP_SIZE - 1;
+	uint32_t group = HASH_GROUP(hash) & groupMask;
 
-	// init all entries
-	for (uint32_t i = 0; i < capacity; ++i)
-		initEntry(&entries[i]);
+	for (uint32_t step = 1; ; ++step)
+	{
+		uint32_t first = group * TABLE_GROUP_SIZE;
+		uint32_t freeSlots = matchFree(table->control + first);
+		if (freeSlots != 0) return first + lowestBit(freeSlots);
+
+		group = (group + step) & groupMask;
+	}
+}
+
+/// <summary>
+/// Bytes of the entries and control bytes of a table with 'capacity' slots.
+/// </summary>
+static size_t blockSize(uint32_t capacity)
+{
+	return (size_t)capacity * (sizeof(Entry) + 1);
+}
+
+static void adjustCapacity(Table* table, uint32_t capacity)
+{
+	// create bucket and control arrays in one block
+	Entry* entries = (Entry*)ALLOCATE(uint8_t, blockSize(capacity));
+	int8_t* control = (int8_t*)(entries + capacity);
+	memset(control, CONTROL_EMPTY, capacity);
 
-	// copy over existing elements
-	table->count = 0; // reset and count non-tombstones
+	// swap in the new arrays, the gc may have run while allocating so read the old ones after
+	Entry* oldEntries = table->entries;
+	int8_t* oldControl = table->control;
 	uint32_t oldCapacity = table->capacity;
+	table->entries = entries;
+	table->control = control;
+	table->capacity = capacity;
+
+	// copy over existing elements, tombstones are dropped
 	for (uint32_t i = 0; i < oldCapacity; ++i)
 	{
-		Entry* entry = &table->entries[i];
-		if (entry->key == NULL) continue; // skip empty and tombstone
+		if (oldControl[i] < 0) continue; // skip empty and tombstone
 
 		// assign new slot
-		Entry* dest = findEntry(entries, capacity, entry->key);
-		dest->key = entry->key;
-		dest->value = entry->value;
-		table->count++;
+		ObjectString* key = oldEntries[i].key;
+		uint32_t slot = findFreeSlot(table, key->hash);
+		control[slot] = HASH_FRAGMENT(key->hash);
+		entries[slot] = oldEntries[i];
 	}
+	table->growthLeft = capacity / 8 * TABLE_MAX_LOAD_EIGHTHS - table->count;
 
-	FREE_ARRAY(Entry, table->entries, oldCapacity);
+	if (oldEntries != NULL)
+		FREE_ARRAY(uint8_t, oldEntries, blockSize(oldCapacity));
+}
 
-	// update table fields
-	table->entries = entries;
-	table->capacity = capacity;
+/// <summary>
+/// Frees the full slot 'index'.
+/// </summary>
+static void eraseSlot(Table* table, uint32_t index)
+{
+	// a group that still has an empty slot ends every probe that reaches it,
+	// so nothing past it relies on this slot and it can become empty too
+	if (matchByte(table->control + (index & ~(TABLE_GROUP_SIZE - 1)), CONTROL_EMPTY) != 0)
+	{
+		table->control[index] = CONTROL_EMPTY;
+		++table->growthLeft;
+	}
+	else
+		table->control[index] = CONTROL_DELETED; // tombstone
+
+	--table->count;
 }
 
 bool tableDelete(Table* table, ObjectString* key)
@@ -79,12 +180,10 @@ bool tableDelete(Table* table, ObjectString* key)
 	// handle empty table
 	if (table->count == 0) return false;
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
+	Entry* entry = findEntry(table, key);
+	if (entry == NULL) return false;
 
-	// tombstone at entry
-	entry->key = NULL;
-	entry->value = BOOL_VAL(true);
+	eraseSlot(table, (uint32_t)(entry - table->entries));
 	return true;
 }
 
@@ -93,8 +192,8 @@ bool tableGet(Table* table, ObjectString* key, Value* value)
 	// handle empty table
 	if (table->count == 0) return false;
 
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	if (entry->key == NULL) return false;
+	Entry* entry = findEntry(table, key);
+	if (entry == NULL) return false;
 
 	// return values
 	*value = entry->value;
@@ -103,32 +202,48 @@ bool tableGet(Table* table, ObjectString* key, Value* value)
 
 bool tableSet(Table* table, ObjectString* key, Value value)
 {
-	// ensure capacity
-	if (table->count + 1 > table->capacity * TABLE_MAX_LOAD_FACTOR)
+	// existing key?
+	if (table->count != 0)
 	{
-		uint32_t capacity = GROW_CAPACITY(table->capacity);
-		adjustCapacity(table, capacity);
+		Entry* entry = findEntry(table, key);
+		if (entry != NULL)
+		{
+			entry->value = value;
+			return false;
+		}
 	}
 
-	// find bucket
-	Entry* entry = findEntry(table->entries, table->capacity, key);
-	bool isNew = entry->key == NULL;
-	if (isNew && IS_NIL(entry->value)) // new and not tombstone
-		++table->count;
+	// find bucket, reusing tombstones before spending an empty slot
+	uint32_t slot = table->capacity == 0 ? 0 : findFreeSlot(table, key->hash);
+	if (table->capacity == 0 || (table->growthLeft == 0 && table->control[slot] == CONTROL_EMPTY))
+	{
+		// mostly tombstones: rehash at the same size to clear them, otherwise grow
+		uint32_t capacity = table->capacity;
+		if (capacity == 0)
+			capacity = TABLE_GROUP_SIZE;
+		else if (table->count * 2 >= capacity)
+			capacity *= 2;
+
+		adjustCapacity(table, capacity);
+		slot = findFreeSlot(table, key->hash);
+	}
 
 	// set entry
-	entry->key = key;
-	entry->value = value;
-	return isNew;
+	if (table->control[slot] == CONTROL_EMPTY)
+		--table->growthLeft;
+	table->control[slot] = HASH_FRAGMENT(key->hash);
+	table->entries[slot].key = key;
+	table->entries[slot].value = value;
+	++table->count;
+	return true;
 }
 
 void copyTable(Table* src, Table* dest)
 {
 	for (uint32_t i = 0; i < src->capacity; ++i)
 	{
-		Entry* entry = &src->entries[i];
-		if (entry->key != NULL)
-			tableSet(dest, entry->key, entry->value);
+		if (src->control[i] >= 0)
+			tableSet(dest, src->entries[i].key, src->entries[i].value);
 	}
 }
 
@@ -137,28 +252,32 @@ ObjectString* tableFindString(Table* table, const char* chars,
 {
 	if (table->count == 0) return NULL;
 
-	uint32_t index = hash & (table->capacity - 1); // fast modulo b.c. power of 2
+	uint32_t groupMask = table->capacity / TABLE_GROUP_SIZE - 1;
+	uint32_t group = HASH_GROUP(hash) & groupMask;
+	int8_t fragment = HASH_FRAGMENT(hash);
 
-	while (true)
+	for (uint32_t step = 1; ; ++step)
 	{
-		// iterator
-		Entry* entry = &table->entries[index];
-
-		if (entry->key == NULL)
+		uint32_t first = group * TABLE_GROUP_SIZE;
+		const int8_t* control = table->control + first;
+		uint32_t empty = matchByte(control, CONTROL_EMPTY);
+		for (uint32_t match = matchByte(control, fragment); match != 0; match &= match - 1)
 		{
-			// stop on non-tombstone entry
-			if (IS_NIL(entry->value)) return NULL;
-		}
-		// compare query and entry
-		else if (entry->key->length == length
-			&& entry->key->hash == hash
-			&& memcmp(entry->key->chars, chars, length) == 0)
-		{
-			return entry->key;
+			// compare query and entry
+			ObjectString* key = table->entries[first + lowestBit(match)].key;
+			if (key->hash == hash
+				&& key->length == length
+				&& memcmp(key->chars, chars, length) == 0)
+			{
+				return key;
+			}
 		}
 
+		// stop on a group with an empty slot
+		if (empty != 0) return NULL;
+
 		// next
-		index = (index + 1) & (table->capacity - 1);
+		group = (group + step) & groupMask;
 	}
 }
 
@@ -166,6 +285,8 @@ void markTable(Table* table)
 {
 	for (uint32_t i = 0; i < table->capacity; ++i)
 	{
+		if (table->control[i] < 0) continue;
+
 		Entry* entry = &table->entries[i];
 		markObject((Object*)entry->key);
 		markValue(entry->value);
@@ -174,7 +295,8 @@ void markTable(Table* table)
 
 void freeTable(Table* table)
 {
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	if (table->entries != NULL)
+		FREE_ARRAY(uint8_t, table->entries, blockSize(table->capacity));
 	initTable(table);
 }
 
@@ -182,7 +304,9 @@ void initTable(Table* table)
 {
 	table->count = 0;
 	table->capacity = 0;
+	table->growthLeft = 0;
 	table->entries = NULL;
+	table->control = NULL;
 }
 
 float loadFactor(Table* table)
@@ -194,9 +318,7 @@ void tableRemoveWhite(Table* table)
 {
 	for (uint32_t i = 0; i < table->capacity; ++i)
 	{
-		Entry* entry = &table->entries[i];
-		ObjectString* key = entry->key;
-		if (key != NULL && !key->object.isMarked)
-			tableDelete(table, key);
+		if (table->control[i] >= 0 && !table->entries[i].key->object.isMarked)
+			eraseSlot(table, i);
 	}
 }
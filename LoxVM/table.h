@@ -3,7 +3,14 @@
 #include "common.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD_FACTOR 0.75f
+/// <summary>
+/// Slots probed together, one SSE2 compare over their control bytes.
+/// Capacity is always a multiple of it.
+/// </summary>
+#define TABLE_GROUP_SIZE 16
+
+// grow (or sweep out tombstones) once this many eighths of the slots are used
+#define TABLE_MAX_LOAD_EIGHTHS 7
 
 typedef struct
 {
@@ -11,14 +18,31 @@ typedef struct
 	Value value;
 } Entry;
 
-inline void initEntry(Entry* entry);
-
+/// <summary>
+/// Swiss table: open addressing over groups of TABLE_GROUP_SIZE slots. Each slot has a
+/// control byte that is empty, deleted or the low 7 bits of its key's hash, so a probe
+/// compares 16 fragments at once and only looks at entries whose fragment matches.
+/// https://abseil.io/about/design/swisstables
+/// </summary>
 typedef struct
 {
+	/// <summary>
+	/// Live entries, without tombstones.
+	/// </summary>
 	uint32_t count;
 	uint32_t capacity;
+
+	/// <summary>
+	/// Empty slots that may still be filled before the next rehash.
+	/// </summary>
+	uint32_t growthLeft;
 	Entry* entries;
 
+	/// <summary>
+	/// One byte per slot, in the same allocation right behind 'entries'.
+	/// Only entries of slots with a non-negative byte are initialized.
+	/// </summary>
+	int8_t* control;
 } Table;
 
 bool tableDelete(Table* table, ObjectString* key);
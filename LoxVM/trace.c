@@ -0,0 +1,1067 @@
+#include <string.h>
+
+#include "trace.h"
+
+#ifdef JIT_X64
+
+#include "assembler.h"
+#include "memory.h"
+#include "platform.h"
+
+// a tracing compiler for hot loops. once a loop header is hot, the recorder runs one
+// iteration of the loop in the interpreter's place and emits code for exactly the path
+// it took, specialised to the types it saw:
+// - variables (locals below the loop's stack depth, and globals) stay in memory. the
+//   guards in front of the body check the type of each one once per entry.
+// - temporaries live in registers, numbers unboxed in xmm registers, and instructions
+//   on two constants are folded.
+// - branches and divisors become guards. a failed guard writes the temporaries back to
+//   the stack and leaves for run() at the instruction it guards.
+// the iteration ends at the backward jump to the header, which jumps straight back into
+// the body. anything the recorder doesn't handle (calls, properties, upvalues, inner
+// loops) abandons the recording and run() carries on from that instruction.
+//
+// layout of the code buffer:
+//   entry stub, exit stub   shared with the baseline compiler, see assembler.h
+//   body                    one iteration of the loop, ending in the jump back
+//   preamble                loads GLOBALS, checks the entry types, jumps to the body
+//   side exits              one per guard
+
+#define GLOBALS R13 // vm.globalValues.values, loaded by the preamble
+
+// displacement of a frame slot or global from SLOTS or GLOBALS
+#define SLOT(index) ((int32_t)((index) * sizeof(Value)))
+
+typedef enum
+{
+	TYPE_UNKNOWN, // not seen yet, or no requirement
+	TYPE_NUMBER,
+	TYPE_NIL,
+	TYPE_BOOL,
+	TYPE_STRING,
+	TYPE_OBJECT, // any object but a string
+	TYPE_DEFINED, // only as a requirement: a global that is written before it is read
+} TraceType;
+
+typedef enum
+{
+	OPERAND_CONSTANT,
+	OPERAND_MEMORY, // in its own stack slot
+	OPERAND_DOUBLE, // unboxed, in an xmm register
+	OPERAND_BOXED, // in a general register
+} OperandKind;
+
+/// <summary>
+/// Where a temporary is while the trace runs.
+/// </summary>
+typedef struct
+{
+	OperandKind kind;
+	TraceType type;
+	uint8_t reg;
+
+	/// <summary>
+	/// Frame slot the value belongs in.
+	/// </summary>
+	uint32_t slot;
+	Value constant;
+} Operand;
+
+/// <summary>
+/// A local below the loop or a global, and the type the trace relies on it having.
+/// </summary>
+typedef struct
+{
+	bool isGlobal;
+	uint32_t index;
+
+	/// <summary>
+	/// Checked by the preamble. TYPE_UNKNOWN for a local written before it is read.
+	/// </summary>
+	TraceType entryType;
+
+	/// <summary>
+	/// As of the instruction being recorded.
+	/// </summary>
+	TraceType type;
+} Variable;
+
+/// <summary>
+/// Way back to run() from a guard: the instruction to resume at and the stack there.
+/// </summary>
+typedef struct
+{
+	uint8_t* ip;
+	uint32_t depth;
+
+	/// <summary>
+	/// Index in Recorder.snapshots of the operands from the loop's depth up.
+	/// </summary>
+	uint32_t operands;
+} Exit;
+
+typedef enum
+{
+	RECORD_CONTINUE,
+	RECORD_ABORT, // the instruction wasn't executed, run() has to
+	RECORD_CLOSED, // back at the header
+} RecordResult;
+
+typedef struct
+{
+	Assembler a;
+	Chunk* chunk;
+	Value* slots;
+
+	/// <summary>
+	/// Stack top of the iteration being recorded.
+	/// </summary>
+	Value* sp;
+	uint8_t* header;
+
+	/// <summary>
+	/// Stack depth at the header. Slots below it are variables, the rest temporaries.
+	/// </summary>
+	uint32_t base;
+	uint32_t depth;
+
+	/// <summary>
+	/// Instructions recorded so far, in the order they ran.
+	/// </summary>
+	uint8_t* path[TRACE_LENGTH_MAX];
+	uint32_t length;
+
+	/// <summary>
+	/// The temporaries, by slot.
+	/// </summary>
+	Operand stack[REGISTERS_MAX];
+
+	Variable variables[TRACE_VARIABLES_MAX];
+	uint32_t variableCount;
+
+	bool isBoxedUsed[16];
+	bool isDoubleUsed[16];
+
+	Exit* exits;
+	uint32_t exitCount;
+	uint32_t exitCapacity;
+
+	Operand* snapshots;
+	uint32_t snapshotCount;
+	uint32_t snapshotCapacity;
+} Recorder;
+
+// registers for temporaries. rax, rcx, rdx, xmm0 and xmm1 are scratch.
+static const Register boxedRegisters[] = { RSI, RDI, R8, R9, R10, R11 };
+static const uint8_t doubleRegisters[] = { 2, 3, 4, 5 };
+
+static TraceType typeOf(Value value)
+{
+	if (IS_NUMBER(value)) return TYPE_NUMBER;
+	if (IS_NIL(value)) return TYPE_NIL;
+	if (IS_BOOL(value)) return TYPE_BOOL;
+	if (IS_STRING(value)) return TYPE_STRING;
+	if (IS_OBJECT(value)) return TYPE_OBJECT;
+	return TYPE_UNKNOWN;
+}
+
+static bool isFalsey(Value value)
+{
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static Operand constantOperand(Value value)
+{
+	// the trace only computes with doubles
+	if (IS_INT(value))
+		value = NUMBER_VAL(AS_NUMBER(value));
+
+	Operand operand = { OPERAND_CONSTANT, typeOf(value), 0, 0, value };
+	return operand;
+}
+
+static Operand registerOperand(bool isDouble, TraceType type, uint8_t reg)
+{
+	Operand operand = { isDouble ? OPERAND_DOUBLE : OPERAND_BOXED, type, reg, 0, NIL_VAL };
+	return operand;
+}
+
+static void release(Recorder* r, Operand* operand)
+{
+	if (operand->kind == OPERAND_DOUBLE)
+		r->isDoubleUsed[operand->reg] = false;
+	else if (operand->kind == OPERAND_BOXED)
+		r->isBoxedUsed[operand->reg] = false;
+}
+
+/// <summary>
+/// Write 'operand' to [base + displacement]. Clobbers rax.
+/// </summary>
+static void storeOperand(Recorder* r, Operand* operand, Register base, int32_t displacement)
+{
+	Assembler* a = &r->a;
+	switch (operand->kind)
+	{
+		case OPERAND_CONSTANT:
+			emitImmediate(a, RAX, operand->constant);
+			emitStore(a, base, displacement, RAX);
+			break;
+		case OPERAND_MEMORY:
+			if (base == SLOTS && displacement == SLOT(operand->slot)) break;
+			emitLoad(a, RAX, SLOTS, SLOT(operand->slot));
+			emitStore(a, base, displacement, RAX);
+			break;
+		case OPERAND_DOUBLE: emitStoreDouble(a, base, displacement, operand->reg); break;
+		case OPERAND_BOXED: emitStore(a, base, displacement, (Register)operand->reg); break;
+	}
+}
+
+/// <summary>
+/// Move the temporary in 'slot' to the stack, out of its register.
+/// </summary>
+static void spill(Recorder* r, uint32_t slot)
+{
+	Operand* operand = &r->stack[slot];
+	storeOperand(r, operand, SLOTS, SLOT(slot));
+	release(r, operand);
+	operand->kind = OPERAND_MEMORY;
+}
+
+/// <summary>
+/// Take a free register, spilling the deepest temporary in one if there is none.
+/// </summary>
+static uint8_t allocateRegister(Recorder* r, bool isDouble)
+{
+	bool* isUsed = isDouble ? r->isDoubleUsed : r->isBoxedUsed;
+	uint32_t count = isDouble ? sizeof(doubleRegisters) : sizeof(boxedRegisters) / sizeof(Register);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint8_t reg = isDouble ? doubleRegisters[i] : (uint8_t)boxedRegisters[i];
+		if (isUsed[reg]) continue;
+
+		isUsed[reg] = true;
+		return reg;
+	}
+
+	// an instruction holds at most two popped operands, so the rest are on the stack
+	OperandKind kind = isDouble ? OPERAND_DOUBLE : OPERAND_BOXED;
+	for (uint32_t slot = r->base; slot < r->depth; ++slot)
+	{
+		if (r->stack[slot].kind != kind) continue;
+
+		uint8_t reg = r->stack[slot].reg;
+		spill(r, slot);
+		isUsed[reg] = true;
+		return reg;
+	}
+	return 0; // not reached
+}
+
+/// <summary>
+/// Push 'value' to the real stack and 'operand' to the recorder's.
+/// </summary>
+static void pushOperand(Recorder* r, Operand operand, Value value)
+{
+	operand.slot = r->depth;
+	r->stack[r->depth++] = operand;
+	*r->sp++ = value;
+	vm.sp = r->sp;
+}
+
+/// <summary>
+/// Pop both stacks. The caller releases the operand once it is done with it.
+/// </summary>
+static Operand popOperand(Recorder* r)
+{
+	vm.sp = --r->sp;
+	return r->stack[--r->depth];
+}
+
+static void discard(Recorder* r, uint32_t count)
+{
+	while (count-- > 0)
+	{
+		Operand operand = popOperand(r);
+		release(r, &operand);
+	}
+}
+
+/// <summary>
+/// The general register holding 'operand', loading it to 'scratch' if needs be.
+/// </summary>
+static Register boxedIn(Recorder* r, Operand* operand, Register scratch)
+{
+	Assembler* a = &r->a;
+	switch (operand->kind)
+	{
+		case OPERAND_CONSTANT: emitImmediate(a, scratch, operand->constant); break;
+		case OPERAND_MEMORY: emitLoad(a, scratch, SLOTS, SLOT(operand->slot)); break;
+		case OPERAND_DOUBLE: emitFromDouble(a, scratch, operand->reg); break;
+		case OPERAND_BOXED: return (Register)operand->reg;
+	}
+	return scratch;
+}
+
+/// <summary>
+/// The xmm register holding number 'operand', loading it to 'scratch' if needs be.
+/// Clobbers rax.
+/// </summary>
+static uint8_t doubleIn(Recorder* r, Operand* operand, uint8_t scratch)
+{
+	Assembler* a = &r->a;
+	switch (operand->kind)
+	{
+		case OPERAND_CONSTANT:
+			emitImmediate(a, RAX, operand->constant);
+			emitToDouble(a, scratch, RAX);
+			break;
+		case OPERAND_MEMORY: emitLoadDouble(a, scratch, SLOTS, SLOT(operand->slot)); break;
+		case OPERAND_DOUBLE: return operand->reg;
+		case OPERAND_BOXED: emitToDouble(a, scratch, (Register)operand->reg); break;
+	}
+	return scratch;
+}
+
+/// <summary>
+/// An xmm register of its own holding popped number 'operand', to write a result to.
+/// </summary>
+static uint8_t ownDouble(Recorder* r, Operand* operand)
+{
+	if (operand->kind == OPERAND_DOUBLE) return operand->reg;
+
+	uint8_t reg = allocateRegister(r, true);
+	doubleIn(r, operand, reg);
+	return reg;
+}
+
+/// <summary>
+/// 'operand' again, in a register of its own unless it is a constant.
+/// </summary>
+static Operand copyOperand(Recorder* r, Operand* operand)
+{
+	if (operand->kind == OPERAND_CONSTANT) return *operand;
+
+	// allocating may spill 'operand' itself, so only look at where it is afterwards
+	bool isDouble = operand->type == TYPE_NUMBER;
+	uint8_t reg = allocateRegister(r, isDouble);
+	if (isDouble)
+	{
+		uint8_t source = doubleIn(r, operand, reg);
+		if (source != reg) emitMoveDouble(&r->a, reg, source);
+	}
+	else
+	{
+		Register source = boxedIn(r, operand, (Register)reg);
+		if (source != reg) emitMove(&r->a, (Register)reg, source);
+	}
+	return registerOperand(isDouble, operand->type, reg);
+}
+
+/// <summary>
+/// Remember the stack as it is now, for a guard leaving for run() at 'ip'.
+/// </summary>
+/// <returns>Index of the exit.</returns>
+static uint32_t addExit(Recorder* r, uint8_t* ip)
+{
+	if (r->exitCapacity < r->exitCount + 1)
+	{
+		uint32_t oldCapacity = r->exitCapacity;
+		r->exitCapacity = GROW_CAPACITY(oldCapacity);
+		r->exits = GROW_ARRAY(Exit, r->exits, oldCapacity, r->exitCapacity);
+	}
+
+	uint32_t count = r->depth - r->base;
+	if (r->snapshotCapacity < r->snapshotCount + count)
+	{
+		uint32_t oldCapacity = r->snapshotCapacity;
+		r->snapshotCapacity = GROW_CAPACITY(oldCapacity);
+		if (r->snapshotCapacity < r->snapshotCount + count)
+			r->snapshotCapacity = r->snapshotCount + count;
+		r->snapshots = GROW_ARRAY(Operand, r->snapshots, oldCapacity, r->snapshotCapacity);
+	}
+
+	Exit* exit = &r->exits[r->exitCount];
+	exit->ip = ip;
+	exit->depth = r->depth;
+	exit->operands = r->snapshotCount;
+	if (count > 0) // no snapshot array yet when every exit so far had an empty stack
+		memcpy(r->snapshots + r->snapshotCount, r->stack + r->base, count * sizeof(Operand));
+	r->snapshotCount += count;
+	return r->exitCount++;
+}
+
+/// <summary>
+/// Leave for run() at the instruction at 'ip' when 'condition' holds.
+/// </summary>
+static void emitExitIf(Recorder* r, Condition condition, uint8_t* ip)
+{
+	uint32_t exit = addExit(r, ip);
+	addFixup(&r->a, emitJump(&r->a, condition), exit, true);
+}
+
+/// <summary>
+/// Set the flags of 'a < b' (isLess) or 'a > b' as 'above', like emitCompareOperands
+/// in the baseline compiler.
+/// </summary>
+static void emitCompareNumbers(Recorder* r, bool isLess, uint8_t left, uint8_t right)
+{
+	if (isLess)
+		emitCompareDoubles(&r->a, right, left);
+	else
+		emitCompareDoubles(&r->a, left, right);
+}
+
+static Variable* findVariable(Recorder* r, bool isGlobal, uint32_t index)
+{
+	for (uint32_t i = 0; i < r->variableCount; ++i)
+	{
+		Variable* variable = &r->variables[i];
+		if (variable->isGlobal == isGlobal && variable->index == index) return variable;
+	}
+
+	Variable* variable = &r->variables[r->variableCount++];
+	variable->isGlobal = isGlobal;
+	variable->index = index;
+	variable->entryType = TYPE_UNKNOWN;
+	variable->type = TYPE_UNKNOWN;
+	return variable;
+}
+
+static void readVariable(Recorder* r, Variable* variable, Value value)
+{
+	if (variable->type == TYPE_UNKNOWN)
+		variable->type = variable->entryType = typeOf(value);
+
+	if (variable->type == TYPE_NIL)
+	{
+		pushOperand(r, constantOperand(NIL_VAL), value);
+		return;
+	}
+
+	Register base = variable->isGlobal ? GLOBALS : SLOTS;
+	bool isDouble = variable->type == TYPE_NUMBER;
+	uint8_t reg = allocateRegister(r, isDouble);
+	if (isDouble)
+		emitLoadDouble(&r->a, reg, base, SLOT(variable->index));
+	else
+		emitLoad(&r->a, (Register)reg, base, SLOT(variable->index));
+	pushOperand(r, registerOperand(isDouble, variable->type, reg), value);
+}
+
+static void writeVariable(Recorder* r, Variable* variable, Operand* operand)
+{
+	if (variable->isGlobal && variable->type == TYPE_UNKNOWN)
+		variable->entryType = TYPE_DEFINED;
+
+	storeOperand(r, operand, variable->isGlobal ? GLOBALS : SLOTS, SLOT(variable->index));
+	variable->type = operand->type;
+}
+
+static void getLocal(Recorder* r, uint8_t slot)
+{
+	Value value = r->slots[slot];
+	if (slot >= r->base)
+		pushOperand(r, copyOperand(r, &r->stack[slot]), value);
+	else
+		readVariable(r, findVariable(r, false, slot), value);
+}
+
+static void setLocal(Recorder* r, uint8_t slot)
+{
+	Operand* top = &r->stack[r->depth - 1];
+	r->slots[slot] = r->sp[-1];
+	if (slot < r->base)
+	{
+		writeVariable(r, findVariable(r, false, slot), top);
+		return;
+	}
+
+	Operand operand = copyOperand(r, top);
+	release(r, &r->stack[slot]);
+	operand.slot = slot;
+	r->stack[slot] = operand;
+}
+
+static void recordStringCall(Recorder* r, Value(*function)(Value a, Value b), TraceType type);
+
+/// <summary>
+/// Called by the trace to compare two strings, whose bits differ when one is a rope.
+/// </summary>
+static Value equalStrings(Value a, Value b)
+{
+	return BOOL_VAL(stringsEqual(AS_STRING(a), AS_STRING(b)));
+}
+
+static void recordEqual(Recorder* r)
+{
+	Assembler* a = &r->a;
+	Operand* top = &r->stack[r->depth - 1];
+	if (top[-1].type == TYPE_STRING && top[0].type == TYPE_STRING
+		&& (top[-1].kind != OPERAND_CONSTANT || top[0].kind != OPERAND_CONSTANT))
+	{
+		recordStringCall(r, &equalStrings, TYPE_BOOL);
+		return;
+	}
+
+	Value result = BOOL_VAL(valuesEqual(r->sp[-2], r->sp[-1]));
+	Operand right = popOperand(r);
+	Operand left = popOperand(r);
+
+	// the types partition the values, so different ones are never equal
+	if ((left.kind == OPERAND_CONSTANT && right.kind == OPERAND_CONSTANT) || left.type != right.type)
+	{
+		pushOperand(r, constantOperand(result), result);
+	}
+	else
+	{
+		Register reg = (Register)allocateRegister(r, false);
+		Register x = boxedIn(r, &left, RAX);
+		Register y = boxedIn(r, &right, RCX);
+		emitRegisters(a, X64_CMP, y, x); // numbers are doubles here, equal by bits as in valuesEqual()
+		emitImmediate(a, reg, FALSE_VAL);
+		emitImmediate(a, RDX, TRUE_VAL);
+		emitConditionalMove(a, CONDITION_EQUAL, reg, RDX);
+		pushOperand(r, registerOperand(false, TYPE_BOOL, reg), result);
+	}
+	release(r, &left);
+	release(r, &right);
+}
+
+static void recordComparison(Recorder* r, bool isLess)
+{
+	Assembler* a = &r->a;
+	double b = AS_NUMBER(r->sp[-1]);
+	double aValue = AS_NUMBER(r->sp[-2]);
+	Value result = BOOL_VAL(isLess ? aValue < b : aValue > b);
+	Operand right = popOperand(r);
+	Operand left = popOperand(r);
+
+	if (left.kind == OPERAND_CONSTANT && right.kind == OPERAND_CONSTANT)
+	{
+		pushOperand(r, constantOperand(result), result);
+	}
+	else
+	{
+		Register reg = (Register)allocateRegister(r, false);
+		uint8_t x = doubleIn(r, &left, 0);
+		uint8_t y = doubleIn(r, &right, 1);
+		emitCompareNumbers(r, isLess, x, y);
+		emitImmediate(a, reg, FALSE_VAL);
+		emitImmediate(a, RCX, TRUE_VAL);
+		emitConditionalMove(a, CONDITION_ABOVE, reg, RCX);
+		pushOperand(r, registerOperand(false, TYPE_BOOL, reg), result);
+	}
+	release(r, &left);
+	release(r, &right);
+}
+
+static void recordArithmetic(Recorder* r, uint8_t opcode, uint8_t* ip)
+{
+	Assembler* a = &r->a;
+	double b = AS_NUMBER(r->sp[-1]);
+	double aValue = AS_NUMBER(r->sp[-2]);
+	double value = 0;
+	switch (opcode)
+	{
+		case SSE_ADD: value = aValue + b; break;
+		case SSE_SUBTRACT: value = aValue - b; break;
+		case SSE_MULTIPLY: value = aValue * b; break;
+		case SSE_DIVIDE: value = aValue / b; break;
+	}
+
+	Operand* divisor = &r->stack[r->depth - 1];
+	if (opcode == SSE_DIVIDE && divisor->kind != OPERAND_CONSTANT)
+	{
+		// leave +-0 to run(), which reports the division by zero
+		Register bits = boxedIn(r, divisor, RCX);
+		if (bits != RCX) emitMove(a, RCX, bits);
+		emitRegisters(a, X64_ADD, RCX, RCX); // shifts out the sign
+		emitExitIf(r, CONDITION_EQUAL, ip);
+	}
+
+	Operand right = popOperand(r);
+	Operand left = popOperand(r);
+	if (left.kind == OPERAND_CONSTANT && right.kind == OPERAND_CONSTANT)
+	{
+		pushOperand(r, constantOperand(NUMBER_VAL(value)), NUMBER_VAL(value));
+		return;
+	}
+
+	// the result takes over the left operand's register
+	uint8_t reg = ownDouble(r, &left);
+	emitArithmeticDouble(a, opcode, reg, doubleIn(r, &right, 1));
+	release(r, &right);
+	pushOperand(r, registerOperand(true, TYPE_NUMBER, reg), NUMBER_VAL(value));
+}
+
+/// <summary>
+/// Called by the trace for string addition. Both strings are on the stack below vm.sp.
+/// </summary>
+static Value concatenateValues(Value a, Value b)
+{
+	return OBJECT_VAL(concatenate(AS_STRING(a), AS_STRING(b)));
+}
+
+/// <summary>
+/// Replace the two strings on top with what 'function' returns for them,
+/// both in the trace and now.
+/// </summary>
+static void recordStringCall(Recorder* r, Value(*function)(Value a, Value b), TraceType type)
+{
+	Assembler* a = &r->a;
+
+	// the call may collect garbage, so every temporary goes to the stack and vm.sp
+	for (uint32_t slot = r->base; slot < r->depth; ++slot)
+		spill(r, slot);
+	emitMove(a, RAX, SLOTS);
+	emitAddImmediate(a, RAX, SLOT(r->depth), false);
+	emitImmediate(a, RCX, (uint64_t)(uintptr_t)&vm.sp);
+	emitStore(a, RCX, 0, RAX);
+	emitLoad(a, ARGUMENT_0, SLOTS, SLOT(r->depth - 2));
+	emitLoad(a, ARGUMENT_1, SLOTS, SLOT(r->depth - 1));
+	emitCall(a, (void*)function);
+
+	// only now, emitting may collect garbage and nothing else holds a new string yet
+	Value result = function(r->sp[-2], r->sp[-1]);
+	discard(r, 2);
+	Register reg = (Register)allocateRegister(r, false);
+	emitMove(a, reg, RAX);
+	pushOperand(r, registerOperand(false, type, reg), result);
+}
+
+static void recordConcatenate(Recorder* r)
+{
+	recordStringCall(r, &concatenateValues, TYPE_STRING);
+}
+
+static void recordNot(Recorder* r)
+{
+	Assembler* a = &r->a;
+	Value result = BOOL_VAL(isFalsey(r->sp[-1]));
+	Operand operand = popOperand(r);
+
+	// only booleans can go either way
+	if (operand.kind == OPERAND_CONSTANT || operand.type != TYPE_BOOL)
+	{
+		pushOperand(r, constantOperand(result), result);
+	}
+	else
+	{
+		Register reg = (Register)allocateRegister(r, false);
+		Register x = boxedIn(r, &operand, RAX);
+		emitImmediate(a, RCX, FALSE_VAL);
+		emitRegisters(a, X64_CMP, RCX, x);
+		emitImmediate(a, reg, FALSE_VAL);
+		emitImmediate(a, RCX, TRUE_VAL);
+		emitConditionalMove(a, CONDITION_EQUAL, reg, RCX);
+		pushOperand(r, registerOperand(false, TYPE_BOOL, reg), result);
+	}
+	release(r, &operand);
+}
+
+static void recordNegate(Recorder* r)
+{
+	Assembler* a = &r->a;
+	Value result = NUMBER_VAL(-AS_NUMBER(r->sp[-1]));
+	Operand operand = popOperand(r);
+	if (operand.kind == OPERAND_CONSTANT)
+	{
+		pushOperand(r, constantOperand(result), result);
+		return;
+	}
+
+	uint8_t reg = ownDouble(r, &operand);
+	emitFromDouble(a, RAX, reg);
+	emitImmediate(a, RCX, SIGN_BIT);
+	emitRegisters(a, X64_XOR, RCX, RAX);
+	emitToDouble(a, reg, RAX);
+	pushOperand(r, registerOperand(true, TYPE_NUMBER, reg), result);
+}
+
+/// <summary>
+/// Leave for run() at 'ip' unless the top of the stack is as falsey as it is now.
+/// </summary>
+static void guardTruth(Recorder* r, bool isFalse, uint8_t* ip)
+{
+	Assembler* a = &r->a;
+	Operand* operand = &r->stack[r->depth - 1];
+	if (operand->kind == OPERAND_CONSTANT || operand->type != TYPE_BOOL) return;
+
+	Register x = boxedIn(r, operand, RAX);
+	emitImmediate(a, RCX, FALSE_VAL);
+	emitRegisters(a, X64_CMP, RCX, x);
+	emitExitIf(r, isFalse ? CONDITION_NOT_EQUAL : CONDITION_EQUAL, ip);
+}
+
+/// <summary>
+/// Leave for run() at 'ip' unless the comparison of the top two numbers goes the way
+/// it went now.
+/// </summary>
+static void guardComparison(Recorder* r, bool isLess, bool isTaken, uint8_t* ip)
+{
+	Operand* left = &r->stack[r->depth - 2];
+	Operand* right = &r->stack[r->depth - 1];
+	if (left->kind == OPERAND_CONSTANT && right->kind == OPERAND_CONSTANT) return;
+
+	uint8_t x = doubleIn(r, left, 0);
+	uint8_t y = doubleIn(r, right, 1);
+	emitCompareNumbers(r, isLess, x, y);
+	emitExitIf(r, isTaken ? CONDITION_ABOVE : CONDITION_BELOW_EQUAL, ip);
+}
+
+/// <summary>
+/// Emit code for the instruction at 'ip' and execute it, advancing 'ip' the way it went.
+/// Nothing is executed when recording is abandoned.
+/// </summary>
+static RecordResult recordInstruction(Recorder* r, uint8_t** ip)
+{
+	Chunk* chunk = r->chunk;
+	uint8_t* code = *ip;
+	uint32_t offset = (uint32_t)(code - chunk->code);
+	Value* constants = chunk->constants.values;
+	Value* sp = r->sp;
+	uint32_t destination = 0;
+	jumpDestination(chunk, offset, &destination);
+
+	// room for what any one instruction pushes and the variables it names
+	if (r->depth + 2 > REGISTERS_MAX || r->variableCount + 2 > TRACE_VARIABLES_MAX)
+		return RECORD_ABORT;
+
+	r->path[r->length++] = code;
+	*ip = code + instructionSize(chunk, offset);
+	switch (code[0])
+	{
+		case OP_CONSTANT: pushOperand(r, constantOperand(constants[code[1]]), constants[code[1]]); break;
+		case OP_CONSTANT_LONG:
+		{
+			Value value = constants[(code[1] << 16) | (code[2] << 8) | code[3]];
+			pushOperand(r, constantOperand(value), value);
+			break;
+		}
+		case OP_CONSTANT_ZERO: pushOperand(r, constantOperand(constants[0]), constants[0]); break;
+		case OP_ZERO: pushOperand(r, constantOperand(NUMBER_VAL(0)), NUMBER_VAL(0)); break;
+		case OP_ONE: pushOperand(r, constantOperand(NUMBER_VAL(1)), NUMBER_VAL(1)); break;
+		case OP_NEG_ONE: pushOperand(r, constantOperand(NUMBER_VAL(-1)), NUMBER_VAL(-1)); break;
+		case OP_NIL: pushOperand(r, constantOperand(NIL_VAL), NIL_VAL); break;
+		case OP_TRUE: pushOperand(r, constantOperand(TRUE_VAL), TRUE_VAL); break;
+		case OP_FALSE: pushOperand(r, constantOperand(FALSE_VAL), FALSE_VAL); break;
+		case OP_POP: discard(r, 1); break;
+		case OP_POPN: discard(r, code[1]); break;
+
+		case OP_GET_LOCAL: getLocal(r, code[1]); break;
+		case OP_SET_LOCAL: setLocal(r, code[1]); break;
+		case OP_GET_GLOBAL:
+		case OP_GET_GLOBAL_LONG:
+		{
+			uint32_t index = code[0] == OP_GET_GLOBAL_LONG
+				? (code[1] << 16) | (code[2] << 8) | code[3] : code[1];
+			Value value = vm.globalValues.values[index];
+			if (IS_UNDEFINED(value)) return RECORD_ABORT;
+
+			readVariable(r, findVariable(r, true, index), value);
+			break;
+		}
+		case OP_SET_GLOBAL:
+		case OP_SET_GLOBAL_LONG:
+		{
+			uint32_t index = code[0] == OP_SET_GLOBAL_LONG
+				? (code[1] << 16) | (code[2] << 8) | code[3] : code[1];
+			if (IS_UNDEFINED(vm.globalValues.values[index])) return RECORD_ABORT;
+
+			vm.globalValues.values[index] = sp[-1];
+			writeVariable(r, findVariable(r, true, index), &r->stack[r->depth - 1]);
+			break;
+		}
+
+		case OP_EQUAL: recordEqual(r); break;
+		case OP_GREATER:
+		case OP_LESS:
+			if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) return RECORD_ABORT;
+			recordComparison(r, code[0] == OP_LESS);
+			break;
+		case OP_ADD:
+		case OP_ADD_NUM:
+		case OP_ADD_STR:
+			if (IS_STRING(sp[-1]) && IS_STRING(sp[-2]))
+			{
+				recordConcatenate(r);
+				break;
+			}
+			if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) return RECORD_ABORT;
+			recordArithmetic(r, SSE_ADD, code);
+			break;
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+			if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) return RECORD_ABORT;
+			if (code[0] == OP_DIVIDE && AS_NUMBER(sp[-1]) == 0) return RECORD_ABORT;
+			recordArithmetic(r, code[0] == OP_SUBTRACT ? SSE_SUBTRACT
+				: code[0] == OP_MULTIPLY ? SSE_MULTIPLY : SSE_DIVIDE, code);
+			break;
+		case OP_NOT: recordNot(r); break;
+		case OP_NEGATE:
+			if (!IS_NUMBER(sp[-1])) return RECORD_ABORT;
+			recordNegate(r);
+			break;
+
+		case OP_JUMP_IF_FALSE:
+		case OP_POP_JUMP_IF_FALSE:
+		{
+			bool isFalse = isFalsey(sp[-1]);
+			guardTruth(r, isFalse, code);
+			if (code[0] == OP_POP_JUMP_IF_FALSE) discard(r, 1);
+			if (isFalse) *ip = chunk->code + destination;
+			break;
+		}
+		case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_NOT_GREATER:
+		{
+			if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) return RECORD_ABORT;
+			bool isLess = code[0] == OP_JUMP_IF_NOT_LESS;
+			double b = AS_NUMBER(sp[-1]);
+			double a = AS_NUMBER(sp[-2]);
+			bool isTaken = !(isLess ? a < b : a > b);
+			guardComparison(r, isLess, isTaken, code);
+			discard(r, 2);
+			if (isTaken) *ip = chunk->code + destination;
+			break;
+		}
+		case OP_JUMP: *ip = chunk->code + destination; break;
+		case OP_LOOP:
+		case OP_POP_LOOP:
+		{
+			// a for loop jumps back twice per iteration, from the body to the increment and
+			// from there to the condition. going round anything already recorded means an
+			// inner loop though, which gets a trace of its own.
+			uint8_t* target = chunk->code + destination;
+			if (target != r->header)
+				for (uint32_t i = 0; i < r->length; ++i)
+					if (r->path[i] == target) return RECORD_ABORT;
+
+			if (code[0] == OP_POP_LOOP) discard(r, 1);
+			*ip = target;
+			if (target == r->header) return RECORD_CLOSED;
+			break;
+		}
+
+		// superinstructions
+		case OP_GET_LOCAL_LOCAL:
+			getLocal(r, code[1]);
+			getLocal(r, code[2]);
+			break;
+		case OP_GET_LOCAL_CONSTANT:
+			getLocal(r, code[1]);
+			pushOperand(r, constantOperand(constants[code[2]]), constants[code[2]]);
+			break;
+		case OP_SET_LOCAL_POP:
+			setLocal(r, code[1]);
+			discard(r, 1);
+			break;
+
+		// calls, upvalues, the object model and printing
+		default:
+			return RECORD_ABORT;
+	}
+	return RECORD_CONTINUE;
+}
+
+/// <summary>
+/// Leave through exit 0, back to the header, unless rax holds a value of 'type'.
+/// Clobbers rax, rcx and rdx.
+/// </summary>
+static void emitTypeGuard(Recorder* r, TraceType type)
+{
+	Assembler* a = &r->a;
+	Condition failure = CONDITION_NOT_EQUAL;
+	switch (type)
+	{
+		case TYPE_NUMBER:
+			emitMove(a, RDX, RAX);
+			emitRegisters(a, X64_AND, QNAN_BITS, RDX);
+			emitRegisters(a, X64_CMP, QNAN_BITS, RDX);
+			failure = CONDITION_EQUAL;
+			break;
+		case TYPE_NIL:
+			emitImmediate(a, RDX, NIL_VAL);
+			emitRegisters(a, X64_CMP, RDX, RAX);
+			break;
+		case TYPE_BOOL: // like IS_BOOL
+			emitImmediate(a, RDX, 1);
+			emitRegisters(a, X64_OR, RDX, RAX);
+			emitImmediate(a, RDX, TRUE_VAL);
+			emitRegisters(a, X64_CMP, RDX, RAX);
+			break;
+		case TYPE_STRING:
+		case TYPE_OBJECT:
+			emitImmediate(a, RCX, QNAN | SIGN_BIT);
+			emitMove(a, RDX, RAX);
+			emitRegisters(a, X64_AND, RCX, RDX);
+			emitRegisters(a, X64_CMP, RCX, RDX);
+			addFixup(a, emitJump(a, CONDITION_NOT_EQUAL), 0, true);
+			emitImmediate(a, RCX, ~(QNAN | SIGN_BIT));
+			emitRegisters(a, X64_AND, RCX, RAX);
+			emitCompareObjectType(a, RAX, OBJECT_STRING);
+			if (type == TYPE_OBJECT) failure = CONDITION_EQUAL;
+			break;
+		case TYPE_DEFINED:
+			emitImmediate(a, RDX, UNDEFINED_VAL);
+			emitRegisters(a, X64_CMP, RDX, RAX);
+			failure = CONDITION_EQUAL;
+			break;
+		default:
+			return;
+	}
+	addFixup(a, emitJump(a, failure), 0, true);
+}
+
+/// <summary>
+/// Close the loop, add the preamble and the side exits and make the code executable.
+/// Leaves 'trace' uncompiled if the variables changed type on the way round, as then
+/// the iteration doesn't lead into the next one.
+/// </summary>
+static void finishTrace(Recorder* r, Trace* trace, uint32_t body)
+{
+	Assembler* a = &r->a;
+	for (uint32_t i = 0; i < r->variableCount; ++i)
+	{
+		Variable* variable = &r->variables[i];
+		if (variable->entryType != TYPE_UNKNOWN && variable->entryType != TYPE_DEFINED
+			&& variable->type != variable->entryType) return;
+	}
+	patchJump(a, emitJump(a, CONDITION_ALWAYS), body);
+
+	trace->entry = a->count;
+	emitImmediate(a, GLOBALS, (uint64_t)(uintptr_t)&vm.globalValues.values);
+	emitLoad(a, GLOBALS, GLOBALS, 0);
+	for (uint32_t i = 0; i < r->variableCount; ++i)
+	{
+		Variable* variable = &r->variables[i];
+		if (variable->entryType == TYPE_UNKNOWN) continue;
+
+		Register base = variable->isGlobal ? GLOBALS : SLOTS;
+		emitLoad(a, RAX, base, SLOT(variable->index));
+		if (variable->entryType == TYPE_NUMBER)
+		{
+			// the body reads numbers as doubles, so small integers become one on the way in
+			emitIntToDouble(a, RAX, 0);
+			emitStore(a, base, SLOT(variable->index), RAX);
+		}
+		emitTypeGuard(r, variable->entryType);
+	}
+	patchJump(a, emitJump(a, CONDITION_ALWAYS), body);
+
+	for (uint32_t i = 0; i < a->fixupCount; ++i)
+	{
+		Fixup* fixup = &a->fixups[i];
+		Exit* exit = &r->exits[fixup->target];
+		patchJump(a, fixup->at, a->count);
+		for (uint32_t j = 0; j < exit->depth - r->base; ++j)
+		{
+			Operand* operand = &r->snapshots[exit->operands + j];
+			storeOperand(r, operand, SLOTS, SLOT(operand->slot));
+		}
+		emitMove(a, SP, SLOTS);
+		emitAddImmediate(a, SP, SLOT(exit->depth), false);
+		emitExit(a, exit->ip);
+	}
+
+	trace->code = finishAssembler(a, &trace->size);
+}
+
+/// <summary>
+/// Run one iteration of the loop at 'trace->header' while recording it, and compile it
+/// if it makes it back to the header.
+/// </summary>
+/// <returns>Where run() continues.</returns>
+static uint8_t* recordTrace(Trace* trace, CallFrame* frame, Value* sp)
+{
+	Recorder r;
+	initAssembler(&r.a);
+	r.chunk = &frame->closure->function->chunk;
+	r.slots = frame->slots;
+	r.sp = sp;
+	r.header = trace->header;
+	r.base = r.depth = (uint32_t)(sp - frame->slots);
+	r.length = 0;
+	r.variableCount = 0;
+	memset(r.isBoxedUsed, 0, sizeof(r.isBoxedUsed));
+	memset(r.isDoubleUsed, 0, sizeof(r.isDoubleUsed));
+	r.exits = NULL;
+	r.exitCount = 0;
+	r.exitCapacity = 0;
+	r.snapshots = NULL;
+	r.snapshotCount = 0;
+	r.snapshotCapacity = 0;
+
+	emitEntryStub(&r.a);
+	emitExitStub(&r.a);
+	addExit(&r, r.header); // exit 0, for the preamble
+
+	uint32_t body = r.a.count;
+	uint8_t* ip = r.header;
+	RecordResult result = RECORD_CONTINUE;
+	while (r.length < TRACE_LENGTH_MAX && result == RECORD_CONTINUE)
+	{
+		uint8_t* instruction = ip;
+		result = recordInstruction(&r, &ip);
+		if (result == RECORD_ABORT) ip = instruction;
+	}
+
+	if (result == RECORD_CLOSED && r.depth == r.base)
+		finishTrace(&r, trace, body);
+
+	freeAssembler(&r.a);
+	FREE_ARRAY(Exit, r.exits, r.exitCapacity);
+	FREE_ARRAY(Operand, r.snapshots, r.snapshotCapacity);
+	vm.sp = r.sp;
+	return ip;
+}
+
+static Trace* findTrace(ObjectFunction* function, uint8_t* header)
+{
+	for (Trace* trace = function->traces; trace != NULL; trace = trace->next)
+		if (trace->header == header) return trace;
+
+	Trace* trace = ALLOCATE(Trace, 1);
+	trace->header = header;
+	trace->hotness = 0;
+	trace->attempts = 0;
+	trace->code = NULL;
+	trace->size = 0;
+	trace->entry = 0;
+	trace->next = function->traces;
+	function->traces = trace;
+	return trace;
+}
+
+uint8_t* runTrace(CallFrame* frame, uint8_t* header, Value* sp)
+{
+	vm.sp = sp;
+	Trace* trace = findTrace(frame->closure->function, header);
+	if (trace->code == NULL)
+	{
+		if (trace->attempts >= TRACE_ATTEMPTS_MAX || ++trace->hotness < TRACE_THRESHOLD)
+			return header;
+
+		trace->hotness = 0;
+		++trace->attempts;
+		uint8_t* ip = recordTrace(trace, frame, sp);
+		if (trace->code == NULL || ip != header) return ip;
+	}
+
+	JitEntry entry = (JitEntry)(void*)trace->code;
+	return entry(trace->code + trace->entry, frame->slots, vm.sp, frame->closure);
+}
+
+void freeTraces(Trace* trace)
+{
+	while (trace != NULL)
+	{
+		Trace* next = trace->next;
+		if (trace->code != NULL) freeExecutable(trace->code, trace->size);
+		FREE(Trace, trace);
+		trace = next;
+	}
+}
+
+#endif
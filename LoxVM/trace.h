@@ -0,0 +1,52 @@
+#pragma once
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT_X64
+
+#define TRACE_THRESHOLD 50 // backward jumps to a loop header before it is recorded
+#define TRACE_ATTEMPTS_MAX 4 // failed recordings before a loop is left to the interpreter
+#define TRACE_LENGTH_MAX 512 // instructions in one trace
+#define TRACE_VARIABLES_MAX 32 // locals and globals one trace can read or write
+
+/// <summary>
+/// A loop header run() has jumped back to, and its machine code once recorded.
+/// </summary>
+struct Trace
+{
+	/// <summary>
+	/// Instruction the loop's backward jump lands on.
+	/// </summary>
+	uint8_t* header;
+
+	uint32_t hotness;
+	uint32_t attempts;
+
+	/// <summary>
+	/// Read-execute memory starting with the entry stub, NULL until recorded.
+	/// </summary>
+	uint8_t* code;
+	size_t size;
+
+	/// <summary>
+	/// Offset into 'code' of the type guards that precede the loop body.
+	/// </summary>
+	uint32_t entry;
+
+	struct Trace* next;
+};
+
+typedef struct Trace Trace;
+
+/// <summary>
+/// Called by run() on every backward jump to 'header'. Counts the jump, records the
+/// loop once it is hot and runs the recorded code while the guards hold.
+/// Leaves the stack top in vm.sp.
+/// </summary>
+/// <returns>The instruction run() should execute next.</returns>
+uint8_t* runTrace(CallFrame* frame, uint8_t* header, Value* sp);
+
+void freeTraces(Trace* trace);
+
+#endif
@@ -34,12 +34,18 @@ void initValueArray(ValueArray* array)
 
 #ifndef NAN_BOXING
 
+static void printUndefinedValue(Value value)
+{
+	printf("undefined");
+}
+
 PrintValueFn printValueFunctions[] =
 {
 	[VAL_BOOL] = { printBoolValue },
 	[VAL_NIL] = { printNilValue },
 	[VAL_NUMBER] = { printNumberValue },
-	[VAL_OBJECT] = { printObject }
+	[VAL_OBJECT] = { printObject },
+	[VAL_UNDEFINED] = { printUndefinedValue }
 };
 
 #endif
@@ -63,6 +69,10 @@ void printValue(Value value)
 	{
 		printObject(value);
 	}
+	else if (IS_UNDEFINED(value))
+	{
+		printf("undefined");
+	}
 	else
 	{
 		exit(123);
@@ -78,7 +88,17 @@ void printValue(Value value)
 bool valuesEqual(Value a, Value b)
 {
 #ifdef NAN_BOXING
-	return a == b;
+	if (a == b)
+		return true;
+
+	// a rope can equal a string it isn't
+	if (IS_STRING(a) && IS_STRING(b))
+		return stringsEqual(AS_STRING(a), AS_STRING(b));
+
+	// a small integer equals the double of the same number. numbers are equal by the bits
+	// of their doubles, as in compiled code, so 0 and -0 differ and a NaN equals itself
+	return IS_INT(a) != IS_INT(b) && IS_NUMBER(a) && IS_NUMBER(b)
+		&& NUMBER_VAL(AS_NUMBER(a)) == NUMBER_VAL(AS_NUMBER(b));
 
 #else
 	if (a.type != b.type)
@@ -88,8 +108,14 @@ bool valuesEqual(Value a, Value b)
 	{
 		case VAL_BOOL:	 return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NIL:	 return true; // nil :== nil
-		case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-		case VAL_OBJECT: return AS_OBJECT(a) == AS_OBJECT(b);
+		case VAL_NUMBER: // by bits, like NaN-boxed numbers
+		{
+			double x = AS_NUMBER(a), y = AS_NUMBER(b);
+			return memcmp(&x, &y, sizeof(double)) == 0;
+		}
+		case VAL_OBJECT: return AS_OBJECT(a) == AS_OBJECT(b)
+			|| (IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b)));
+		case VAL_UNDEFINED: return true;
 		default: exit(123); // unreachable;
 	}
 #endif
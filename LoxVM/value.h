@@ -11,7 +11,9 @@ typedef struct ObjectClosure ObjectClosure;
 typedef struct ObjectUpvalue ObjectUpvalue;
 typedef struct ObjectClass ObjectClass;
 typedef struct ObjectInstance ObjectInstance;
+typedef struct ObjectShape ObjectShape;
 typedef struct ObjectBoundMethod ObjectBoundMethod;
+typedef struct VM VM;
 
 #ifdef NAN_BOXING
 
@@ -22,6 +24,11 @@ typedef struct ObjectBoundMethod ObjectBoundMethod;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+#define TAG_UNDEFINED 4 // 100.
+
+// above the singletons' tags and any object pointer, which fit in 48 bits.
+// a small integer is QNAN | TAG_INT with the int32 in the low half.
+#define TAG_INT ((uint64_t)0x0001000000000000)
 
 typedef uint64_t Value;
 
@@ -52,21 +59,53 @@ static Value numToValue(double number)
 #define NIL_VAL				((Value)(uint64_t)(QNAN | TAG_NIL))
 #define FALSE_VAL			((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL			((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define UNDEFINED_VAL		((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
 #define BOOL_VAL(b)			((b) ? TRUE_VAL : FALSE_VAL)
 #define NUMBER_VAL(num)		numToValue(num)
+#define INT_VAL(i)			((Value)(QNAN | TAG_INT | (uint32_t)(int32_t)(i)))
+#define INT64_VAL(i)		int64ToValue(i)
 #define OBJECT_VAL(obj)		(Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_OBJECT(value)	((Object*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
-#define AS_NUMBER(value)	valueToNum(value)
+#define AS_NUMBER(value)	valueToNumber(value)
+#define AS_DOUBLE(value)	valueToNum(value)
+#define AS_INT(value)		((int32_t)(uint32_t)(value))
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_OBJECT(value)	(((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 #define IS_NIL(value)       ((value) == NIL_VAL)
-#define IS_NUMBER(value)	(((value) & QNAN) != QNAN)
+#define IS_NUMBER(value)	isNumber(value)
+#define IS_DOUBLE(value)	(((value) & QNAN) != QNAN)
+#define IS_INT(value)		(((value) >> 32) == ((QNAN | TAG_INT) >> 32))
+#define IS_INT_PAIR(a, b)	(((((a) ^ (QNAN | TAG_INT)) | ((b) ^ (QNAN | TAG_INT))) >> 32) == 0)
+#define IS_UNDEFINED(value)	((value) == UNDEFINED_VAL)
+
+/// <summary>
+/// A double or a small integer. Both are numbers to scripts.
+/// </summary>
+static inline bool isNumber(Value value)
+{
+	return IS_DOUBLE(value) || IS_INT(value);
+}
+
+static inline double valueToNumber(Value value)
+{
+	return IS_INT(value) ? (double)AS_INT(value) : valueToNum(value);
+}
+
+/// <summary>
+/// Exact result of integer arithmetic: a small integer while it fits, a double after.
+/// </summary>
+static inline Value int64ToValue(int64_t i)
+{
+	return i == (int32_t)i ? INT_VAL(i) : numToValue((double)i);
+}
 
 #else
 
+#undef JIT_X64 // machine code only knows NaN-boxed values
+
 // REMEMBER to modify to printValueFunctions table if modifying.
 typedef enum
 {
@@ -74,6 +113,7 @@ typedef enum
 	VAL_NIL,
 	VAL_NUMBER,
 	VAL_OBJECT,
+	VAL_UNDEFINED, // global slot reserved but not defined yet, never seen by scripts
 } ValueType;
 
 typedef struct
@@ -92,17 +132,28 @@ typedef struct
 #define IS_NIL(value)		((value).type == VAL_NIL)
 #define IS_NUMBER(value)	((value).type == VAL_NUMBER)
 #define IS_OBJECT(value)	((value).type == VAL_OBJECT)
+#define IS_UNDEFINED(value)	((value).type == VAL_UNDEFINED)
+
+// small integers only exist NaN-boxed, here they are plain numbers
+#define IS_DOUBLE(value)	IS_NUMBER(value)
+#define IS_INT(value)		false
+#define IS_INT_PAIR(a, b)	false
 
 // getters
 #define AS_BOOL(value)		((value).as.boolean)
 #define AS_NUMBER(value)	((value).as.number)
 #define AS_OBJECT(value)	((value).as.object)
+#define AS_DOUBLE(value)	AS_NUMBER(value)
+#define AS_INT(value)		((int32_t)AS_NUMBER(value))
 
 // setters
 #define BOOL_VAL(value)		((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL				((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)	((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)		NUMBER_VAL((double)(value))
+#define INT64_VAL(value)	NUMBER_VAL((double)(value))
 #define OBJECT_VAL(obj)		((Value){VAL_OBJECT, {.object = (Object*)obj}})
+#define UNDEFINED_VAL		((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
@@ -1,66 +1,163 @@
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "platform.h"
+#include "trace.h"
 #include "value.h"
 #include "vm.h"
 
 // prototypes
-static void defineNativeFunction(const char* name, NativeFn function);
+static ObjectNative* defineNativeFunction(const char* name, NativeFn function, uint8_t arity);
+static void defineNumberNative1(const char* name, NativeNumber1 function);
+static void defineNumberNative2(const char* name, NativeNumber2 function);
+static void defineStringNative1(const char* name, NativeString1 function);
 inline CallFrame* currentCallFrame();
 
 VM vm;
 
+#ifdef DEBUG_PROFILE_OPCODES
+/// <summary>
+/// How often [first][second] executed back to back. Used to pick superinstructions.
+/// </summary>
+static uint64_t opcodePairCounts[UINT8_COUNT][UINT8_COUNT];
+
+/// <summary>
+/// Instructions dispatched by either engine.
+/// </summary>
+static uint64_t dispatchCount;
+
+static void printOpcodeProfile()
+{
+	fprintf(stderr, "== %llu dispatches ==\n", (unsigned long long)dispatchCount);
+	fprintf(stderr, "== opcode pairs ==\n");
+	// selection of the most frequent pairs, destructive since we're shutting down
+	for (uint32_t n = 0; n < 32; ++n)
+	{
+		uint32_t first = 0, second = 0;
+		for (uint32_t i = 0; i < UINT8_COUNT; ++i)
+			for (uint32_t j = 0; j < UINT8_COUNT; ++j)
+				if (opcodePairCounts[i][j] > opcodePairCounts[first][second])
+					first = i, second = j;
+
+		if (opcodePairCounts[first][second] == 0)
+			break;
+		fprintf(stderr, "%3u %3u %12llu\n", first, second,
+			(unsigned long long)opcodePairCounts[first][second]);
+		opcodePairCounts[first][second] = 0;
+	}
+}
+#endif
+
 /// <summary>
 /// Reset stack pointer.
 /// </summary>
 /// <param name="vm"></param>
-static void resetStack()
+static void resetStack(VM* vm)
 {
-	vm.stack.count = 0;
-	vm.frameCount = 0;
-	vm.openUpvalues = NULL;
+	vm->sp = vm->stack;
+	vm->frameTop = vm->stack;
+	vm->frameCount = 0;
+
+	// forget what the abandoned frames captured
+	for (ObjectUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+		vm->openUpvalueSlots[upvalue->location - vm->stack] = NULL;
+	vm->openUpvalues = NULL;
 	// no need to actually de-allocate anything
 }
 
+static FrameSegment* newFrameSegment(FrameSegment* previous, uint32_t capacity)
+{
+	// not a GC object, and allocating it must not start a collection mid-call
+	FrameSegment* segment = (FrameSegment*)malloc(
+		sizeof(FrameSegment) + sizeof(CallFrame) * capacity);
+	if (segment == NULL) exit(1);
+
+	segment->previous = previous;
+	segment->next = NULL;
+	segment->capacity = capacity;
+	return segment;
+}
+
 void initStack(VM* vm)
 {
-	initValueArray(&vm->stack);
-	vm->stack.capacity = STACK_DEFAULT;
-	vm->stack.values = GROW_ARRAY(Value, vm->stack.values, 0, STACK_DEFAULT);
-	resetStack();
+	// reserved once up front. every frame checks its headroom in call(),
+	// so nothing in run() has to bounds-check a push.
+	vm->stack = (Value*)allocateGuarded(sizeof(Value) * STACK_DEFAULT);
+	vm->stackLimit = vm->stack + STACK_DEFAULT;
+	vm->openUpvalueSlots = (ObjectUpvalue**)allocateGuarded(
+		sizeof(ObjectUpvalue*) * STACK_DEFAULT);
+	vm->openUpvalues = NULL;
+
+	// deeper segments only get allocated by code that recurses that far
+	vm->callStack = newFrameSegment(NULL, FRAMES_SEGMENT);
+	vm->frameSegment = vm->callStack;
+	vm->frame = NULL;
+	resetStack(vm);
 }
 
 void freeVM(VM* vm)
 {
-	// free stack
-	freeValueArray(&vm->stack);
+#ifdef DEBUG_PROFILE_OPCODES
+	printOpcodeProfile();
+#endif
 
 	// force GC
 	vm->initString = NULL;
 	freeObjects(vm->objects);
 
 	freeTable(&vm->strings);
-	freeTable(&vm->globals);
+	freeTable(&vm->globalSlots);
+	freeValueArray(&vm->globalValues);
+	freeValueArray(&vm->globalNames);
 
 	// reset fields
 	initVM(vm);
+
+	// free stack last, initVM() pushes while interning
+	freeGuarded(vm->stack, sizeof(Value) * STACK_DEFAULT);
+	vm->stack = NULL;
+	vm->sp = NULL;
+	vm->stackLimit = NULL;
+	freeGuarded(vm->openUpvalueSlots, sizeof(ObjectUpvalue*) * STACK_DEFAULT);
+	vm->openUpvalueSlots = NULL;
+
+	while (vm->callStack != NULL)
+	{
+		FrameSegment* next = vm->callStack->next;
+		free(vm->callStack);
+		vm->callStack = next;
+	}
+	vm->frameSegment = NULL;
+	vm->frame = NULL;
 }
 
 void initNativeFunctions()
 {
 	// init native functions
-	defineNativeFunction("clock", clockNative);
+	defineNativeFunction("clock", clockNative, 0);
+	defineNumberNative1("sqrt", sqrt);
+	defineNumberNative1("abs", fabs);
+	defineNumberNative1("floor", floor);
+	defineNumberNative2("min", fmin);
+	defineNumberNative2("max", fmax);
+	defineNumberNative2("pow", pow);
+	defineStringNative1("len", lengthNative);
 }
 
 void initVM(VM* vm)
 {
 	vm->exitCode = -1; // interrupted
+	vm->engine = ENGINE_STACK;
+	vm->framesMax = FRAMES_MAX;
 	vm->objects = NULL;
 	vm->bytesAllocated = 0;
 	vm->nextGC = 1024 * 1024;
@@ -69,10 +166,13 @@ void initVM(VM* vm)
 	vm->grayCount = 0;
 	vm->grayCapacity = 0;
 	vm->grayStack = NULL;
+	vm->cacheEpoch = 0;
 
-	initValueArray(&vm->stack);
+	vm->hashSeed = randomSeed(); // before anything is hashed
 	initTable(&vm->strings);
-	initTable(&vm->globals);
+	initTable(&vm->globalSlots);
+	initValueArray(&vm->globalValues);
+	initValueArray(&vm->globalNames);
 
 	// constant strings
 	vm->initString = NULL; // zero-memory in case copyString runs GC
@@ -82,51 +182,127 @@ void initVM(VM* vm)
 /// <summary>
 /// Log error and reset state.
 /// </summary>
-static void runtimeError(const char* format, ...)
+static void reportRuntimeError(VM* vm, const char* format, va_list args)
 {
 	// log message
-	va_list args;
-	va_start(args, format);
 	vfprintf(stderr, format, args);
-	va_end(args);
 	fputs("\n", stderr);
 
 	// stack trace
-	for (int32_t i = vm.frameCount - 1; i >= 0; --i)
+	FrameSegment* segment = vm->frameSegment;
+	CallFrame* frame = vm->frame;
+	uint32_t skipped = vm->frameCount > 2 * STACK_TRACE_FRAMES
+		? vm->frameCount - 2 * STACK_TRACE_FRAMES : 0;
+	for (uint32_t i = vm->frameCount; i > 0; --i)
 	{
-		CallFrame* frame = currentCallFrame();
-		ObjectFunction* function = frame->closure->function;
-		size_t instruction = frame->ip - function->chunk.code - 1; // prev instruction is culprit
-		uint32_t line = function->chunk.lines[instruction];
-		fprintf(stderr, "[line %d] in script\n", line);
-		if (function->name == NULL)
-			fprintf(stderr, "script\n");
+		if (skipped != 0 && i <= vm->frameCount - STACK_TRACE_FRAMES && i > STACK_TRACE_FRAMES)
+		{
+			// the middle of a deep stack, e.g. "Stack overflow."
+			if (i == vm->frameCount - STACK_TRACE_FRAMES)
+				fprintf(stderr, "... %u more frames\n", skipped);
+		}
 		else
-			fprintf(stderr, "%s()\n", function->name->chars);
+		{
+			ObjectFunction* function = frame->closure->function;
+			uint32_t line;
+			if (vm->engine == ENGINE_REGISTER)
+				line = function->registerChunk.lines[frame->pc - function->registerChunk.code - 1];
+			else // prev instruction is culprit
+				line = function->chunk.lines[frame->ip - function->chunk.code - 1];
+			fprintf(stderr, "[line %d] in script\n", line);
+			if (function->name == NULL)
+				fprintf(stderr, "script\n");
+			else
+				fprintf(stderr, "%s()\n", function->name->chars);
+		}
+
+		// step out to the caller, which may end the segment below
+		if (frame != segment->frames)
+			--frame;
+		else if (segment->previous != NULL)
+		{
+			segment = segment->previous;
+			frame = segment->frames + segment->capacity - 1;
+		}
 	}
 
 	// reset state
-	resetStack();
+	resetStack(vm);
+}
+
+static void runtimeError(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	reportRuntimeError(&vm, format, args);
+	va_end(args);
+}
+
+bool nativeError(VM* vm, const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	reportRuntimeError(vm, format, args);
+	va_end(args);
+	return false;
 }
 
-static void defineNativeFunction(const char* name, NativeFn function)
+static ObjectNative* defineNativeFunction(const char* name, NativeFn function, uint8_t arity)
 {
 	// push and pop to account for GC occurring due to allocations
 	push(OBJECT_VAL(copyString(name, (uint32_t)strlen(name))));
-	push(OBJECT_VAL(newNativeFunction(function)));
-	tableSet(&vm.globals, AS_STRING(vm.stack.values[0]), vm.stack.values[1]);
+	push(OBJECT_VAL(newNativeFunction(function, arity)));
+	uint32_t slot = globalSlot(AS_STRING(vm.sp[-2]));
+	vm.globalValues.values[slot] = vm.sp[-1];
+	ObjectNative* native = AS_NATIVE(pop());
 	pop();
+	return native;
+}
+
+static void defineNumberNative1(const char* name, NativeNumber1 function)
+{
+	ObjectNative* native = defineNativeFunction(name, number1Shim, 1);
+	native->signature = NATIVE_NUMBER_1;
+	native->typed.number1 = function;
+}
+
+static void defineNumberNative2(const char* name, NativeNumber2 function)
+{
+	ObjectNative* native = defineNativeFunction(name, number2Shim, 2);
+	native->signature = NATIVE_NUMBER_2;
+	native->typed.number2 = function;
+}
+
+static void defineStringNative1(const char* name, NativeString1 function)
+{
+	ObjectNative* native = defineNativeFunction(name, string1Shim, 1);
+	native->signature = NATIVE_STRING_1;
+	native->typed.string1 = function;
+}
+
+uint32_t globalSlot(ObjectString* name)
+{
+	Value slot;
+	if (tableGet(&vm.globalSlots, name, &slot))
+		return (uint32_t)AS_INT(slot);
+
+	uint32_t index = vm.globalValues.count;
+	push(OBJECT_VAL(name)); // store where gc can reach it
+	writeValueArray(&vm.globalNames, OBJECT_VAL(name));
+	writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+	tableSet(&vm.globalSlots, name, INT_VAL(index));
 	pop();
+	return index;
 }
 
 void push(Value value)
 {
-	writeValueArray(&vm.stack, value);
+	*vm.sp++ = value;
 }
 
 Value pop()
 {
-	return vm.stack.values[--vm.stack.count];
+	return *--vm.sp;
 }
 
 /// <summary>
@@ -134,17 +310,58 @@ Value pop()
 /// </summary>
 inline Value* stackTop()
 {
-	return &vm.stack.values[vm.stack.count];
+	return vm.sp;
 }
 
 inline CallFrame* currentCallFrame()
 {
-	return &vm.callStack[vm.frameCount - 1];
+	return vm.frame;
+}
+
+/// <summary>
+/// Make room for one more frame, moving on to the next segment once this one is full.
+/// The caller checks vm.framesMax.
+/// </summary>
+static inline CallFrame* pushCallFrame()
+{
+	if (vm.frameCount++ == 0)
+	{
+		vm.frameSegment = vm.callStack;
+		return vm.frame = vm.callStack->frames;
+	}
+
+	FrameSegment* segment = vm.frameSegment;
+	if (++vm.frame == segment->frames + segment->capacity)
+	{
+		if (segment->next == NULL)
+			segment->next = newFrameSegment(segment, segment->capacity * 2);
+		vm.frameSegment = segment = segment->next;
+		vm.frame = segment->frames;
+	}
+	return vm.frame;
+}
+
+/// <summary>
+/// Drop the innermost frame.
+/// </summary>
+/// <returns>The caller's frame, NULL if that was the last one.</returns>
+static inline CallFrame* popCallFrame()
+{
+	if (--vm.frameCount == 0)
+		return NULL;
+
+	FrameSegment* segment = vm.frameSegment;
+	if (vm.frame == segment->frames)
+	{
+		vm.frameSegment = segment = segment->previous;
+		return vm.frame = segment->frames + segment->capacity - 1;
+	}
+	return --vm.frame;
 }
 
 inline Value peek(uint32_t distance)
 {
-	return vm.stack.values[vm.stack.count - 1 - distance];
+	return *(vm.sp - 1 - distance);
 }
 
 /// <returns>False if a runtime error ocurred.</returns>
@@ -159,24 +376,48 @@ static bool call(ObjectClosure* closure, uint8_t argCount)
 		return false;
 	}
 
-	// guard against stack overflow
-	if (vm.frameCount == FRAMES_MAX)
+	// slots are function name and parameters
+	Value* slots = stackTop() - argCount - 1;
+
+	// guard against stack overflow. the value stack is checked once here for
+	// the function's deepest point, so pushes inside run() are unchecked.
+	if (vm.frameCount == vm.framesMax
+		|| slots + function->maxStack > vm.stackLimit)
 	{
 		runtimeError("Stack overflow.");
 		return false;
 	}
 
+#ifdef JIT_X64
+	// hot functions get machine code, which run() switches to when it enters them
+	if (++function->callCount == JIT_THRESHOLD && vm.engine == ENGINE_STACK)
+		compileJit(function);
+#endif
+
 	// setup call frame
-	CallFrame* frame = &vm.callStack[vm.frameCount++];
+	CallFrame* frame = pushCallFrame();
 	frame->closure = closure;
 	frame->ip = function->chunk.code;
-	// slots are function name and parameters
-	uint32_t stackSize = vm.stack.count - argCount - 1;
-	frame->slots = &vm.stack.values[stackSize];
-	frame->stackOffset = stackSize; // 
+	frame->slots = slots;
 	return true;
 }
 
+/// <summary>
+/// Runs a native with the 'argCount' values at 'args', leaving its result in args[-1].
+/// No frame is pushed and the caller pops the arguments.
+/// </summary>
+/// <returns>False if a runtime error ocurred.</returns>
+static inline bool callNative(ObjectNative* native, uint8_t argCount, Value* args)
+{
+	if (argCount != native->arity)
+	{
+		runtimeError("Expected %d arguments but got %d.",
+			native->arity, argCount);
+		return false;
+	}
+	return native->function(&vm, args, args - 1);
+}
+
 bool callValue(Value callee, uint8_t argCount)
 {
 	if (IS_OBJECT(callee))
@@ -195,10 +436,9 @@ bool callValue(Value callee, uint8_t argCount)
 				stackTop()[-argCount - 1] = OBJECT_VAL(newInstance(_class));
 
 				// initializer
-				Value initializer;
-				if (tableGet(&_class->methods, vm.initString, &initializer))
+				if (_class->initializer != NULL)
 				{
-					return call(AS_CLOSURE(initializer), argCount);
+					return call(_class->initializer, argCount);
 				}
 				else if (argCount != 0) // disallow passing args to a class with no initializer
 				{
@@ -211,14 +451,10 @@ bool callValue(Value callee, uint8_t argCount)
 			}
 			case OBJECT_CLOSURE: return call(AS_CLOSURE(callee), argCount);
 			case OBJECT_NATIVE:
-			{
-				NativeFn native = AS_NATIVE(callee);
-				Value* argv = &vm.stack.values[vm.stack.count - argCount];
-				Value result = native(argCount, argv);
-				vm.stack.count -= argCount + 1; // deallocate args off stack
-				push(result); // return value
+				if (!callNative(AS_NATIVE(callee), argCount, stackTop() - argCount))
+					return false;
+				vm.sp -= argCount; // deallocate args, the result took the callee's slot
 				return true;
-			}
 			default: break; // error
 		}
 	}
@@ -226,21 +462,47 @@ bool callValue(Value callee, uint8_t argCount)
 	return false;
 }
 
-static bool invokeFromClass(ObjectClass* klass, ObjectString* name, uint8_t argCount)
+/// <summary>
+/// Entry of 'cache' for receivers of shape 'shape', NULL on a miss.
+/// </summary>
+static inline InlineCacheEntry* findInlineCacheEntry(InlineCache* cache, ObjectShape* shape)
 {
-	Value method;
+	// methods were defined since this site last looked
+	if (cache->epoch != vm.cacheEpoch)
+	{
+		cache->epoch = vm.cacheEpoch;
+		cache->count = 0;
+		return NULL;
+	}
 
-	if (!tableGet(&klass->methods, name, &method))
+	for (uint32_t i = 0; i < cache->count; ++i)
 	{
-		runtimeError("Undefined property '%s'.", name->chars);
-		return false;
+		if (cache->entries[i].shape == shape)
+			return &cache->entries[i];
 	}
+	return NULL;
+}
 
-	// items are already on the stack where they belong
-	return call(AS_CLOSURE(method), argCount);
+/// <summary>
+/// Remember a lookup result, replacing the shape's previous entry if there is one.
+/// </summary>
+static void updateInlineCache(InlineCache* cache, ObjectShape* shape,
+	ObjectClosure* method, ObjectShape* transition, uint32_t index)
+{
+	InlineCacheEntry* entry = findInlineCacheEntry(cache, shape);
+	if (entry == NULL)
+	{
+		if (cache->count == INLINE_CACHE_SIZE)
+			return; // megamorphic, leave it to the tables
+		entry = &cache->entries[cache->count++];
+		entry->shape = shape;
+	}
+	entry->method = method;
+	entry->transition = transition;
+	entry->index = index;
 }
 
-static bool invoke(ObjectString* name, uint8_t argCount)
+static bool invoke(ObjectString* name, uint8_t argCount, InlineCache* cache)
 {
 	Value receiver = peek(argCount); // instance is item preceding args
 
@@ -254,439 +516,889 @@ static bool invoke(ObjectString* name, uint8_t argCount)
 	ObjectInstance* instance = AS_INSTANCE(receiver);
 
 	// handle function stored in a field being called correctly
-	Value value;
-	if (tableGet(&instance->fields, name, &value))
+	uint32_t slot;
+	if (shapeFindField(instance->shape, name, &slot))
 	{
+		Value value = instance->fields[slot];
 		stackTop()[-argCount - 1] = value; // replace instance with callee on stack
 		return callValue(value, argCount);
 	}
 
 	// invoke method
-	return invokeFromClass(instance->_class, name, argCount);
+	ObjectClass* klass = instance->_class;
+	Value method;
+	if (!tableGet(&klass->methods, name, &method))
+	{
+		runtimeError("Undefined property '%s'.", name->chars);
+		return false;
+	}
+
+	// instances of this shape have no field hiding the method
+	updateInlineCache(cache, instance->shape, AS_CLOSURE(method), NULL, 0);
+	return call(AS_CLOSURE(method), argCount);
+}
+
+/// <summary>
+/// 'method' bound to 'instance'. Reading the same method again, e.g. to pass it as a
+/// callback in a loop, gets the same bound method instead of a new allocation.
+/// </summary>
+static ObjectBoundMethod* bindInstanceMethod(ObjectInstance* instance, ObjectClosure* method)
+{
+	ObjectBoundMethod* boundMethod = instance->boundMethod;
+	if (boundMethod == NULL || boundMethod->method != method)
+		instance->boundMethod = boundMethod = newBoundMethod(OBJECT_VAL(instance), method);
+	return boundMethod;
 }
 
 /// <summary>
-/// Binds a method to an Instance and replaces it on the stack.
+/// Method 'name' of 'superclass' for a 'super' expression, NULL after reporting an error.
+/// A 'super' site only ever sees the one superclass of its enclosing class, so it is
+/// cached under the superclass's root shape and the table is searched once per site.
 /// </summary>
-static bool bindMethod(ObjectClass* klass, ObjectString* name)
+static ObjectClosure* findSuperMethod(ObjectClass* superclass, ObjectString* name,
+	InlineCache* cache)
 {
+	InlineCacheEntry* entry = findInlineCacheEntry(cache, superclass->rootShape);
+	if (entry != NULL)
+		return entry->method;
+
 	Value method;
-	if (!tableGet(&klass->methods, name, &method))
+	if (!tableGet(&superclass->methods, name, &method))
 	{
 		runtimeError("Undefined property '%s'.", name->chars);
-		return false;
+		return NULL;
 	}
 
-	// bind the method
-	ObjectBoundMethod* boundMethod = newBoundMethod(
-		peek(0), AS_CLOSURE(method));
-	pop(); // owning class
-	push(OBJECT_VAL(boundMethod));
-	return true;
+	updateInlineCache(cache, superclass->rootShape, AS_CLOSURE(method), NULL, 0);
+	return AS_CLOSURE(method);
 }
 
 static ObjectUpvalue* captureUpvalue(Value* local)
 {
-	ObjectUpvalue* prevUpvalue = NULL;
-	// start at upvalue closest to stack
-	ObjectUpvalue* upvalue = vm.openUpvalues; // return value
-
-	// sorted linked-list traversal
-	while (upvalue != NULL && upvalue->location > local)
-	{
-		prevUpvalue = upvalue;
-		upvalue = upvalue->next;
-	}
+	// re-use the variable if another closure already captured it
+	ObjectUpvalue** slot = &vm.openUpvalueSlots[local - vm.stack];
+	if (*slot != NULL)
+		return *slot;
 
-	// did we find it or should we make a new one?
-	if (upvalue != NULL && upvalue->location == local)
-		return upvalue; // re-use existing variable
-	
 	// create a new one
 	ObjectUpvalue* createdUpvalue = newUpvalue(local);
-	createdUpvalue->next = upvalue;
+	*slot = createdUpvalue;
 
-	// add to linked-list
-	if (prevUpvalue == NULL) // no head (first)
-		vm.openUpvalues = createdUpvalue; // head
-	else
-		prevUpvalue->next = createdUpvalue; // tail
+	// add to head of linked-list
+	createdUpvalue->next = vm.openUpvalues;
+	if (vm.openUpvalues != NULL)
+		vm.openUpvalues->previous = createdUpvalue;
+	vm.openUpvalues = createdUpvalue;
 
 	return createdUpvalue;
 }
 
+static inline void closeUpvalue(ObjectUpvalue* upvalue)
+{
+	vm.openUpvalueSlots[upvalue->location - vm.stack] = NULL;
+	upvalue->closed = *upvalue->location; // move the value to heap
+	upvalue->location = &upvalue->closed; // point to location on heap
+}
+
+/// <summary>
+/// Close every upvalue at or above 'last', which is the base of the running frame.
+/// </summary>
 static void closeUpvalues(Value* last)
 {
-	while (vm.openUpvalues != NULL
-		&& vm. openUpvalues->location >= last)
+	// the running frame's upvalues are the newest, the callers' are all below 'last'
+	ObjectUpvalue* upvalue = vm.openUpvalues;
+	while (upvalue != NULL && upvalue->location >= last)
 	{
-		ObjectUpvalue* upvalue = vm.openUpvalues;
-		upvalue->closed = *upvalue->location; // move the value to heap
-		upvalue->location = &upvalue->closed; // point to location on heap
-		vm.openUpvalues = upvalue->next;
+		closeUpvalue(upvalue);
+		upvalue = upvalue->next;
 	}
+
+	vm.openUpvalues = upvalue;
+	if (upvalue != NULL)
+		upvalue->previous = NULL;
 }
 
-static void defineMethod(ObjectString* name)
+/// <summary>
+/// Close the upvalue of one slot leaving scope, if anything captured it.
+/// </summary>
+static void closeUpvalueSlot(Value* local)
+{
+	ObjectUpvalue* upvalue = vm.openUpvalueSlots[local - vm.stack];
+	if (upvalue == NULL)
+		return;
+
+	// unlink wherever it is, captures in a block are not in slot order
+	if (upvalue->previous != NULL)
+		upvalue->previous->next = upvalue->next;
+	else
+		vm.openUpvalues = upvalue->next;
+	if (upvalue->next != NULL)
+		upvalue->next->previous = upvalue->previous;
+
+	closeUpvalue(upvalue);
+}
+
+/// <summary>
+/// Add or overwrite a field, remembering its slot and any shape transition.
+/// </summary>
+static void storeField(ObjectInstance* instance, ObjectString* name, Value value,
+	InlineCache* cache)
+{
+	ObjectShape* shape = instance->shape;
+	uint32_t slot = setField(instance, name, value);
+	updateInlineCache(cache, shape, NULL,
+		instance->shape != shape ? instance->shape : NULL, slot);
+}
+
+static void addMethod(ObjectClass* klass, ObjectString* name, Value method)
 {
-	Value method = peek(0);
-	ObjectClass* klass = AS_CLASS(peek(1));
 	tableSet(&klass->methods, name, method);
+	if (name == vm.initString)
+		klass->initializer = AS_CLOSURE(method);
+	++vm.cacheEpoch; // anything cached may be stale now
+}
+
+static void defineMethod(ObjectString* name)
+{
+	addMethod(AS_CLASS(peek(1)), name, peek(0));
 	pop(); // pop method, leave class
 }
 
+/// <summary>
+/// Copy-down inheritance: the subclass starts out with everything the superclass has.
+/// </summary>
+static void inherit(ObjectClass* superclass, ObjectClass* subclass)
+{
+	copyTable(&superclass->methods, &subclass->methods);
+	subclass->initializer = superclass->initializer;
+	subclass->fieldHint = superclass->fieldHint;
+	++vm.cacheEpoch; // defines methods too
+}
+
 static bool isFalsey(Value value)
 {
 	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 /// <summary>
-/// Concatenates two strings together.
+/// Product of two small integers. A zero product with a negative factor is -0,
+/// which only a double can hold.
+/// </summary>
+static inline Value multiplyInts(int32_t a, int32_t b)
+{
+	int64_t product = (int64_t)a * b;
+	if (product == 0 && (a | b) < 0)
+		return NUMBER_VAL(-0.0);
+	return INT64_VAL(product);
+}
+
+/// <summary>
+/// A small integer whose negation is one too. -0 and -INT32_MIN are doubles.
 /// </summary>
-static void concatenate()
+static inline bool isNegatableInt(Value value)
 {
-	ObjectString* b = AS_STRING(peek(0)); // keep on stack for gc
-	ObjectString* a = AS_STRING(peek(1));
+	return IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT32_MIN;
+}
 
-	uint32_t length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1); // \0
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0'; // null-terminated
+/// <summary>
+/// Concatenates two strings together.
+/// Both must stay reachable by the GC until it returns.
+/// </summary>
+ObjectString* concatenate(ObjectString* a, ObjectString* b)
+{
+	if (a->length == 0) return b;
+	if (b->length == 0) return a;
+
+	// long results only link the two, so appending in a loop doesn't copy everything
+	// built so far each time. short ones are shorter than any rope, so both are interned.
+	if (a->length + b->length >= ROPE_MIN_LENGTH)
+		return newRope(a, b);
+	return copyConcatenation(a, b);
+}
 
-	ObjectString* result = takeString(chars, length);
-	pop(); pop();
-	push(OBJECT_VAL(result));
+/// <summary>
+/// Turn the script's return value into the exit code.
+/// </summary>
+static InterpretResult exitScript(Value result)
+{
+	if (IS_BOOL(result))
+	{
+		// 'true' indicates 'success' and 'false' indicates 'failure'.
+		vm.exitCode = AS_BOOL(result) ? 0 : -1;
+	}
+	else if (IS_NUMBER(result))
+	{
+		// assumes cast will work
+		vm.exitCode = (uint64_t)AS_NUMBER(result);
+	}
+	else if (IS_NIL(result))
+	{
+		// normal exit (possibly an early-exit)
+		vm.exitCode = 0;
+	}
+	// TODO - return a string through stdout?
+	else
+	{
+		runtimeError("Can only return number, nil, or bool.");
+		return INTERPRET_RUNTIME_ERROR;
+	}
+	return INTERPRET_OK; // exit
 }
 
 static InterpretResult run()
 {
+	// interpreter registers. these are only written back to the current
+	// CallFrame and 'vm.stack' when something outside of run() needs them.
 	CallFrame* frame = currentCallFrame();
+	register uint8_t* ip = frame->ip; // instruction pointer
+	register Value* slots = frame->slots; // frame pointer
+	register Value* sp = stackTop(); // stack pointer
+	OpCode operation = OP_CALL; // instruction being executed, we got here by a call
 
-#define READ_BYTE() (*(frame->ip++))
+#define READ_BYTE() (*(ip++))
 #define READ_16() \
-	(frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+	(ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
 #define READ_24() \
-	(frame->ip += 3, (uint32_t)((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+	(ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 #define READ_32() \
-	(frame->ip += 4, (uint32_t)((frame->ip[-4] << 24) | (frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+	(ip += 4, (uint32_t)((ip[-4] << 24) | (ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[READ_24()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
-#define BINARY_OP(valueType, op) do \
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_16()])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define DROP() (--sp) // POP() without reading the value
+#define PEEK(distance) (sp[-1 - (distance)])
+
+// write registers back before calls, allocations (GC safepoints) and errors
+#define SAVE_STATE() do \
+{ \
+	frame->ip = ip; \
+	vm.sp = sp; \
+} while (false)
+
+// reload registers after anything that may have changed frames or the stack
+#define LOAD_STATE() do \
+{ \
+	frame = currentCallFrame(); \
+	ip = frame->ip; \
+	slots = frame->slots; \
+	sp = stackTop(); \
+} while (false)
+
+#define RUNTIME_ERROR(...) do \
+{ \
+	SAVE_STATE(); \
+	runtimeError(__VA_ARGS__); \
+	return INTERPRET_RUNTIME_ERROR; \
+} while (false)
+
+// two doubles take the same path they always did. two small integers go through the
+// integer ALU in 64 bits, where sums and differences can't overflow, and 'intType'
+// boxes the result. a double and an integer meet as doubles.
+#define BINARY_OP(valueType, intType, op) do \
+{ \
+	Value b = POP(); \
+	Value a = sp[-1]; \
+	if (IS_DOUBLE(a) && IS_DOUBLE(b)) \
+		sp[-1] = valueType(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+	else if (IS_INT_PAIR(a, b)) \
+		sp[-1] = intType((int64_t)AS_INT(a) op AS_INT(b)); \
+	else if (IS_NUMBER(a) && IS_NUMBER(b)) \
+		sp[-1] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+	else if (!IS_NUMBER(b)) \
+		RUNTIME_ERROR("Right-hand operand must be a number."); \
+	else \
+		RUNTIME_ERROR("Left-hand operand must be a number."); \
+} while (false) \
+
+// compare and branch in one, pops both operands
+#define BRANCH_UNLESS(op) do \
 { \
-	if (!IS_NUMBER(peek(0))) \
+	uint16_t offset = READ_16(); \
+	Value b = POP(); \
+	Value a = POP(); \
+	bool isTrue; \
+	if (IS_DOUBLE(a) && IS_DOUBLE(b)) \
+		isTrue = AS_DOUBLE(a) op AS_DOUBLE(b); \
+	else if (IS_INT_PAIR(a, b)) \
+		isTrue = AS_INT(a) op AS_INT(b); \
+	else if (IS_NUMBER(a) && IS_NUMBER(b)) \
+		isTrue = AS_NUMBER(a) op AS_NUMBER(b); \
+	else if (!IS_NUMBER(b)) \
+		RUNTIME_ERROR("Right-hand operand must be a number."); \
+	else \
+		RUNTIME_ERROR("Left-hand operand must be a number."); \
+	if (!isTrue) \
+		ip += offset; \
+} while (false)
+
+#ifdef JIT_X64
+// continue in machine code if the current function has some. it stops at the first
+// instruction it can't run and leaves that for the interpreter.
+#define ENTER_JIT() do \
+{ \
+	if (frame->closure->function->jit != NULL) \
 	{ \
-		runtimeError("Right-hand operand must be a number."); \
-		return INTERPRET_RUNTIME_ERROR; \
+		ip = runJit(frame, ip, sp); \
+		sp = vm.sp; \
 	} \
-	else if (!IS_NUMBER(peek(1))) \
+} while (false)
+
+// on a backward jump: run the loop's trace if it has one, record it if it has got hot.
+#define ENTER_TRACE() do \
+{ \
+	ip = runTrace(frame, ip, sp); \
+	sp = vm.sp; \
+} while (false)
+#else
+#define ENTER_JIT() do { } while (false)
+#define ENTER_TRACE() do { } while (false)
+#endif
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() do \
+{ \
+	printf("        "); \
+	for (Value* slot = vm.stack; slot < sp; ++slot) \
 	{ \
-		runtimeError("Left-hand operand must be a number."); \
-		return INTERPRET_RUNTIME_ERROR; \
+		printf("[ "); \
+		printValue(*slot); \
+		printf(" ]"); \
 	} \
-	double b = AS_NUMBER(pop()); \
-	double a = AS_NUMBER(pop()); \
-	push(valueType(a op b)); \
-} while (false) \
+	disassembleInstruction(&(frame->closure->function->chunk), \
+		(uint32_t)(ip - frame->closure->function->chunk.code)); \
+} while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
 
-	// work
-	while (1)
+#ifdef DEBUG_PROFILE_OPCODES
+// 'operation' has just run and 'ip' points at its successor
+#define PROFILE_OPCODE() (++dispatchCount, ++opcodePairCounts[operation][*ip])
+#else
+#define PROFILE_OPCODE() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+	// direct threaded code: every handler jumps straight to the next one
+	// through this table instead of going back through the switch.
+	static void* dispatchTable[UINT8_COUNT] =
 	{
-#ifdef DEBUG_TRACE_EXECUTION
-		printf("        ");
+		[0 ... UINT8_MAX] = &&unknownOpcode, // fill gaps first
+		[OP_CONSTANT] = &&OP_CONSTANT_HANDLER,
+		[OP_CONSTANT_LONG] = &&OP_CONSTANT_LONG_HANDLER,
+		[OP_CONSTANT_ZERO] = &&OP_CONSTANT_ZERO_HANDLER,
+		[OP_ZERO] = &&OP_ZERO_HANDLER,
+		[OP_ONE] = &&OP_ONE_HANDLER,
+		[OP_NEG_ONE] = &&OP_NEG_ONE_HANDLER,
+		[OP_NIL] = &&OP_NIL_HANDLER,
+		[OP_TRUE] = &&OP_TRUE_HANDLER,
+		[OP_FALSE] = &&OP_FALSE_HANDLER,
+		[OP_POP] = &&OP_POP_HANDLER,
+		[OP_POPN] = &&OP_POPN_HANDLER,
+		[OP_GET_LOCAL] = &&OP_GET_LOCAL_HANDLER,
+		[OP_SET_LOCAL] = &&OP_SET_LOCAL_HANDLER,
+		[OP_DEFINE_GLOBAL] = &&OP_DEFINE_GLOBAL_HANDLER,
+		[OP_DEFINE_GLOBAL_LONG] = &&OP_DEFINE_GLOBAL_LONG_HANDLER,
+		[OP_GET_GLOBAL] = &&OP_GET_GLOBAL_HANDLER,
+		[OP_GET_GLOBAL_LONG] = &&OP_GET_GLOBAL_LONG_HANDLER,
+		[OP_SET_GLOBAL] = &&OP_SET_GLOBAL_HANDLER,
+		[OP_SET_GLOBAL_LONG] = &&OP_SET_GLOBAL_LONG_HANDLER,
+		[OP_GET_SUPER] = &&OP_GET_SUPER_HANDLER,
+		[OP_GET_UPVALUE] = &&OP_GET_UPVALUE_HANDLER,
+		[OP_SET_UPVALUE] = &&OP_SET_UPVALUE_HANDLER,
+		[OP_GET_PROPERTY] = &&OP_GET_PROPERTY_HANDLER,
+		[OP_GET_PROPERTY_LONG] = &&OP_GET_PROPERTY_LONG_HANDLER,
+		[OP_SET_PROPERTY] = &&OP_SET_PROPERTY_HANDLER,
+		[OP_SET_PROPERTY_LONG] = &&OP_SET_PROPERTY_LONG_HANDLER,
+		[OP_EQUAL] = &&OP_EQUAL_HANDLER,
+		[OP_GREATER] = &&OP_GREATER_HANDLER,
+		[OP_LESS] = &&OP_LESS_HANDLER,
+		[OP_ADD] = &&OP_ADD_HANDLER,
+		[OP_SUBTRACT] = &&OP_SUBTRACT_HANDLER,
+		[OP_MULTIPLY] = &&OP_MULTIPLY_HANDLER,
+		[OP_DIVIDE] = &&OP_DIVIDE_HANDLER,
+		[OP_NOT] = &&OP_NOT_HANDLER,
+		[OP_NEGATE] = &&OP_NEGATE_HANDLER,
+		[OP_JUMP_IF_FALSE] = &&OP_JUMP_IF_FALSE_HANDLER,
+		[OP_JUMP] = &&OP_JUMP_HANDLER,
+		[OP_LOOP] = &&OP_LOOP_HANDLER,
+		[OP_CALL] = &&OP_CALL_HANDLER,
+		[OP_TAIL_CALL] = &&OP_TAIL_CALL_HANDLER,
+		[OP_INVOKE] = &&OP_INVOKE_HANDLER,
+		[OP_SUPER_INVOKE] = &&OP_SUPER_INVOKE_HANDLER,
+		[OP_CLOSURE] = &&OP_CLOSURE_HANDLER,
+		[OP_CLOSURE_LONG] = &&OP_CLOSURE_LONG_HANDLER,
+		[OP_CLOSE_UPVALUE] = &&OP_CLOSE_UPVALUE_HANDLER,
+		[OP_PRINT] = &&OP_PRINT_HANDLER,
+		[OP_RETURN] = &&OP_RETURN_HANDLER,
+		[OP_CLASS] = &&OP_CLASS_HANDLER,
+		[OP_INHERIT] = &&OP_INHERIT_HANDLER,
+		[OP_METHOD] = &&OP_METHOD_HANDLER,
+		[OP_METHOD_LONG] = &&OP_METHOD_LONG_HANDLER,
+		[OP_GET_LOCAL_LOCAL] = &&OP_GET_LOCAL_LOCAL_HANDLER,
+		[OP_GET_LOCAL_CONSTANT] = &&OP_GET_LOCAL_CONSTANT_HANDLER,
+		[OP_SET_LOCAL_POP] = &&OP_SET_LOCAL_POP_HANDLER,
+		[OP_POP_JUMP_IF_FALSE] = &&OP_POP_JUMP_IF_FALSE_HANDLER,
+		[OP_JUMP_IF_NOT_LESS] = &&OP_JUMP_IF_NOT_LESS_HANDLER,
+		[OP_JUMP_IF_NOT_GREATER] = &&OP_JUMP_IF_NOT_GREATER_HANDLER,
+		[OP_POP_LOOP] = &&OP_POP_LOOP_HANDLER,
+		[OP_ADD_NUM] = &&OP_ADD_NUM_HANDLER,
+		[OP_ADD_STR] = &&OP_ADD_STR_HANDLER,
+	};
+
+#define CASE(op) case op: op##_HANDLER:
+#define DISPATCH() do \
+{ \
+	PROFILE_OPCODE(); \
+	TRACE_EXECUTION(); \
+	goto *dispatchTable[operation = READ_BYTE()]; \
+} while (false)
+#else
+#define CASE(op) case op:
+#define DISPATCH() continue // back to the top of the loop
+#endif
 
-		//for (Value* slot = vm->stack.values; slot < vm->stack.count; slot++)
-		for (uint32_t i = 0; i < vm.stack.count; ++i)
-		{
-			Value value = vm.stack.values[i];
-			printf("[ ");
-			printValue(value);
-			printf(" ]");
-		}
+	ENTER_JIT();
 
-		disassembleInstruction(&(frame->closure->function->chunk),
-			(uint32_t)(frame->ip - frame->closure->function->chunk.code)); //offset
-#endif
+	// work
+	while (1)
+	{
+		PROFILE_OPCODE();
+		TRACE_EXECUTION();
 
 		// decode instruction
-		// consider �direct threaded code�, �jump table�, and �computed goto�.
-		OpCode operation = READ_BYTE();
+		operation = READ_BYTE();
 		switch (operation)
 		{
 			// constants
-			case OP_CONSTANT: push(READ_CONSTANT()); break;
-			case OP_CONSTANT_LONG: push(READ_CONSTANT_LONG()); break;// function works, macro doesn't
-			case OP_CONSTANT_ZERO:
-				push(frame->closure->function->chunk.constants.values[0]);
-				break;
+			CASE(OP_CONSTANT) PUSH(READ_CONSTANT()); DISPATCH();
+			CASE(OP_CONSTANT_LONG) PUSH(READ_CONSTANT_LONG()); DISPATCH();// function works, macro doesn't
+			CASE(OP_CONSTANT_ZERO)
+				PUSH(frame->closure->function->chunk.constants.values[0]);
+				DISPATCH();
 
 			// literals
-			case OP_ZERO: push(NUMBER_VAL(0)); break;
-			case OP_ONE: push(NUMBER_VAL(1)); break;
-			case OP_NEG_ONE: push(NUMBER_VAL(-1)); break;
-			case OP_NIL: push(NIL_VAL); break;
-			case OP_TRUE: push(BOOL_VAL(true)); break;
-			case OP_FALSE: push(BOOL_VAL(false)); break;
-			case OP_POP: pop(); break; // discard 
-			case OP_POPN: vm.stack.count -= READ_BYTE(); break;
+			CASE(OP_ZERO) PUSH(INT_VAL(0)); DISPATCH();
+			CASE(OP_ONE) PUSH(INT_VAL(1)); DISPATCH();
+			CASE(OP_NEG_ONE) PUSH(INT_VAL(-1)); DISPATCH();
+			CASE(OP_NIL) PUSH(NIL_VAL); DISPATCH();
+			CASE(OP_TRUE) PUSH(BOOL_VAL(true)); DISPATCH();
+			CASE(OP_FALSE) PUSH(BOOL_VAL(false)); DISPATCH();
+			CASE(OP_POP) DROP(); DISPATCH(); // discard 
+			CASE(OP_POPN) sp -= READ_BYTE(); DISPATCH();
 
 			// variable accessors
-			case OP_GET_LOCAL:
+			CASE(OP_GET_LOCAL)
 			{
 				uint8_t slot = READ_BYTE();
-				push(frame->slots[slot]);
-				break;
+				PUSH(slots[slot]);
+				DISPATCH();
 			}
-			case OP_SET_LOCAL:
+			CASE(OP_SET_LOCAL)
 			{
 				// leave val on stack to support 'a = b = c = 10;'
 				uint8_t slot = READ_BYTE();
-				frame->slots[slot] = peek(0);
-				break;
+				slots[slot] = PEEK(0);
+				DISPATCH();
 			}
-			case OP_DEFINE_GLOBAL: // consider LONG constants
+			CASE(OP_DEFINE_GLOBAL)
+			CASE(OP_DEFINE_GLOBAL_LONG)
 			{
-				ObjectString* name = READ_STRING();
-				tableSet(&vm.globals, name, peek(0)); // can easily redefine globals
-				pop(); // discard after to be considerate of GC
-				break;
+				uint32_t slot = operation == OP_DEFINE_GLOBAL_LONG ? READ_24() : READ_BYTE();
+				vm.globalValues.values[slot] = POP(); // can easily redefine globals
+				DISPATCH();
 			}
-			case OP_GET_GLOBAL:
+			CASE(OP_GET_GLOBAL)
+			CASE(OP_GET_GLOBAL_LONG)
 			{
-				ObjectString* name = READ_STRING();
-				Value value;
-				if (!tableGet(&vm.globals, name, &value))
-				{
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				push(value);
-				break;
+				uint32_t slot = operation == OP_GET_GLOBAL_LONG ? READ_24() : READ_BYTE();
+				Value value = vm.globalValues.values[slot];
+				if (IS_UNDEFINED(value))
+					RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+				PUSH(value);
+				DISPATCH();
 			}
-			case OP_SET_GLOBAL:
+			CASE(OP_SET_GLOBAL)
+			CASE(OP_SET_GLOBAL_LONG)
 			{
-				ObjectString* name = READ_STRING();
-
-				// undefined?
-				if (tableSet(&vm.globals, name, peek(0)))
-				{
-					tableDelete(&vm.globals, name); // undo mistake
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
-				}
-				break;
+				uint32_t slot = operation == OP_SET_GLOBAL_LONG ? READ_24() : READ_BYTE();
+				Value* global = &vm.globalValues.values[slot];
+
+				// assignment doesn't declare
+				if (IS_UNDEFINED(*global))
+					RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+				*global = PEEK(0);
+				DISPATCH();
 			}
-			case OP_GET_SUPER:
+			CASE(OP_GET_SUPER)
 			{
 				ObjectString* name = READ_STRING(); // member of super
-				ObjectClass* superclass = AS_CLASS(pop());
+				InlineCache* cache = READ_CACHE();
+				ObjectClass* superclass = AS_CLASS(POP());
+				SAVE_STATE();
 
 				// 'super' always resolves to a method, since fields are not inherited
-				if (!bindMethod(superclass, name))
+				ObjectClosure* method = findSuperMethod(superclass, name, cache);
+				if (method == NULL)
 					return INTERPRET_RUNTIME_ERROR;
 
-				break;
+				// replace the receiver with the bound method
+				sp[-1] = OBJECT_VAL(bindInstanceMethod(AS_INSTANCE(PEEK(0)), method));
+				DISPATCH();
 			}
-			case OP_GET_UPVALUE:
+			CASE(OP_GET_UPVALUE)
 			{
 				uint8_t slot = READ_BYTE();
-				push(*frame->closure->upvalues[slot]->location);
-				break;
+				PUSH(*frame->closure->upvalues[slot]->location);
+				DISPATCH();
 			}
-			case OP_SET_UPVALUE:
+			CASE(OP_SET_UPVALUE)
 			{
 				// don't pop because assignment is an expression
 				uint8_t slot = READ_BYTE();
-				*frame->closure->upvalues[slot]->location = peek(0);
-				break;
+				*frame->closure->upvalues[slot]->location = PEEK(0);
+				DISPATCH();
 			}
 
 			// properties
-			case OP_GET_PROPERTY:
-			case OP_GET_PROPERTY_LONG:
+			CASE(OP_GET_PROPERTY)
+			CASE(OP_GET_PROPERTY_LONG)
 			{
+				bool isLong = operation == OP_GET_PROPERTY_LONG;
+				ObjectString* name = isLong ? READ_STRING_LONG() : READ_STRING();
+				InlineCache* cache = READ_CACHE();
+
 				// guard against not accessing an instance
-				if (!IS_INSTANCE(peek(0)))
+				if (!IS_INSTANCE(PEEK(0)))
+					RUNTIME_ERROR("Only instances have properties.");
+
+				ObjectInstance* instance = AS_INSTANCE(PEEK(0)); // cast
+
+				// seen this shape here before?
+				InlineCacheEntry* entry = findInlineCacheEntry(cache, instance->shape);
+				if (entry != NULL)
 				{
-					runtimeError("Only instances have properties.");
-					return INTERPRET_RUNTIME_ERROR;
+					if (entry->method != NULL)
+					{
+						SAVE_STATE();
+						sp[-1] = OBJECT_VAL(bindInstanceMethod(instance, entry->method));
+					}
+					else
+					{
+						sp[-1] = instance->fields[entry->index]; // replace Instance
+					}
+					DISPATCH();
 				}
 
-				bool isLong = operation == OP_GET_PROPERTY_LONG;
-				ObjectInstance* instance = AS_INSTANCE(peek(0)); // cast
-				ObjectString* name = isLong ? READ_STRING_LONG() : READ_STRING();
-
 				// search fields
-				Value value;
-				if (tableGet(&instance->fields, name, &value))
+				uint32_t slot;
+				if (shapeFindField(instance->shape, name, &slot))
 				{
-					pop(); // Instance
-					push(value); //
-					break;
+					updateInlineCache(cache, instance->shape, NULL, NULL, slot);
+					sp[-1] = instance->fields[slot]; // replace Instance
+					DISPATCH();
 				}
 
 				// search methods
-				if (!bindMethod(instance->_class, name))
-					return INTERPRET_RUNTIME_ERROR;
-				break;
+				Value method;
+				if (!tableGet(&instance->_class->methods, name, &method))
+					RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+
+				updateInlineCache(cache, instance->shape, AS_CLOSURE(method), NULL, 0);
+				SAVE_STATE();
+				sp[-1] = OBJECT_VAL(bindInstanceMethod(instance, AS_CLOSURE(method)));
+				DISPATCH();
 			}
-			case OP_SET_PROPERTY:
-			case OP_SET_PROPERTY_LONG:
+			CASE(OP_SET_PROPERTY)
+			CASE(OP_SET_PROPERTY_LONG)
 			{
+				bool isLong = operation == OP_SET_PROPERTY_LONG;
+				ObjectString* name = isLong ? READ_STRING_LONG() : READ_STRING();
+				InlineCache* cache = READ_CACHE();
+
 				// guard against not accessing an instance
-				if (!IS_INSTANCE(peek(1)))
+				if (!IS_INSTANCE(PEEK(1)))
+					RUNTIME_ERROR("Only instances have fields.");
+
+				ObjectInstance* instance = AS_INSTANCE(PEEK(1));
+
+				// repeat what the last store from this shape did, if there is room for it
+				InlineCacheEntry* entry = findInlineCacheEntry(cache, instance->shape);
+				if (entry != NULL && entry->transition == NULL)
 				{
-					runtimeError("Only instances have fields.");
-					return INTERPRET_RUNTIME_ERROR;
+					instance->fields[entry->index] = PEEK(0);
+				}
+				else if (entry != NULL && entry->index < instance->fieldCapacity)
+				{
+					instance->fields[entry->index] = PEEK(0);
+					instance->shape = entry->transition;
+				}
+				else
+				{
+					SAVE_STATE();
+					storeField(instance, name, PEEK(0), cache);
 				}
 
-				bool isLong = operation == OP_SET_PROPERTY_LONG;
-				ObjectInstance* instance = AS_INSTANCE(peek(1));
-				ObjectString* name = isLong ? READ_STRING_LONG() : READ_STRING();
-				tableSet(&instance->fields, name, peek(0));
-				Value value = pop(); // pop the result of the get
-				pop(); // pop the instance
-				push(value); // push the assigned value back to allow chaining
-				break;
+				Value value = POP(); // pop the result of the get
+				sp[-1] = value; // replace the instance with the assigned value to allow chaining
+				DISPATCH();
 			}
 
 			// boolean
-			case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-			case OP_EQUAL:
+			CASE(OP_NOT) sp[-1] = BOOL_VAL(isFalsey(sp[-1])); DISPATCH();
+			CASE(OP_EQUAL)
 			{
-				Value b = pop();
-				Value a = pop();
-				push(BOOL_VAL(valuesEqual(a, b)));
-				break;
+				Value b = POP();
+				Value a = sp[-1];
+				sp[-1] = BOOL_VAL(valuesEqual(a, b));
+				DISPATCH();
 			}
-			case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-			case OP_LESS: BINARY_OP(BOOL_VAL, < ); break;
+			CASE(OP_GREATER) BINARY_OP(BOOL_VAL, BOOL_VAL, >); DISPATCH();
+			CASE(OP_LESS) BINARY_OP(BOOL_VAL, BOOL_VAL, < ); DISPATCH();
 
 			// arithmetic
-			case OP_ADD: // BINARY_OP(NUMBER_VAL, +); break;
+			CASE(OP_ADD) // BINARY_OP(NUMBER_VAL, +); DISPATCH();
 			{
-				if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+				// quicken: specialize this site for the types it sees
+				if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1)))
 				{
-					concatenate();
+					ip[-1] = OP_ADD_STR;
+					SAVE_STATE();
+					ObjectString* result = concatenate(AS_STRING(PEEK(1)), AS_STRING(PEEK(0)));
+					DROP();
+					sp[-1] = OBJECT_VAL(result);
 				}
-				else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+				else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
 				{
-					double b = AS_NUMBER(pop());
-					double a = AS_NUMBER(pop());
-					push(NUMBER_VAL(a + b));
+					// run again as OP_ADD_NUM
+					ip[-1] = OP_ADD_NUM;
+					--ip;
 				}
 				else
 				{
-					runtimeError("Operands must be two numbers or two strings.");
-					return INTERPRET_RUNTIME_ERROR;
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-			case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-			case OP_DIVIDE: // BINARY_OP(NUMBER_VAL, /); break;
+			CASE(OP_ADD_NUM)
 			{
-				if (!IS_NUMBER(peek(0)))
+				Value b = PEEK(0);
+				Value a = PEEK(1);
+				if (IS_DOUBLE(a) && IS_DOUBLE(b))
+					sp[-2] = NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b));
+				else if (IS_INT_PAIR(a, b))
+					sp[-2] = INT64_VAL((int64_t)AS_INT(a) + AS_INT(b));
+				else if (IS_NUMBER(a) && IS_NUMBER(b))
+					sp[-2] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+				else
 				{
-					runtimeError("Right-hand operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
+					// de-specialize and run again as OP_ADD
+					ip[-1] = OP_ADD;
+					--ip;
+					DISPATCH();
 				}
-				else if (!IS_NUMBER(peek(1)))
+				DROP();
+				DISPATCH();
+			}
+			CASE(OP_ADD_STR)
+			{
+				if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1)))
 				{
-					runtimeError("Left-hand operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
+					// de-specialize and run again as OP_ADD
+					ip[-1] = OP_ADD;
+					--ip;
+					DISPATCH();
 				}
-
-				double b = AS_NUMBER(pop());
-				if (b == 0) // div 0
+				SAVE_STATE();
+				ObjectString* result = concatenate(AS_STRING(PEEK(1)), AS_STRING(PEEK(0)));
+				DROP();
+				sp[-1] = OBJECT_VAL(result);
+				DISPATCH();
+			}
+			CASE(OP_SUBTRACT) BINARY_OP(NUMBER_VAL, INT64_VAL, -); DISPATCH();
+			CASE(OP_MULTIPLY)
+			{
+				if (IS_INT_PAIR(PEEK(0), PEEK(1)))
 				{
-					runtimeError("Divide by zero.");
-					return INTERPRET_RUNTIME_ERROR;
+					Value b = POP();
+					sp[-1] = multiplyInts(AS_INT(sp[-1]), AS_INT(b));
+					DISPATCH();
 				}
-				double a = AS_NUMBER(pop());
+				BINARY_OP(NUMBER_VAL, INT64_VAL, *);
+				DISPATCH();
+			}
+			CASE(OP_DIVIDE) // BINARY_OP(NUMBER_VAL, /); DISPATCH();
+			{
+				if (!IS_NUMBER(PEEK(0)))
+					RUNTIME_ERROR("Right-hand operand must be a number.");
+				else if (!IS_NUMBER(PEEK(1)))
+					RUNTIME_ERROR("Left-hand operand must be a number.");
+
+				double b = AS_NUMBER(PEEK(0));
+				if (b == 0) // div 0
+					RUNTIME_ERROR("Divide by zero.");
+
+				DROP();
+				double a = AS_NUMBER(sp[-1]);
 				double quotient = a / b;
-				push(NUMBER_VAL(quotient));
-				break;
+				sp[-1] = NUMBER_VAL(quotient);
+				DISPATCH();
 			}
-			case OP_NEGATE:
+			CASE(OP_NEGATE)
 			{
-				// type check
-				if (!IS_NUMBER(peek(0)))
+				if (isNegatableInt(PEEK(0)))
 				{
-					runtimeError("Operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
+					sp[-1] = INT_VAL(-AS_INT(sp[-1]));
+					DISPATCH();
 				}
 
-				uint32_t top = vm.stack.count - 1;
-				vm.stack.values[top] = NUMBER_VAL(-AS_NUMBER(vm.stack.values[top])); // challenge: avoid push/pop for unary op
-				break;
+				// type check
+				if (!IS_NUMBER(PEEK(0)))
+					RUNTIME_ERROR("Operand must be a number.");
+
+				sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1])); // challenge: avoid push/pop for unary op
+				DISPATCH();
 			}
-			case OP_JUMP_IF_FALSE:
+			CASE(OP_JUMP_IF_FALSE)
 			{
 				uint16_t offset = READ_16(); // always consume args
-				if (isFalsey(peek(0)))
-					frame->ip += offset;
-				break;
+				if (isFalsey(PEEK(0)))
+					ip += offset;
+				DISPATCH();
 			}
-			case OP_JUMP:
+			CASE(OP_JUMP)
 			{
 				uint16_t offset = READ_16();
-				frame->ip += offset;
-				break;
+				ip += offset;
+				DISPATCH();
 			}
-			case OP_LOOP:
+			CASE(OP_LOOP)
 			{
 				uint16_t offset = READ_16();
-				frame->ip -= offset;
-				break;
+				ip -= offset;
+				ENTER_TRACE();
+				ENTER_JIT();
+				DISPATCH();
 			}
-			case OP_CALL:
+			CASE(OP_CALL)
 			{
 				uint8_t argCount = READ_BYTE();
-				if (!callValue(peek(argCount), argCount))
+				Value callee = PEEK(argCount);
+				SAVE_STATE();
+
+				// natives are leaves: no frame, the result lands where the callee was
+				if (IS_NATIVE(callee))
+				{
+					if (!callNative(AS_NATIVE(callee), argCount, sp - argCount))
+						return INTERPRET_RUNTIME_ERROR;
+					sp -= argCount;
+					ENTER_JIT();
+					DISPATCH();
+				}
+
+				if (!callValue(callee, argCount))
 					return INTERPRET_RUNTIME_ERROR;
-				frame = currentCallFrame(); // reset base pointer
-				break;
+				LOAD_STATE(); // switch to callee
+				ENTER_JIT();
+				DISPATCH();
 			}
-			case OP_INVOKE:
+			CASE(OP_TAIL_CALL)
+			{
+				uint8_t argCount = READ_BYTE();
+				Value callee = PEEK(argCount);
+
+				// anything else is called as usual, the OP_RETURN after this hands back
+				// its result. a wrong argument count is reported from this frame too.
+				if (!IS_CLOSURE(callee) || AS_CLOSURE(callee)->function->arity != argCount)
+				{
+					SAVE_STATE();
+					if (!callValue(callee, argCount))
+						return INTERPRET_RUNTIME_ERROR;
+					LOAD_STATE();
+					ENTER_JIT();
+					DISPATCH();
+				}
+
+				// the callee takes over this frame. whatever captured the caller's locals
+				// is closed before the callee and arguments slide down over them.
+				closeUpvalues(slots);
+				memmove(slots, sp - argCount - 1, sizeof(Value) * (argCount + 1));
+				sp = slots + argCount + 1;
+				popCallFrame(); // call() pushes the same frame again
+				SAVE_STATE();
+				if (!call(AS_CLOSURE(callee), argCount))
+					return INTERPRET_RUNTIME_ERROR;
+				LOAD_STATE();
+				ENTER_JIT();
+				DISPATCH();
+			}
+			CASE(OP_INVOKE)
 			{
 				// get operands
 				ObjectString* method = READ_STRING();
 				uint8_t argCount = READ_BYTE();
+				InlineCache* cache = READ_CACHE();
+				Value receiver = PEEK(argCount);
+				SAVE_STATE();
+
+				// cached method skips both the field and the method table
+				if (IS_INSTANCE(receiver))
+				{
+					InlineCacheEntry* entry = findInlineCacheEntry(cache,
+						AS_INSTANCE(receiver)->shape);
+					if (entry != NULL && entry->method != NULL)
+					{
+						if (!call(entry->method, argCount))
+							return INTERPRET_RUNTIME_ERROR;
+
+						LOAD_STATE(); // switch to callee
+						ENTER_JIT();
+						DISPATCH();
+					}
+				}
 
 				// invoke method with args
-				if (!invoke(method, argCount))
+				if (!invoke(method, argCount, cache))
 					return INTERPRET_RUNTIME_ERROR;
 
-				// reset base pointer
-				frame = currentCallFrame();
-
-				break;
+				LOAD_STATE(); // switch to callee
+				ENTER_JIT();
+				DISPATCH();
 			}
-			case OP_SUPER_INVOKE:
+			CASE(OP_SUPER_INVOKE)
 			{
 				// get operands
-				ObjectString* method = READ_STRING();
+				ObjectString* name = READ_STRING();
 				uint8_t argCount = READ_BYTE();
-				ObjectClass* superclass = AS_CLASS(pop());
+				InlineCache* cache = READ_CACHE();
+				ObjectClass* superclass = AS_CLASS(POP());
 
-				if (!invokeFromClass(superclass, method, argCount))
+				SAVE_STATE();
+				ObjectClosure* method = findSuperMethod(superclass, name, cache);
+
+				// arguments are already on the stack where they belong
+				if (method == NULL || !call(method, argCount))
 					return INTERPRET_RUNTIME_ERROR;
 
-				frame = currentCallFrame(); // reset base pointer
-				break;
+				LOAD_STATE(); // switch to callee
+				ENTER_JIT();
+				DISPATCH();
 			}
-			case OP_CLOSURE:
-			case OP_CLOSURE_LONG:
+			CASE(OP_CLOSURE)
+			CASE(OP_CLOSURE_LONG)
 			{
 				bool isLong = operation == OP_CLOSURE_LONG;
 				ObjectFunction* function = isLong
 					? AS_FUNCTION(READ_CONSTANT_LONG())
 					: AS_FUNCTION(READ_CONSTANT());
+				SAVE_STATE();
 				ObjectClosure* closure = newClosure(function);
-				push(OBJECT_VAL(closure));
+				PUSH(OBJECT_VAL(closure));
+				SAVE_STATE(); // keep closure reachable while upvalues are allocated
 
 				// handle upvalues
 				for (uint32_t i = 0; i < closure->upvalueCount; ++i)
@@ -694,110 +1406,779 @@ static InterpretResult run()
 					uint8_t isLocal = READ_BYTE();
 					uint8_t index = READ_BYTE();
 					if (isLocal)
-						closure->upvalues[i] = captureUpvalue(frame->slots + index);
+						closure->upvalues[i] = captureUpvalue(slots + index);
 					else // is already captured
 						closure->upvalues[i] = frame->closure->upvalues[index];
 				}
-				break;
+				DISPATCH();
 			}
-			case OP_PRINT:
+			CASE(OP_PRINT)
 			{
-				printValue(pop());
+				printValue(POP());
 				printf("\n");
-				break;
+				DISPATCH();
 			}
-			case OP_CLOSE_UPVALUE:
+			CASE(OP_CLOSE_UPVALUE)
 			{
-				closeUpvalues(&vm.stack.values[vm.stack.count - 1]);
-				pop();
-				break;
+				closeUpvalueSlot(sp - 1);
+				DROP();
+				DISPATCH();
 			}
-			case OP_RETURN:
+			CASE(OP_RETURN)
 			{
-				Value result = pop(); // the return value
-				closeUpvalues(frame->slots); // close function's params and locals
-				uint32_t count = --vm.frameCount; // pop callstack
+				Value result = POP(); // the return value
+				closeUpvalues(slots); // close function's params and locals
+				CallFrame* caller = popCallFrame(); // pop callstack
 
 				// is program complete
-				if (count == 0)
+				if (caller == NULL)
 				{
-					pop(); // pop <script>
-					if (IS_BOOL(result))
-					{
-						// 'true' indicates 'success' and 'false' indicates 'failure'.
-						vm.exitCode = AS_BOOL(result) ? 0 : -1;
-					}
-					else if (IS_NUMBER(result))
-					{
-						// assumes cast will work
-						vm.exitCode = (uint64_t)AS_NUMBER(result);
-					}
-					else if (IS_NIL(result))
-					{
-						// normal exit (possibly an early-exit)
-						vm.exitCode = 0;
-					}
-					// TODO - return a string through stdout?
-					else
-					{
-						runtimeError("Can only return number, nil, or bool.");
-						return INTERPRET_RUNTIME_ERROR;
-					}
-					return INTERPRET_OK; // exit
+					DROP(); // pop <script>
+					vm.sp = sp;
+					return exitScript(result);
 				}
 
 				// deallocate locals, args, function name
-				//uint32_t locals = (&vm.stack.values[vm.stack.count] - frame->slots);
-				vm.stack.count -= vm.stack.count - frame->stackOffset;
-				//vm.stack.count -= locals;
+				sp = slots;
 
 				// return statement
-				push(result); // set return value
-				frame = &vm.callStack[count - 1]; // restore previous base pointer
-				break;
+				PUSH(result); // set return value
+
+				// restore caller's registers
+				frame = caller;
+				ip = frame->ip;
+				slots = frame->slots;
+				ENTER_JIT();
+				DISPATCH();
 			}
 
 			// classes
-			case OP_CLASS:
-				push(OBJECT_VAL(newClass(READ_STRING()))); break;
-			case OP_INHERIT:
+			CASE(OP_CLASS)
 			{
-				Value superclass = peek(1);
+				ObjectString* name = READ_STRING();
+				SAVE_STATE();
+				PUSH(OBJECT_VAL(newClass(name)));
+				DISPATCH();
+			}
+			CASE(OP_INHERIT)
+			{
+				Value superclass = PEEK(1);
 
 				// verify self-respecting user code
 				if (!IS_CLASS(superclass))
+					RUNTIME_ERROR("Can only inherit from a class.");
+
+				ObjectClass* subclass = AS_CLASS(PEEK(0));
+
+				SAVE_STATE();
+				inherit(AS_CLASS(superclass), subclass);
+
+				DROP(); // subclass
+				DISPATCH();
+			}
+			CASE(OP_METHOD)
+			CASE(OP_METHOD_LONG)
+			{
+				bool isLong = operation == OP_METHOD_LONG;
+				ObjectString* name = isLong ? READ_STRING_LONG() : READ_STRING();
+				SAVE_STATE();
+				defineMethod(name);
+				LOAD_STATE();
+				DISPATCH();
+			}
+
+			// superinstructions
+			CASE(OP_GET_LOCAL_LOCAL)
+			{
+				uint8_t first = READ_BYTE();
+				uint8_t second = READ_BYTE();
+				PUSH(slots[first]);
+				PUSH(slots[second]);
+				DISPATCH();
+			}
+			CASE(OP_GET_LOCAL_CONSTANT)
+			{
+				uint8_t slot = READ_BYTE();
+				PUSH(slots[slot]);
+				PUSH(READ_CONSTANT());
+				DISPATCH();
+			}
+			CASE(OP_SET_LOCAL_POP)
+			{
+				uint8_t slot = READ_BYTE();
+				slots[slot] = POP();
+				DISPATCH();
+			}
+			CASE(OP_POP_JUMP_IF_FALSE)
+			{
+				uint16_t offset = READ_16();
+				if (isFalsey(POP()))
+					ip += offset;
+				DISPATCH();
+			}
+			CASE(OP_JUMP_IF_NOT_LESS) BRANCH_UNLESS(<); DISPATCH();
+			CASE(OP_JUMP_IF_NOT_GREATER) BRANCH_UNLESS(>); DISPATCH();
+			CASE(OP_POP_LOOP)
+			{
+				uint16_t offset = READ_16();
+				DROP();
+				ip -= offset;
+				ENTER_TRACE();
+				ENTER_JIT();
+				DISPATCH();
+			}
+
+			default:
+#ifdef COMPUTED_GOTO
+			unknownOpcode:
+#endif
+				RUNTIME_ERROR("Opcode not accounted for!");
+		}
+	}
+
+#undef DISPATCH
+#undef CASE
+#undef PROFILE_OPCODE
+#undef TRACE_EXECUTION
+#undef ENTER_JIT
+#undef ENTER_TRACE
+#undef BRANCH_UNLESS
+#undef BINARY_OP
+#undef RUNTIME_ERROR
+#undef LOAD_STATE
+#undef SAVE_STATE
+#undef PEEK
+#undef POP
+#undef DROP
+#undef PUSH
+#undef READ_CACHE
+#undef READ_STRING_LONG
+#undef READ_STRING
+#undef READ_CONSTANT_LONG
+#undef READ_CONSTANT
+#undef READ_32
+#undef READ_24
+#undef READ_16
+#undef READ_BYTE
+}
+
+/// <summary>
+/// Set up the frame call() just pushed for the register engine.
+/// </summary>
+static void enterRegisterFrame(CallFrame* frame)
+{
+	ObjectFunction* function = frame->closure->function; // fetch once
+	frame->pc = function->registerChunk.code;
+	frame->savedTop = vm.frameTop;
+
+	// the GC marks every slot below frameTop, so slots it didn't cover
+	// before may hold anything and are cleared first
+	Value* top = frame->slots + function->maxStack - 1; // minus the parking slot
+	Value* slot = frame->slots + function->arity + 1; // callee and arguments are set
+	if (slot < vm.frameTop)
+		slot = vm.frameTop;
+	for (; slot < top; ++slot)
+		*slot = NIL_VAL;
+	if (top > vm.frameTop)
+		vm.frameTop = top;
+
+	vm.sp = vm.frameTop; // pushes from the runtime go above every frame
+}
+
+/// <summary>
+/// Dispatch loop of the register engine. Same frames, objects and GC as run(),
+/// but instructions name their operands as frame slots, so there's no pushing
+/// or popping and a statement like 'a = b + c' is one dispatch.
+/// Between instructions vm.sp sits at vm.frameTop.
+/// </summary>
+static InterpretResult runRegister()
+{
+	CallFrame* frame = currentCallFrame();
+	register Instruction* pc = frame->pc; // instruction pointer
+	register Value* slots = frame->slots; // frame pointer
+	Instruction instruction = 0; // being executed
+
+#define READ_WORD() (*(pc++))
+#define READ_CONSTANT(index) (frame->closure->function->chunk.constants.values[index])
+#define READ_STRING() AS_STRING(READ_CONSTANT(READ_WORD()))
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_WORD()])
+#define RA (slots[DECODE_A(instruction)])
+#define RB (slots[DECODE_B(instruction)])
+#define RC (slots[DECODE_C(instruction)])
+
+// write registers back before calls and errors
+#define SAVE_STATE() do { frame->pc = pc; } while (false)
+
+// reload registers after anything that may have changed frames
+#define LOAD_STATE() do \
+{ \
+	frame = currentCallFrame(); \
+	pc = frame->pc; \
+	slots = frame->slots; \
+} while (false)
+
+#define RUNTIME_ERROR(...) do \
+{ \
+	SAVE_STATE(); \
+	runtimeError(__VA_ARGS__); \
+	return INTERPRET_RUNTIME_ERROR; \
+} while (false)
+
+// after call() or callValue(): a pushed frame gets set up, anything
+// else has already left its result in the callee's slot
+#define ENTER_CALLEE() do \
+{ \
+	if (currentCallFrame() != frame) \
+		enterRegisterFrame(currentCallFrame()); \
+	else \
+		vm.sp = vm.frameTop; \
+	LOAD_STATE(); \
+} while (false)
+
+// same order of cases as in run()
+#define BINARY_OP(valueType, intType, op) do \
+{ \
+	Value b = RC; \
+	Value a = RB; \
+	if (IS_DOUBLE(a) && IS_DOUBLE(b)) \
+		RA = valueType(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+	else if (IS_INT_PAIR(a, b)) \
+		RA = intType((int64_t)AS_INT(a) op AS_INT(b)); \
+	else if (IS_NUMBER(a) && IS_NUMBER(b)) \
+		RA = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+	else if (!IS_NUMBER(b)) \
+		RUNTIME_ERROR("Right-hand operand must be a number."); \
+	else \
+		RUNTIME_ERROR("Left-hand operand must be a number."); \
+} while (false)
+
+#define BRANCH_UNLESS(op) do \
+{ \
+	int32_t offset = (int32_t)READ_WORD(); \
+	Value b = RB; \
+	Value a = RA; \
+	bool isTrue; \
+	if (IS_DOUBLE(a) && IS_DOUBLE(b)) \
+		isTrue = AS_DOUBLE(a) op AS_DOUBLE(b); \
+	else if (IS_INT_PAIR(a, b)) \
+		isTrue = AS_INT(a) op AS_INT(b); \
+	else if (IS_NUMBER(a) && IS_NUMBER(b)) \
+		isTrue = AS_NUMBER(a) op AS_NUMBER(b); \
+	else if (!IS_NUMBER(b)) \
+		RUNTIME_ERROR("Right-hand operand must be a number."); \
+	else \
+		RUNTIME_ERROR("Left-hand operand must be a number."); \
+	if (!isTrue) \
+		pc += offset; \
+} while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() do \
+{ \
+	ObjectFunction* function = frame->closure->function; \
+	printf("        "); \
+	for (Value* slot = slots; slot < slots + function->maxStack - 1; ++slot) \
+	{ \
+		printf("[ "); \
+		printValue(*slot); \
+		printf(" ]"); \
+	} \
+	disassembleRegisterInstruction(function, \
+		(uint32_t)(pc - function->registerChunk.code)); \
+} while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#ifdef DEBUG_PROFILE_OPCODES
+#define PROFILE_OPCODE() (++dispatchCount)
+#else
+#define PROFILE_OPCODE() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+	static void* dispatchTable[UINT8_COUNT] =
+	{
+		[0 ... UINT8_MAX] = &&unknownOpcode, // fill gaps first
+		[ROP_MOVE] = &&ROP_MOVE_HANDLER,
+		[ROP_CONSTANT] = &&ROP_CONSTANT_HANDLER,
+		[ROP_CONSTANT_LONG] = &&ROP_CONSTANT_LONG_HANDLER,
+		[ROP_NIL] = &&ROP_NIL_HANDLER,
+		[ROP_TRUE] = &&ROP_TRUE_HANDLER,
+		[ROP_FALSE] = &&ROP_FALSE_HANDLER,
+		[ROP_DEFINE_GLOBAL] = &&ROP_DEFINE_GLOBAL_HANDLER,
+		[ROP_GET_GLOBAL] = &&ROP_GET_GLOBAL_HANDLER,
+		[ROP_SET_GLOBAL] = &&ROP_SET_GLOBAL_HANDLER,
+		[ROP_GET_UPVALUE] = &&ROP_GET_UPVALUE_HANDLER,
+		[ROP_SET_UPVALUE] = &&ROP_SET_UPVALUE_HANDLER,
+		[ROP_GET_PROPERTY] = &&ROP_GET_PROPERTY_HANDLER,
+		[ROP_SET_PROPERTY] = &&ROP_SET_PROPERTY_HANDLER,
+		[ROP_GET_SUPER] = &&ROP_GET_SUPER_HANDLER,
+		[ROP_EQUAL] = &&ROP_EQUAL_HANDLER,
+		[ROP_GREATER] = &&ROP_GREATER_HANDLER,
+		[ROP_LESS] = &&ROP_LESS_HANDLER,
+		[ROP_ADD] = &&ROP_ADD_HANDLER,
+		[ROP_SUBTRACT] = &&ROP_SUBTRACT_HANDLER,
+		[ROP_MULTIPLY] = &&ROP_MULTIPLY_HANDLER,
+		[ROP_DIVIDE] = &&ROP_DIVIDE_HANDLER,
+		[ROP_NOT] = &&ROP_NOT_HANDLER,
+		[ROP_NEGATE] = &&ROP_NEGATE_HANDLER,
+		[ROP_JUMP] = &&ROP_JUMP_HANDLER,
+		[ROP_JUMP_IF_FALSE] = &&ROP_JUMP_IF_FALSE_HANDLER,
+		[ROP_JUMP_IF_NOT_LESS] = &&ROP_JUMP_IF_NOT_LESS_HANDLER,
+		[ROP_JUMP_IF_NOT_GREATER] = &&ROP_JUMP_IF_NOT_GREATER_HANDLER,
+		[ROP_CALL] = &&ROP_CALL_HANDLER,
+		[ROP_TAIL_CALL] = &&ROP_TAIL_CALL_HANDLER,
+		[ROP_INVOKE] = &&ROP_INVOKE_HANDLER,
+		[ROP_SUPER_INVOKE] = &&ROP_SUPER_INVOKE_HANDLER,
+		[ROP_CLOSURE] = &&ROP_CLOSURE_HANDLER,
+		[ROP_CLOSE_UPVALUE] = &&ROP_CLOSE_UPVALUE_HANDLER,
+		[ROP_PRINT] = &&ROP_PRINT_HANDLER,
+		[ROP_RETURN] = &&ROP_RETURN_HANDLER,
+		[ROP_CLASS] = &&ROP_CLASS_HANDLER,
+		[ROP_INHERIT] = &&ROP_INHERIT_HANDLER,
+		[ROP_METHOD] = &&ROP_METHOD_HANDLER,
+	};
+
+#define CASE(op) case op: op##_HANDLER:
+#define DISPATCH() do \
+{ \
+	PROFILE_OPCODE(); \
+	TRACE_EXECUTION(); \
+	instruction = READ_WORD(); \
+	goto *dispatchTable[DECODE_OP(instruction)]; \
+} while (false)
+#else
+#define CASE(op) case op:
+#define DISPATCH() continue // back to the top of the loop
+#endif
+
+	while (1)
+	{
+		PROFILE_OPCODE();
+		TRACE_EXECUTION();
+
+		// decode instruction
+		instruction = READ_WORD();
+		switch (DECODE_OP(instruction))
+		{
+			CASE(ROP_MOVE) RA = RB; DISPATCH();
+			CASE(ROP_CONSTANT) RA = READ_CONSTANT(DECODE_BX(instruction)); DISPATCH();
+			CASE(ROP_CONSTANT_LONG) RA = READ_CONSTANT(READ_WORD()); DISPATCH();
+			CASE(ROP_NIL) RA = NIL_VAL; DISPATCH();
+			CASE(ROP_TRUE) RA = BOOL_VAL(true); DISPATCH();
+			CASE(ROP_FALSE) RA = BOOL_VAL(false); DISPATCH();
+
+			// variable accessors
+			CASE(ROP_DEFINE_GLOBAL)
+				vm.globalValues.values[READ_WORD()] = RA; // can easily redefine globals
+				DISPATCH();
+			CASE(ROP_GET_GLOBAL)
+			{
+				uint32_t slot = READ_WORD();
+				Value value = vm.globalValues.values[slot];
+				if (IS_UNDEFINED(value))
+					RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+				RA = value;
+				DISPATCH();
+			}
+			CASE(ROP_SET_GLOBAL)
+			{
+				uint32_t slot = READ_WORD();
+				Value* global = &vm.globalValues.values[slot];
+
+				// assignment doesn't declare
+				if (IS_UNDEFINED(*global))
+					RUNTIME_ERROR("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+				*global = RA;
+				DISPATCH();
+			}
+			CASE(ROP_GET_UPVALUE)
+				RA = *frame->closure->upvalues[DECODE_B(instruction)]->location;
+				DISPATCH();
+			CASE(ROP_SET_UPVALUE)
+				*frame->closure->upvalues[DECODE_B(instruction)]->location = RA;
+				DISPATCH();
+
+			// properties
+			CASE(ROP_GET_PROPERTY)
+			{
+				ObjectString* name = READ_STRING();
+				InlineCache* cache = READ_CACHE();
+				Value object = RB;
+
+				// guard against not accessing an instance
+				if (!IS_INSTANCE(object))
+					RUNTIME_ERROR("Only instances have properties.");
+
+				ObjectInstance* instance = AS_INSTANCE(object); // cast
+
+				// seen this shape here before?
+				InlineCacheEntry* entry = findInlineCacheEntry(cache, instance->shape);
+				if (entry != NULL)
+				{
+					if (entry->method != NULL)
+					{
+						SAVE_STATE();
+						RA = OBJECT_VAL(bindInstanceMethod(instance, entry->method));
+					}
+					else
+					{
+						RA = instance->fields[entry->index];
+					}
+					DISPATCH();
+				}
+
+				// search fields
+				uint32_t slot;
+				if (shapeFindField(instance->shape, name, &slot))
+				{
+					updateInlineCache(cache, instance->shape, NULL, NULL, slot);
+					RA = instance->fields[slot];
+					DISPATCH();
+				}
+
+				// search methods
+				Value method;
+				if (!tableGet(&instance->_class->methods, name, &method))
+					RUNTIME_ERROR("Undefined property '%s'.", name->chars);
+
+				updateInlineCache(cache, instance->shape, AS_CLOSURE(method), NULL, 0);
+				SAVE_STATE();
+				RA = OBJECT_VAL(bindInstanceMethod(instance, AS_CLOSURE(method)));
+				DISPATCH();
+			}
+			CASE(ROP_SET_PROPERTY)
+			{
+				ObjectString* name = READ_STRING();
+				InlineCache* cache = READ_CACHE();
+				Value object = RB;
+				Value value = RC;
+
+				// guard against not accessing an instance
+				if (!IS_INSTANCE(object))
+					RUNTIME_ERROR("Only instances have fields.");
+
+				ObjectInstance* instance = AS_INSTANCE(object);
+
+				// repeat what the last store from this shape did, if there is room for it
+				InlineCacheEntry* entry = findInlineCacheEntry(cache, instance->shape);
+				if (entry != NULL && entry->transition == NULL)
+				{
+					instance->fields[entry->index] = value;
+				}
+				else if (entry != NULL && entry->index < instance->fieldCapacity)
+				{
+					instance->fields[entry->index] = value;
+					instance->shape = entry->transition;
+				}
+				else
 				{
-					runtimeError("Can only inherit from a class.");
+					SAVE_STATE();
+					storeField(instance, name, value, cache);
+				}
+
+				RA = value; // assignment is an expression
+				DISPATCH();
+			}
+			CASE(ROP_GET_SUPER)
+			{
+				ObjectString* name = READ_STRING(); // member of super
+				InlineCache* cache = READ_CACHE();
+				ObjectClass* superclass = AS_CLASS(RC);
+				SAVE_STATE();
+
+				// 'super' always resolves to a method, since fields are not inherited
+				ObjectClosure* method = findSuperMethod(superclass, name, cache);
+				if (method == NULL)
 					return INTERPRET_RUNTIME_ERROR;
+
+				RA = OBJECT_VAL(bindInstanceMethod(AS_INSTANCE(RB), method));
+				DISPATCH();
+			}
+
+			// boolean
+			CASE(ROP_EQUAL) RA = BOOL_VAL(valuesEqual(RB, RC)); DISPATCH();
+			CASE(ROP_GREATER) BINARY_OP(BOOL_VAL, BOOL_VAL, >); DISPATCH();
+			CASE(ROP_LESS) BINARY_OP(BOOL_VAL, BOOL_VAL, <); DISPATCH();
+			CASE(ROP_NOT) RA = BOOL_VAL(isFalsey(RB)); DISPATCH();
+
+			// arithmetic
+			CASE(ROP_ADD)
+			{
+				Value b = RC;
+				Value a = RB;
+				if (IS_DOUBLE(a) && IS_DOUBLE(b))
+				{
+					RA = NUMBER_VAL(AS_DOUBLE(a) + AS_DOUBLE(b));
+				}
+				else if (IS_INT_PAIR(a, b))
+				{
+					RA = INT64_VAL((int64_t)AS_INT(a) + AS_INT(b));
+				}
+				else if (IS_NUMBER(a) && IS_NUMBER(b))
+				{
+					RA = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+				}
+				else if (IS_STRING(a) && IS_STRING(b))
+				{
+					SAVE_STATE();
+					RA = OBJECT_VAL(concatenate(AS_STRING(a), AS_STRING(b)));
+				}
+				else
+				{
+					RUNTIME_ERROR("Operands must be two numbers or two strings.");
+				}
+				DISPATCH();
+			}
+			CASE(ROP_SUBTRACT) BINARY_OP(NUMBER_VAL, INT64_VAL, -); DISPATCH();
+			CASE(ROP_MULTIPLY)
+			{
+				if (IS_INT_PAIR(RB, RC))
+				{
+					RA = multiplyInts(AS_INT(RB), AS_INT(RC));
+					DISPATCH();
+				}
+				BINARY_OP(NUMBER_VAL, INT64_VAL, *);
+				DISPATCH();
+			}
+			CASE(ROP_DIVIDE)
+			{
+				Value b = RC;
+				Value a = RB;
+				if (!IS_NUMBER(b))
+					RUNTIME_ERROR("Right-hand operand must be a number.");
+				else if (!IS_NUMBER(a))
+					RUNTIME_ERROR("Left-hand operand must be a number.");
+
+				if (AS_NUMBER(b) == 0) // div 0
+					RUNTIME_ERROR("Divide by zero.");
+
+				RA = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+				DISPATCH();
+			}
+			CASE(ROP_NEGATE)
+			{
+				if (isNegatableInt(RB))
+				{
+					RA = INT_VAL(-AS_INT(RB));
+					DISPATCH();
 				}
 
-				ObjectClass* subclass = AS_CLASS(peek(0));
+				// type check
+				if (!IS_NUMBER(RB))
+					RUNTIME_ERROR("Operand must be a number.");
 
-				// copy-down inheritance
-				copyTable(&AS_CLASS(superclass)->methods,
-					&subclass->methods);
+				RA = NUMBER_VAL(-AS_NUMBER(RB));
+				DISPATCH();
+			}
 
-				pop(); // subclass
-				break;
+			// control flow
+			CASE(ROP_JUMP)
+			{
+				int32_t offset = (int32_t)READ_WORD();
+				pc += offset;
+				DISPATCH();
+			}
+			CASE(ROP_JUMP_IF_FALSE)
+			{
+				int32_t offset = (int32_t)READ_WORD(); // always consume args
+				if (isFalsey(RA))
+					pc += offset;
+				DISPATCH();
 			}
-			case OP_METHOD: defineMethod(READ_STRING()); break;
-			case OP_METHOD_LONG: defineMethod(READ_STRING_LONG()); break;
+			CASE(ROP_JUMP_IF_NOT_LESS) BRANCH_UNLESS(<); DISPATCH();
+			CASE(ROP_JUMP_IF_NOT_GREATER) BRANCH_UNLESS(>); DISPATCH();
+			CASE(ROP_CALL)
+			{
+				uint8_t argCount = DECODE_B(instruction);
+				Value* callee = &RA;
+				SAVE_STATE();
 
-			default:
+				// natives write their result straight into A, vm.sp stays above the frame
+				if (IS_NATIVE(*callee))
+				{
+					if (!callNative(AS_NATIVE(*callee), argCount, callee + 1))
+						return INTERPRET_RUNTIME_ERROR;
+					DISPATCH();
+				}
+
+				vm.sp = callee + argCount + 1; // where call() looks for the arguments
+				if (!callValue(*callee, argCount))
+					return INTERPRET_RUNTIME_ERROR;
+				ENTER_CALLEE();
+				DISPATCH();
+			}
+			CASE(ROP_TAIL_CALL)
+			{
+				uint8_t argCount = DECODE_B(instruction);
+				Value* callee = &RA;
+				SAVE_STATE();
+				if (!IS_CLOSURE(*callee) || AS_CLOSURE(*callee)->function->arity != argCount)
+				{
+					vm.sp = callee + argCount + 1;
+					if (!callValue(*callee, argCount))
+						return INTERPRET_RUNTIME_ERROR;
+					ENTER_CALLEE();
+					DISPATCH();
+				}
+
+				// like ROP_RETURN up to the callee taking over the frame, as in run()
+				closeUpvalues(slots);
+				memmove(slots, callee, sizeof(Value) * (argCount + 1));
+				popCallFrame();
+				vm.frameTop = frame->savedTop;
+				vm.sp = slots + argCount + 1;
+				if (!call(AS_CLOSURE(*slots), argCount))
+					return INTERPRET_RUNTIME_ERROR;
+				enterRegisterFrame(currentCallFrame());
+				LOAD_STATE();
+				DISPATCH();
+			}
+			CASE(ROP_INVOKE)
+			{
+				// get operands
+				ObjectString* method = READ_STRING();
+				InlineCache* cache = READ_CACHE();
+				uint8_t argCount = DECODE_B(instruction);
+				Value* receiver = &RA;
+				SAVE_STATE();
+				vm.sp = receiver + argCount + 1;
+
+				// cached method skips both the field and the method table
+				InlineCacheEntry* entry = IS_INSTANCE(*receiver)
+					? findInlineCacheEntry(cache, AS_INSTANCE(*receiver)->shape)
+					: NULL;
+				if (entry != NULL && entry->method != NULL)
+				{
+					if (!call(entry->method, argCount))
+						return INTERPRET_RUNTIME_ERROR;
+				}
+				else if (!invoke(method, argCount, cache))
+				{
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				ENTER_CALLEE();
+				DISPATCH();
+			}
+			CASE(ROP_SUPER_INVOKE)
 			{
-				runtimeError("Opcode not accounted for!");
-				return INTERPRET_RUNTIME_ERROR;
+				ObjectString* name = READ_STRING();
+				uint8_t argCount = DECODE_B(instruction);
+				InlineCache* cache = READ_CACHE();
+				ObjectClass* superclass = AS_CLASS(RC);
+				SAVE_STATE();
+				vm.sp = &RA + argCount + 1;
+				ObjectClosure* method = findSuperMethod(superclass, name, cache);
+				if (method == NULL || !call(method, argCount))
+					return INTERPRET_RUNTIME_ERROR;
+				ENTER_CALLEE();
+				DISPATCH();
 			}
+			CASE(ROP_CLOSURE)
+			{
+				ObjectFunction* function = AS_FUNCTION(READ_CONSTANT(READ_WORD()));
+				SAVE_STATE();
+				ObjectClosure* closure = newClosure(function);
+				RA = OBJECT_VAL(closure); // keep closure reachable while upvalues are allocated
+
+				// handle upvalues
+				for (uint32_t i = 0; i < closure->upvalueCount; ++i)
+				{
+					Instruction upvalue = READ_WORD();
+					uint8_t isLocal = upvalue & 0xff;
+					uint8_t index = (uint8_t)(upvalue >> 8);
+					if (isLocal)
+						closure->upvalues[i] = captureUpvalue(slots + index);
+					else // is already captured
+						closure->upvalues[i] = frame->closure->upvalues[index];
+				}
+				DISPATCH();
+			}
+			CASE(ROP_CLOSE_UPVALUE) closeUpvalueSlot(&RA); DISPATCH();
+			CASE(ROP_PRINT)
+			{
+				printValue(RA);
+				printf("\n");
+				DISPATCH();
+			}
+			CASE(ROP_RETURN)
+			{
+				Value result = RA;
+				closeUpvalues(slots); // close function's params and locals
+				CallFrame* caller = popCallFrame(); // pop callstack
+				vm.frameTop = frame->savedTop;
+
+				// is program complete
+				if (caller == NULL)
+				{
+					vm.sp = slots; // pop <script>
+					return exitScript(result);
+				}
+
+				*slots = result; // replaces the callee in the caller's frame
+				vm.sp = vm.frameTop;
+
+				// restore caller's registers
+				frame = caller;
+				pc = frame->pc;
+				slots = frame->slots;
+				DISPATCH();
+			}
+
+			// classes
+			CASE(ROP_CLASS)
+			{
+				ObjectString* name = READ_STRING();
+				SAVE_STATE();
+				RA = OBJECT_VAL(newClass(name));
+				DISPATCH();
+			}
+			CASE(ROP_INHERIT)
+			{
+				Value superclass = RA;
+
+				// verify self-respecting user code
+				if (!IS_CLASS(superclass))
+					RUNTIME_ERROR("Can only inherit from a class.");
+
+				SAVE_STATE();
+				inherit(AS_CLASS(superclass), AS_CLASS(RB));
+				DISPATCH();
+			}
+			CASE(ROP_METHOD)
+			{
+				ObjectString* name = READ_STRING();
+				SAVE_STATE();
+				addMethod(AS_CLASS(RA), name, RB);
+				DISPATCH();
+			}
+
+			default:
+#ifdef COMPUTED_GOTO
+			unknownOpcode:
+#endif
+				RUNTIME_ERROR("Opcode not accounted for!");
 		}
 	}
 
+#undef DISPATCH
+#undef CASE
+#undef PROFILE_OPCODE
+#undef TRACE_EXECUTION
+#undef BRANCH_UNLESS
 #undef BINARY_OP
+#undef ENTER_CALLEE
+#undef RUNTIME_ERROR
+#undef LOAD_STATE
+#undef SAVE_STATE
+#undef RC
+#undef RB
+#undef RA
+#undef READ_CACHE
 #undef READ_STRING
-#undef READ_CONSTANT_LONG
 #undef READ_CONSTANT
-#undef READ_LONG
-#undef READ_SHORT
-#undef READ_BYTE
+#undef READ_WORD
 }
 
 InterpretResult interpret(const char* source)
@@ -813,5 +2194,10 @@ InterpretResult interpret(const char* source)
 	push(OBJECT_VAL(closure));
 	call(closure, 0); // main()
 
+	if (vm.engine == ENGINE_REGISTER)
+	{
+		enterRegisterFrame(currentCallFrame());
+		return runRegister();
+	}
 	return run();
 }
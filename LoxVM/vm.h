@@ -5,12 +5,21 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
+// call frames live in segments that are added as calls nest deeper: the first holds
+// FRAMES_SEGMENT frames and every further one twice as many as the one before.
+// vm.framesMax caps the depth, FRAMES_MAX unless the command line says otherwise.
+#define FRAMES_SEGMENT 64
+#define FRAMES_MAX 65536 // (1 << 16)
+
+// a runtime error's stack trace shows this many innermost and outermost frames,
+// the ones in between of a deeper stack are only counted
+#define STACK_TRACE_FRAMES 16
 
 #define INIT_STRING "init"
 #define INIT_STRING_LENGTH  4
 
-#define STACK_DEFAULT (FRAMES_MAX * 256)
+#define STACK_DEFAULT 1048576 // (1 << 20) values, backed by the OS as they are touched
+#define GLOBALS_MAX 16777216 // (1 << 24)
 
 typedef struct
 {
@@ -19,10 +28,19 @@ typedef struct
 	/// </summary>
 	ObjectClosure* closure;
 
-	/// <summary>
-	/// 
-	/// </summary>
-	uint8_t* ip; // return address
+	union
+	{
+		/// <summary>
+		/// 
+		/// </summary>
+		uint8_t* ip; // return address
+
+		/// <summary>
+		/// Return address in the register engine.
+		/// Only one engine runs per VM, so it shares the word with 'ip'.
+		/// </summary>
+		Instruction* pc;
+	};
 
 	/// <summary>
 	/// Frame pointer. Points to top (uninitialized memory).
@@ -30,45 +48,143 @@ typedef struct
 	Value* slots; // frame pointer locals and args?
 
 	/// <summary>
-	/// The stack pointer when the function is called, to be restored
-	/// when function exits to deallocate the stack.
+	/// Register engine: vm.frameTop to restore when this frame returns.
 	/// </summary>
-	uint32_t stackOffset;
+	Value* savedTop;
 } CallFrame;
 
-typedef struct
+/// <summary>
+/// A block of call frames. Frames never move once their segment exists,
+/// so run() can keep pointers to them.
+/// </summary>
+typedef struct FrameSegment
+{
+	struct FrameSegment* previous;
+
+	/// <summary>
+	/// Kept after the frames in it return, to be reused by the next deep call.
+	/// </summary>
+	struct FrameSegment* next;
+
+	uint32_t capacity;
+	CallFrame frames[];
+} FrameSegment;
+
+typedef enum
+{
+	/// <summary>
+	/// Run Chunk code in run(). The default.
+	/// </summary>
+	ENGINE_STACK,
+
+	/// <summary>
+	/// Run RegisterChunk code in runRegister().
+	/// </summary>
+	ENGINE_REGISTER,
+} Engine;
+
+struct VM
 {
 	int64_t exitCode;
 
-	CallFrame callStack[FRAMES_MAX];
+	/// <summary>
+	/// First segment of the call stack, allocated with the value stack.
+	/// </summary>
+	FrameSegment* callStack;
+
+	/// <summary>
+	/// Segment that holds 'frame'.
+	/// </summary>
+	FrameSegment* frameSegment;
+
+	/// <summary>
+	/// Innermost active frame. Meaningless while frameCount is 0.
+	/// </summary>
+	CallFrame* frame;
+
 	uint32_t frameCount;
 
+	/// <summary>
+	/// Deepest the call stack may get before "Stack overflow.".
+	/// </summary>
+	uint32_t framesMax;
+
+	/// <summary>
+	/// Fixed block of STACK_DEFAULT values with a guard page behind it.
+	/// Never relocated, so CallFrame.slots and open upvalues stay valid.
+	/// </summary>
+	Value* stack;
+
 	/// <summary>
 	/// Points to where the next value will go.
 	/// </summary>
-	//Value* sp; // stack.count
-	ValueArray stack;
+	Value* sp;
 
 	/// <summary>
-	/// Global variables.
+	/// One past the last usable stack slot.
 	/// </summary>
-	Table globals;
+	Value* stackLimit;
+
+	/// <summary>
+	/// Register engine: end of the highest slot any active frame may read.
+	/// Everything below it holds a live value, so the GC marks up to here.
+	/// Stays at 'stack' for the stack engine.
+	/// </summary>
+	Value* frameTop;
+
+	/// <summary>
+	/// Which instruction set compile() produces and interpret() runs.
+	/// Chosen once per run, before anything is compiled.
+	/// </summary>
+	Engine engine;
+
+	/// <summary>
+	/// Global variable name -> index into globalValues (a number).
+	/// Filled in by the compiler, so bytecode only carries the index.
+	/// </summary>
+	Table globalSlots;
+
+	/// <summary>
+	/// Global variables. UNDEFINED_VAL until their definition runs.
+	/// </summary>
+	ValueArray globalValues;
+
+	/// <summary>
+	/// Name of each global slot, for error messages.
+	/// </summary>
+	ValueArray globalNames;
 
 	/// <summary>
 	/// Hash set of interned strings. 'value' is always 'nil' and meaningless.
 	/// </summary>
 	Table strings;
 
+	/// <summary>
+	/// Random per run and mixed into every string hash, so slot positions can't be predicted.
+	/// </summary>
+	uint64_t hashSeed;
+
 	/// <summary>
 	/// Cached string of 'init' for a class initializer.
 	/// </summary>
 	ObjectString* initString;
 
 	/// <summary>
-	/// Linked-list of upvalues that are still on the stack.
+	/// Bumped whenever methods are defined, which empties every inline cache.
+	/// </summary>
+	uint32_t cacheEpoch;
+
+	/// <summary>
+	/// Linked-list of upvalues that are still on the stack, most recently captured first.
+	/// Only the running frame captures, so a frame's upvalues always sit at the head.
 	/// </summary>
 	ObjectUpvalue* openUpvalues;
 
+	/// <summary>
+	/// Parallel to 'stack': the open upvalue of each slot, or NULL.
+	/// </summary>
+	ObjectUpvalue** openUpvalueSlots;
+
 	size_t bytesAllocated;
 	size_t nextGC;
 
@@ -80,7 +196,7 @@ typedef struct
 	uint32_t grayCount;
 	uint32_t grayCapacity;
 	Object** grayStack;
-} VM;
+};
 
 typedef enum
 {
@@ -92,6 +208,22 @@ typedef enum
 extern VM vm; // declare, and expose to the rest of the program
 
 void freeVM(VM* vm);
+
+/// <summary>
+/// Report a runtime error from inside a native function, which then returns false.
+/// </summary>
+bool nativeError(VM* vm, const char* format, ...);
+
+/// <summary>
+/// Index of global 'name' in vm.globalValues. Reserves an undefined slot the first time.
+/// </summary>
+uint32_t globalSlot(ObjectString* name);
+
+/// <summary>
+/// Concatenates two strings together.
+/// Both must stay reachable by the GC until it returns.
+/// </summary>
+ObjectString* concatenate(ObjectString* a, ObjectString* b);
 /// <summary>
 /// Add all the native functions that the vm offers.
 /// </summary>